@@ -32,15 +32,31 @@
 @class CK2SFTPSession;
 
 
+#define CK2SFTPDefaultReadWindow 16
+#define CK2SFTPMaximumPipelineDepth 256
+
+
 @interface CK2SFTPFileHandle : NSFileHandle
 {
   @private
     LIBSSH2_SFTP_HANDLE *_handle;
     CK2SFTPSession      *_session;
     NSString            *_path;
+    NSUInteger          _readWindow;
+    
+    NSMutableData       *_writeBuffer;
+    NSUInteger          _maximumWriteBytesInFlight;
+    
+    BOOL                _adaptsPipelineDepth;
+    BOOL                _pipelineSettled;
+    double              _bestThroughput;
+    double              _measuredThroughput;
+    unsigned long long  _sampleBytes;
+    CFAbsoluteTime      _sampleStart;
 }
 
-// Session reference & path are not compulsary, but without you won't get decent error information
+// Path is not compulsary, but without you won't get decent error information
+// The session is needed to wait upon its socket whenever libssh2 would block
 - (id)initWithSFTPHandle:(LIBSSH2_SFTP_HANDLE *)handle session:(CK2SFTPSession *)session path:(NSString *)path;
 
 - (BOOL)closeFile:(NSError **)error;
@@ -49,4 +65,51 @@
 - (NSInteger)write:(const uint8_t *)buffer maxLength:(NSUInteger)length error:(NSError **)error;
 - (NSInteger)write:(const uint8_t *)buffer maxLength:(NSUInteger)length;
 
+// Non-zero switches -writeData:error: into pipelined mode. Data is queued and handed to libssh2 as SSH_FXP_WRITE packets at increasing offsets, with acks collected as they come in; a call only blocks while more than this many bytes are unacknowledged
+// Since queued data may not have reached the server yet, errors can be reported by a later call than the one which supplied the data. -closeFile:, -synchronizeFile and any read or direct write send everything still queued first
+// Defaults to 0, meaning each -writeData:error: waits until all its data is acknowledged
+@property(nonatomic) NSUInteger maximumWriteBytesInFlight;
+- (BOOL)flushWrites:(NSError **)error;
+
+// Writes the contents of a local file, from offset to its end, at the receiver's current offset. The file is read a window at a time into one of the session's recycled buffers, so no NSData is created and memory use stays flat however big the file. Should the file be truncated meanwhile, what's left of it is sent
+// Pipelined as deep as maximumWriteBytesInFlight, or CK2SFTPDefaultReadWindow chunks if that's lower. The handler, if any, is called as data is acknowledged
+- (BOOL)writeContentsOfURL:(NSURL *)URL fromOffset:(unsigned long long)offset progressHandler:(void (^)(NSUInteger bytesWritten))handler error:(NSError **)error;
+
+// Flushes queued writes, then asks the server to commit the file to disk, if it supports fsync@openssh.com. Servers without are taken to have done their best already
+- (BOOL)synchronizeFile:(NSError **)error;
+
+
+#pragma mark Reading
+
+// Reads are pipelined: libssh2 keeps several SSH_FXP_READ requests in flight, rather than waiting a round trip per chunk
+// Returns less than length only when end of file is reached. nil upon error
+- (NSData *)readDataOfLength:(NSUInteger)length error:(NSError **)error;
+- (NSData *)readDataToEndOfFile:(NSError **)error;
+
+// Returns number of bytes read, 0 at end of file, or negative upon error
+- (NSInteger)read:(uint8_t *)buffer maxLength:(NSUInteger)length error:(NSError **)error;
+- (NSInteger)read:(uint8_t *)buffer maxLength:(NSUInteger)length;
+
+// Reads from the receiver's current offset to the end of the remote file into a local file at offset, creating it if need be. length is how much is expected: as much of that as the file system confirms it has preallocated is memory mapped a window at a time for libssh2 to read straight into, so no NSData is created. Anything else, including beyond length, goes through a recycled buffer
+// The local file is left holding just what arrived, so is trimmed if the remote file turned out shorter than expected, or the read fails. The handler, if any, is called as data arrives
+- (BOOL)readIntoFileAtURL:(NSURL *)URL offset:(unsigned long long)offset length:(unsigned long long)length progressHandler:(void (^)(NSUInteger bytesRead))handler error:(NSError **)error;
+
+// Number of CK2SFTPPreferredChunkSize read requests to keep outstanding. Defaults to CK2SFTPDefaultReadWindow
+// Raise it for high latency links; each request costs that much memory until answered
+@property(nonatomic) NSUInteger readWindow;
+
+
+#pragma mark Adaptive Pipelining
+
+// libssh2 fixes the size of each request at CK2SFTPPreferredChunkSize, so what's left to tune is how many are kept in flight
+// When YES, the receiver measures throughput as data flows, and keeps doubling readWindow or maximumWriteBytesInFlight (if non-zero), up to CK2SFTPMaximumPipelineDepth chunks, until that stops improving matters. Read those properties back to see what was settled upon. Defaults to NO
+@property(nonatomic) BOOL adaptsPipelineDepth;
+@property(nonatomic, readonly) double measuredThroughput;   // bytes per second over the most recent sample. 0 until there is one
+
+
+#pragma mark Seeking
+
+// -offsetInFile, -seekToFileOffset: and -seekToEndOfFile work as for any other file handle. Seeking sends any queued writes first, and costs no round trip; seeking to the end has to ask the server for the file's size
+- (BOOL)seekToFileOffset:(unsigned long long)offset error:(NSError **)error;
+
 @end
@@ -28,6 +28,18 @@
 
 #import "CK2SFTPSession.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+// Capability learning and flow control are private to the session
+@interface CK2SFTPSession (CK2SFTPFileHandle)
+- (void)learnCapability:(BOOL)capability forKey:(NSString *)key;
+- (void)learnCapabilityIfNeeded:(BOOL)capability forKey:(NSString *)key;
+- (void)maintainReceiveWindow;
+@end
+
 
 @implementation CK2SFTPFileHandle
 
@@ -40,6 +52,7 @@
         _handle = handle;
         _session = [session retain];
         _path = [path copy];
+        _readWindow = CK2SFTPDefaultReadWindow;
     }
     
     return self;
@@ -52,11 +65,17 @@
     BOOL result = YES;
     if (_handle)
     {
-        result = (libssh2_sftp_close(_handle) == 0);
+        // Anything still queued up has to reach the server first
+        if (![self flushWrites:error]) return NO;
+        
+        result = (CK2SFTPRetry(_session, libssh2_sftp_close(_handle)) == 0);
         
         if (result)
         {
             _handle = NULL;
+            
+            // Writes may well have changed the file's size etc.
+            [_session invalidateCachedMetadataForPath:_path];
             [_session release]; _session = nil;
         }
         else if (error)
@@ -74,6 +93,7 @@
     [_session release]; _session = nil; // just in case closing failed
     
     [_path release];
+    [_writeBuffer release];
     
     [super dealloc];
 }
@@ -89,6 +109,16 @@
 
 - (BOOL)writeData:(NSData *)data error:(NSError **)error;
 {
+    if (_maximumWriteBytesInFlight)
+    {
+        // Queue up the data, only blocking for acks once there's more than the budget outstanding
+        if (!_writeBuffer) _writeBuffer = [[NSMutableData alloc] initWithCapacity:_maximumWriteBytesInFlight];
+        [_writeBuffer appendData:data];
+        
+        return [self sendWriteBufferWhileExceedingLength:(_maximumWriteBytesInFlight - 1) error:error];
+    }
+    
+    
     NSUInteger offset = 0;
     NSUInteger remainder = [data length];
     
@@ -119,7 +149,519 @@
 
 - (NSInteger)write:(const uint8_t *)buffer maxLength:(NSUInteger)length;
 {
-    return libssh2_sftp_write(_handle, (const char *)buffer, length);
+    // Writing directly mustn't overtake anything queued
+    if (![self flushWrites:NULL]) return -1;
+    
+    return CK2SFTPRetry(_session, libssh2_sftp_write(_handle, (const char *)buffer, length));
+}
+
+#pragma mark Pipelined Writing
+
+- (BOOL)sendWriteBufferWhileExceedingLength:(NSUInteger)length error:(NSError **)error;
+{
+    // libssh2 expects to be handed the same unacknowledged bytes on each call. It sends whatever of them isn't yet in flight, and returns how many have now been acknowledged
+    while ([_writeBuffer length] > length)
+    {
+        NSUInteger maxLength = MIN([_writeBuffer length], MAX(_maximumWriteBytesInFlight, CK2SFTPPreferredChunkSize));
+        ssize_t written = CK2SFTPRetry(_session, libssh2_sftp_write(_handle, [_writeBuffer bytes], maxLength));
+        
+        if (written < 0)
+        {
+            // There's no telling which bytes made it, so the queue is of no further use
+            [_writeBuffer setLength:0];
+            if (error) *error = [_session performSelector:@selector(sessionErrorWithPath:) withObject:_path];
+            return NO;
+        }
+        
+        [_writeBuffer replaceBytesInRange:NSMakeRange(0, written) withBytes:NULL length:0];
+        
+        NSUInteger depth = [self adaptPipelineDepth:(_maximumWriteBytesInFlight / CK2SFTPPreferredChunkSize) afterTransferringBytes:written];
+        _maximumWriteBytesInFlight = MAX(_maximumWriteBytesInFlight, depth * CK2SFTPPreferredChunkSize);
+    }
+    
+    return YES;
+}
+
+#pragma mark Writing From Files
+
+#define CK2SFTPMappedWindowSize (16 * 1024 * 1024)
+
+- (BOOL)writeContentsOfURL:(NSURL *)URL fromOffset:(unsigned long long)offset progressHandler:(void (^)(NSUInteger bytesWritten))handler error:(NSError **)error;
+{
+    NSParameterAssert([URL isFileURL]);
+    
+    if (![self flushWrites:error]) return NO;
+    
+    int fd = open([[URL path] fileSystemRepresentation], O_RDONLY);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0)
+    {
+        if (error) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:[NSDictionary dictionaryWithObject:URL forKey:NSURLErrorKey]];
+        if (fd >= 0) close(fd);
+        return NO;
+    }
+    
+    // Don't want the pages lingering in the cache once sent
+    fcntl(fd, F_NOCACHE, 1);
+    
+    NSUInteger inFlight = MAX(_maximumWriteBytesInFlight, CK2SFTPDefaultReadWindow * CK2SFTPPreferredChunkSize);
+    unsigned long long end = fileStat.st_size;
+    [self beginPipelineSample];
+    BOOL result = YES;
+    
+    // The file is read a window at a time into a recycled buffer, rather than mapped, so it being truncated underneath us can't raise SIGBUS. libssh2 needs handing the same unacknowledged bytes on each call, so those are kept together, and topped up behind once half of them have been acknowledged. That keeps shuffling them down the buffer to once per half window
+    char *buffer = [_session borrowBuffer];
+    size_t capacity = CK2SFTPBufferLength;
+    size_t start = 0;
+    size_t pending = 0;
+    
+    while (offset + pending < end || pending)
+    {
+        size_t wanted = (size_t)MIN((unsigned long long)MIN(inFlight, capacity), end - offset);
+        if (pending <= wanted / 2 && offset + pending < end)
+        {
+            memmove(buffer, buffer + start, pending);
+            start = 0;
+            
+            ssize_t read = pread(fd, buffer + pending, wanted - pending, offset + pending);
+            if (read < 0)
+            {
+                if (errno == EINTR) continue;
+                if (error) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:[NSDictionary dictionaryWithObject:URL forKey:NSURLErrorKey]];
+                result = NO;
+                break;
+            }
+            if (read == 0) end = offset + pending;  // the file shrank since it was opened, so send only what's left
+            
+            pending += read;
+            if (!pending) break;
+        }
+        
+        ssize_t written = CK2SFTPRetry(_session, libssh2_sftp_write(_handle, buffer + start, pending));
+        if (written < 0)
+        {
+            if (error) *error = [_session performSelector:@selector(sessionErrorWithPath:) withObject:_path];
+            result = NO;
+            break;
+        }
+        
+        start += written;
+        pending -= written;
+        offset += written;
+        if (handler && written) handler(written);
+        
+        inFlight = MAX(inFlight, [self adaptPipelineDepth:(inFlight / CK2SFTPPreferredChunkSize) afterTransferringBytes:written] * CK2SFTPPreferredChunkSize);
+        
+        // A pipeline deeper than a pooled buffer needs a buffer of its own
+        if (inFlight > capacity)
+        {
+            char *larger = malloc(inFlight);
+            if (!larger)
+            {
+                if (error) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:ENOMEM userInfo:[NSDictionary dictionaryWithObject:URL forKey:NSURLErrorKey]];
+                result = NO;
+                break;
+            }
+            memcpy(larger, buffer + start, pending);
+            
+            if (capacity == CK2SFTPBufferLength) [_session returnBuffer:buffer]; else free(buffer);
+            buffer = larger;
+            capacity = inFlight;
+            start = 0;
+        }
+    }
+    
+    if (capacity == CK2SFTPBufferLength) [_session returnBuffer:buffer]; else free(buffer);
+    
+    // Only carry the depth settled upon over to -writeData:error: if it was pipelining already; turning that on changes when errors are reported
+    if (_adaptsPipelineDepth && _maximumWriteBytesInFlight) _maximumWriteBytesInFlight = inFlight;
+    
+    close(fd);
+    return result;
+}
+
+- (BOOL)flushWrites:(NSError **)error;
+{
+    return [self sendWriteBufferWhileExceedingLength:0 error:error];
+}
+
+- (BOOL)synchronizeFile:(NSError **)error;
+{
+    if (![self flushWrites:error]) return NO;
+    
+#if LIBSSH2_VERSION_NUM >= 0x010404
+    if ([[[_session serverCapabilities] objectForKey:CK2SFTPCapabilityFsync] isEqual:[NSNumber numberWithBool:NO]]) return YES;
+    
+    if (CK2SFTPRetry(_session, libssh2_sftp_fsync(_handle)) != LIBSSH2_ERROR_NONE)
+    {
+        NSError *fsyncError = [_session performSelector:@selector(sessionErrorWithPath:) withObject:_path];
+        
+        // Unsupported isn't a failure; the server's already done as much as it's going to
+        if ([[fsyncError domain] isEqualToString:CK2LibSSH2SFTPErrorDomain] && [fsyncError code] == LIBSSH2_FX_OP_UNSUPPORTED)
+        {
+            [_session learnCapability:NO forKey:CK2SFTPCapabilityFsync];
+            return YES;
+        }
+        
+        if (error) *error = fsyncError;
+        return NO;
+    }
+    
+    [_session learnCapabilityIfNeeded:YES forKey:CK2SFTPCapabilityFsync];
+#endif
+    
+    return YES;
+}
+
+- (void)synchronizeFile;
+{
+    NSError *error;
+    if (![self synchronizeFile:&error])
+    {
+        [NSException raise:NSFileHandleOperationException format:@"%@", [error localizedDescription]];
+    }
+}
+
+@synthesize maximumWriteBytesInFlight = _maximumWriteBytesInFlight;
+- (void)setMaximumWriteBytesInFlight:(NSUInteger)budget;
+{
+    [self flushWrites:NULL];
+    _maximumWriteBytesInFlight = budget;
+}
+
+#pragma mark Reading
+
+- (NSData *)readDataOfLength:(NSUInteger)length;
+{
+    NSError *error;
+    NSData *result = [self readDataOfLength:length error:&error];
+    if (!result)
+    {
+        [NSException raise:NSFileHandleOperationException format:@"%@", [error localizedDescription]];
+    }
+    
+    return result;
+}
+
+- (NSData *)readDataToEndOfFile;
+{
+    return [self readDataOfLength:NSUIntegerMax];
+}
+
+- (NSData *)readDataOfLength:(NSUInteger)length error:(NSError **)error;
+{
+    // libssh2 splits each read into CK2SFTPPreferredChunkSize requests, all sent before waiting on the first reply. So the size of buffer we hand it is what sets the pipeline depth
+    NSMutableData *result = [NSMutableData dataWithLength:MIN(length, _readWindow * CK2SFTPPreferredChunkSize)];
+    NSUInteger offset = 0;
+    
+    while (offset < length)
+    {
+        NSUInteger window = _readWindow * CK2SFTPPreferredChunkSize;
+        
+        // Grow geometrically up to what's been asked for, so reading to end of file doesn't allocate the world upfront
+        if (offset == [result length])
+        {
+            [result setLength:MIN(length, offset + MAX(offset, window))];
+        }
+        
+        NSUInteger maxLength = MIN([result length] - offset, window);
+        NSInteger read = [self read:[result mutableBytes] + offset maxLength:maxLength error:error];
+        if (read < 0) return nil;
+        if (read == 0) break;   // end of file
+        
+        offset += read;
+        _readWindow = [self adaptPipelineDepth:_readWindow afterTransferringBytes:read];
+    }
+    
+    [result setLength:offset];
+    return result;
+}
+
+- (NSData *)readDataToEndOfFile:(NSError **)error;
+{
+    return [self readDataOfLength:NSUIntegerMax error:error];
+}
+
+- (NSInteger)read:(uint8_t *)buffer maxLength:(NSUInteger)length error:(NSError **)error;
+{
+    NSInteger result = [self read:buffer maxLength:length];
+    if (result < 0 && error)
+    {
+        *error = [_session performSelector:@selector(sessionErrorWithPath:) withObject:_path];
+    }
+    
+    return result;
+}
+
+- (NSInteger)read:(uint8_t *)buffer maxLength:(NSUInteger)length;
+{
+    if (![self flushWrites:NULL]) return -1;
+    
+    [_session maintainReceiveWindow];
+    return CK2SFTPRetry(_session, libssh2_sftp_read(_handle, (char *)buffer, length));
+}
+
+- (BOOL)readIntoFileAtURL:(NSURL *)URL offset:(unsigned long long)offset length:(unsigned long long)length progressHandler:(void (^)(NSUInteger bytesRead))handler error:(NSError **)error;
+{
+    NSParameterAssert([URL isFileURL]);
+    
+    if (![self flushWrites:error]) return NO;
+    
+    int fd = open([[URL path] fileSystemRepresentation], O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+    {
+        if (error) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:[NSDictionary dictionaryWithObject:URL forKey:NSURLErrorKey]];
+        return NO;
+    }
+    
+    // Anything beyond offset is about to be replaced, and mustn't be mistaken for downloaded data should this fail
+    if (ftruncate(fd, offset) != 0)
+    {
+        if (error) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:[NSDictionary dictionaryWithObject:URL forKey:NSURLErrorKey]];
+        close(fd);
+        return NO;
+    }
+    
+    // Writing to a mapped page the disk has no room for raises SIGBUS. So the file is only mapped once the space is known to be reserved; file systems that can't promise that (SMB, exFAT and the like) are written to a buffer at a time instead
+    unsigned long long end = offset;    // of the space reserved, and so mapped
+    fstore_t store = { F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)length, 0 };
+    if (length)
+    {
+        if (fcntl(fd, F_PREALLOCATE, &store) == 0)
+        {
+            // Should less be allocated than asked for, map just that much, and buffer the rest
+            end = offset + MIN((unsigned long long)store.fst_bytesalloc, length);
+        }
+        else if (errno == ENOSPC)
+        {
+            if (error) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:ENOSPC userInfo:[NSDictionary dictionaryWithObject:URL forKey:NSURLErrorKey]];
+            close(fd);
+            return NO;
+        }
+    }
+    
+    BOOL mapped = (end > offset);
+    if (mapped && ftruncate(fd, end) != 0)
+    {
+        if (error) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:[NSDictionary dictionaryWithObject:URL forKey:NSURLErrorKey]];
+        ftruncate(fd, offset);
+        close(fd);
+        return NO;
+    }
+    
+    long pageSize = getpagesize();
+    char *buffer = NULL;
+    BOOL result = YES;
+    BOOL atEnd = NO;
+    [self beginPipelineSample];
+    
+    // The remote file may have grown since it was measured, so carry on until the server reports its end
+    while (result && !atEnd)
+    {
+        if (mapped && offset < end)
+        {
+            // As with writing, the file is mapped a chunk at a time and libssh2 reads straight into the pages
+            unsigned long long mapStart = offset - (offset % pageSize);
+            size_t mapLength = (size_t)MIN((unsigned long long)CK2SFTPMappedWindowSize, end - mapStart);
+            
+            void *map = mmap(NULL, mapLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd, mapStart);
+            if (map == MAP_FAILED)
+            {
+                if (error) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:[NSDictionary dictionaryWithObject:URL forKey:NSURLErrorKey]];
+                result = NO;
+                break;
+            }
+            
+            char *bytes = (char *)map + (offset - mapStart);
+            size_t remainder = mapLength - (size_t)(offset - mapStart);
+            
+            while (remainder)
+            {
+                [_session maintainReceiveWindow];
+                ssize_t read = CK2SFTPRetry(_session, libssh2_sftp_read(_handle, bytes, MIN(remainder, _readWindow * CK2SFTPPreferredChunkSize)));
+                if (read < 0)
+                {
+                    if (error) *error = [_session performSelector:@selector(sessionErrorWithPath:) withObject:_path];
+                    result = NO;
+                    break;
+                }
+                if (read == 0)
+                {
+                    atEnd = YES;    // the file shrank since its size was looked up
+                    break;
+                }
+                
+                bytes += read;
+                remainder -= read;
+                offset += read;
+                if (handler) handler(read);
+                
+                _readWindow = [self adaptPipelineDepth:_readWindow afterTransferringBytes:read];
+            }
+            
+            munmap(map, mapLength);
+            continue;
+        }
+        
+        // Unmapped, read a window into a recycled buffer and write it out from there
+        if (!buffer) buffer = [_session borrowBuffer];
+        
+        [_session maintainReceiveWindow];
+        ssize_t read = CK2SFTPRetry(_session, libssh2_sftp_read(_handle, buffer, MIN(CK2SFTPBufferLength, _readWindow * CK2SFTPPreferredChunkSize)));
+        if (read < 0)
+        {
+            if (error) *error = [_session performSelector:@selector(sessionErrorWithPath:) withObject:_path];
+            result = NO;
+            break;
+        }
+        if (read == 0)
+        {
+            atEnd = YES;
+            break;
+        }
+        
+        ssize_t written = 0;
+        while (written < read)
+        {
+            ssize_t chunk = pwrite(fd, buffer + written, read - written, offset + written);
+            if (chunk < 0)
+            {
+                if (errno == EINTR) continue;
+                if (error) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:[NSDictionary dictionaryWithObject:URL forKey:NSURLErrorKey]];
+                result = NO;
+                break;
+            }
+            written += chunk;
+        }
+        if (!result) break;
+        
+        offset += read;
+        if (handler) handler(read);
+        
+        _readWindow = [self adaptPipelineDepth:_readWindow afterTransferringBytes:read];
+    }
+    
+    [_session returnBuffer:buffer];
+    
+    // Leave the file holding only what actually arrived, so a failed or cancelled download isn't mistaken for a complete one when resuming, and there are no zeroes on the end if there turned out to be less data than expected
+    ftruncate(fd, offset);
+    
+    close(fd);
+    return result;
+}
+
+@synthesize readWindow = _readWindow;
+- (void)setReadWindow:(NSUInteger)window;
+{
+    _readWindow = MAX(window, 1);   // need at least one request in flight to make progress!
+}
+
+#pragma mark Adaptive Pipelining
+
+- (void)beginPipelineSample;
+{
+    _sampleStart = CFAbsoluteTimeGetCurrent();
+    _sampleBytes = 0;
+}
+
+// Doubles the depth for as long as doing so pays off, which finds roughly the link's bandwidth-delay product. Once it stops paying off, the depth is left as is, since cutting back the writes libssh2 already has in flight isn't safe
+- (NSUInteger)adaptPipelineDepth:(NSUInteger)depth afterTransferringBytes:(NSUInteger)bytes;
+{
+    if (!_adaptsPipelineDepth) return depth;
+    
+    // Judge each depth over several pipelines' worth of data, so a single slow reply doesn't mislead
+    _sampleBytes += bytes;
+    if (_sampleBytes < 4 * depth * CK2SFTPPreferredChunkSize) return depth;
+    
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    if (now <= _sampleStart) return depth;
+    
+    double throughput = _sampleBytes / (now - _sampleStart);
+    _measuredThroughput = throughput;
+    _sampleStart = now;
+    _sampleBytes = 0;
+    
+    if (_pipelineSettled) return depth;
+    
+    if (throughput > _bestThroughput * 1.1 && depth < CK2SFTPMaximumPipelineDepth)
+    {
+        _bestThroughput = throughput;
+        return MIN(depth * 2, CK2SFTPMaximumPipelineDepth);
+    }
+    
+    _pipelineSettled = YES;
+    return depth;
+}
+
+@synthesize adaptsPipelineDepth = _adaptsPipelineDepth;
+@synthesize measuredThroughput = _measuredThroughput;
+
+- (void)setAdaptsPipelineDepth:(BOOL)adapts;
+{
+    _adaptsPipelineDepth = adapts;
+    _pipelineSettled = NO;
+    _bestThroughput = 0.0;
+    [self beginPipelineSample];
+}
+
+#pragma mark Seeking
+
+- (unsigned long long)offsetInFile;
+{
+    // libssh2 only counts data once it's acknowledged
+    NSError *error;
+    if (![self flushWrites:&error])
+    {
+        [NSException raise:NSFileHandleOperationException format:@"%@", [error localizedDescription]];
+    }
+    
+    [[_session transportLock] lock];
+    unsigned long long result = libssh2_sftp_tell64(_handle);
+    [[_session transportLock] unlock];
+    
+    return result;
+}
+
+- (void)seekToFileOffset:(unsigned long long)offset;
+{
+    NSError *error;
+    if (![self seekToFileOffset:offset error:&error])
+    {
+        [NSException raise:NSFileHandleOperationException format:@"%@", [error localizedDescription]];
+    }
+}
+
+- (BOOL)seekToFileOffset:(unsigned long long)offset error:(NSError **)error;
+{
+    // Anything queued belongs at the old offset
+    if (![self flushWrites:error]) return NO;
+    
+    // Purely local to libssh2, which discards any data it read ahead
+    [[_session transportLock] lock];
+    libssh2_sftp_seek64(_handle, offset);
+    [[_session transportLock] unlock];
+    
+    return YES;
+}
+
+- (unsigned long long)seekToEndOfFile;
+{
+    NSError *error;
+    if ([self flushWrites:&error])
+    {
+        LIBSSH2_SFTP_ATTRIBUTES attributes;
+        if (CK2SFTPRetry(_session, libssh2_sftp_fstat(_handle, &attributes)) == LIBSSH2_ERROR_NONE &&
+            attributes.flags & LIBSSH2_SFTP_ATTR_SIZE)
+        {
+            [self seekToFileOffset:attributes.filesize];
+            return attributes.filesize;
+        }
+        
+        error = [_session performSelector:@selector(sessionErrorWithPath:) withObject:_path];
+    }
+    
+    [NSException raise:NSFileHandleOperationException format:@"%@", [error localizedDescription]];
+    return 0;
 }
 
 @end
@@ -41,11 +41,51 @@ extern NSString *const CK2SSHAuthenticationSchemePublicKey;
 extern NSString *const CK2SSHAuthenticationSchemeKeyboardInteractive;
 extern NSString *const CK2SSHAuthenticationSchemePassword;
 
+extern NSString *const CK2SFTPFileAccessDate;   // NSFileManager has no equivalent key
+
+// Keys for -serverCapabilities. The extension-based ones are named after the extension they use
+extern NSString *const CK2SFTPCapabilityPOSIXRename;        // posix-rename@openssh.com
+extern NSString *const CK2SFTPCapabilityStatVFS;            // statvfs@openssh.com
+extern NSString *const CK2SFTPCapabilityFsync;              // fsync@openssh.com
+extern NSString *const CK2SFTPCapabilityHonoursMkdirMode;   // creates directories with the mode asked for
+extern NSString *const CK2SFTPCapabilityHonoursOpenMode;    // creates files with the mode asked for
+
 
 #define CK2SFTPPreferredChunkSize 30000
+#define CK2SFTPHighBandwidthDelayReceiveWindow (16 * 1024 * 1024)   // enough to fill a 1Gbit/s link with a 100ms round trip
+#define CK2SFTPBufferLength (CK2SFTPDefaultReadWindow * CK2SFTPPreferredChunkSize)    // enough for a full read window
+
+
+// libssh2 is run in non-blocking mode. Wrap calls into it like so to have them retried for as long as they report LIBSSH2_ERROR_EAGAIN, waiting upon the session's socket in between. Gives up after the session's timeout, returning LIBSSH2_ERROR_EAGAIN
+// Calls are made holding the session's transport lock, since any additional channels share the same libssh2 session
+#define CK2SFTPRetry(session, call) ({ \
+    __typeof__(call) _ck2Result; \
+    BOOL _ck2Again; \
+    do { \
+        [[(session) transportLock] lock]; \
+        _ck2Result = (call); \
+        _ck2Again = (_ck2Result == LIBSSH2_ERROR_EAGAIN); \
+        [(session) libssh2CallDidFinish:(_ck2Result < 0)]; \
+        [[(session) transportLock] unlock]; \
+    } while (_ck2Again && [(session) waitForSocket]); \
+    _ck2Result; })
+
+// For those libssh2 calls which return a pointer, and so report LIBSSH2_ERROR_EAGAIN through the session's last error instead
+#define CK2SFTPRetryPointer(session, call) ({ \
+    __typeof__(call) _ck2Result; \
+    BOOL _ck2Again; \
+    do { \
+        [[(session) transportLock] lock]; \
+        _ck2Result = (call); \
+        _ck2Again = (!_ck2Result && libssh2_session_last_errno([(session) libssh2_session]) == LIBSSH2_ERROR_EAGAIN); \
+        [(session) libssh2CallDidFinish:!_ck2Result]; \
+        [[(session) transportLock] unlock]; \
+    } while (_ck2Again && [(session) waitForSocket]); \
+    _ck2Result; })
 
 
 @protocol CK2SFTPSessionDelegate;
+@class CK2SFTPMetadataCache, CK2SFTPBufferPool, CK2SFTPConnectionTimings;
 
 
 @interface CK2SFTPSession : NSObject <NSURLAuthenticationChallengeSender>
@@ -55,10 +95,28 @@ extern NSString *const CK2SSHAuthenticationSchemePassword;
     LIBSSH2_SFTP        *_sftp;
     LIBSSH2_SESSION     *_session;
     CFSocketRef         _socket;
+    int                 _kqueue;
+    NSTimeInterval      _timeout;
+    unsigned long       _receiveWindowSize;
+    CFAbsoluteTime      _callStart;         // when the current libssh2 call first had to wait
+    CFAbsoluteTime      _lastSocketWait;
+    int                 _lastErrorCode;     // of the last call made through CK2SFTPRetry()
+    NSString            *_lastErrorMessage;
+    unsigned long       _lastSFTPErrorCode;
+    
+    NSRecursiveLock     *_transportLock;
+    CK2SFTPSession      *_transportOwner;   // for additional channels
+    NSMutableArray      *_channels;         // non-retained additional channels
+    
+    CK2SFTPMetadataCache    *_metadataCache;
+    CK2SFTPBufferPool       *_bufferPool;
     
     id <CK2SFTPSessionDelegate>     _delegate;
     NSURLAuthenticationChallenge    *_challenge;
     NSURLCredential                 *_keyboardInteractiveCredential;    // weak
+    
+    CK2SFTPConnectionTimings        *_connectionTimings;
+    BOOL                            _reportedConnectionTimings;
 }
 
 - (id)initWithURL:(NSURL *)URL delegate:(id <CK2SFTPSessionDelegate>)delegate;
@@ -67,7 +125,17 @@ extern NSString *const CK2SSHAuthenticationSchemePassword;
 - (void)start;  // Causes the receiver to begin session, if it has not already
 - (void)cancel; // after cancelling, you'll stop receiving delegate messages
 
+// How long to wait on the server before failing an operation with NSURLErrorTimedOut. Defaults to 60 seconds
+// Operations still block their thread until complete; the session doesn't yet multiplex outstanding requests from a single thread. Cancelling waits no more than a few seconds on each step of shutting down, whatever the timeout
+@property(nonatomic) NSTimeInterval timeout;
+
+// How much the server may send on the SFTP channel before waiting for it to be acknowledged. That caps downloads at window / round trip time, however deep the SFTP pipelining, so raise it to CK2SFTPHighBandwidthDelayReceiveWindow or thereabouts for fast, distant servers
+// libssh2 only keeps the window topped up to its own default, so the receiver tops it back up before reading. Channels opened afterwards inherit the setting. Defaults to 0, leaving it to libssh2
+// Uploads are governed by the server's window, and libssh2 fixes the maximum packet size when opening the channel, so neither can be tuned from this end
+@property(nonatomic) unsigned long receiveWindowSize;
+
 // Some servers ignore the mode, meaning you'll have to call -setPermissions:… afterwards
+// The exception is when passing LIBSSH2_FXF_CREAT | LIBSSH2_FXF_EXCL, as the file is then known to be new. The session learns whether the server honours the mode, remembering it for future sessions, and corrects the permissions itself if needed
 - (CK2SFTPFileHandle *)openHandleAtPath:(NSString *)path flags:(unsigned long)flags mode:(long)mode error:(NSError **)error;
 
 - (BOOL)setPermissions:(unsigned long)permissions forItemAtPath:(NSString *)path error:(NSError **)error;
@@ -76,6 +144,59 @@ extern NSString *const CK2SSHAuthenticationSchemePassword;
 - (BOOL)removeDirectoryAtPath:(NSString *)path error:(NSError **)error;
 - (BOOL)moveItemAtPath:(NSString *)oldPath toPath:(NSString *)newPath error:(NSError **)error;
 
+// With overwrite, replaces any existing file at newPath. Servers supporting posix-rename@openssh.com do so atomically in a single request, provided libssh2 is 1.11 or later (the bundled build isn't); otherwise the file is removed and the rename retried, but only if the rename failed as if for the destination existing, with the source still there, and the two being different items
+- (BOOL)moveItemAtPath:(NSString *)oldPath toPath:(NSString *)newPath overwrite:(BOOL)overwrite error:(NSError **)error;
+
+// Copies a file, giving it the same permissions. The data is streamed down and back up again through pipelined reads and writes, holding only a couple of windows of the file in memory at once
+// Fails if there's already something at dstPath
+- (BOOL)copyItemAtPath:(NSString *)srcPath toPath:(NSString *)dstPath error:(NSError **)error;
+
+// With overwrite, replaces any existing file at dstPath, refusing if it's the source itself. A failed copy removes whatever it left at dstPath
+- (BOOL)copyItemAtPath:(NSString *)srcPath toPath:(NSString *)dstPath overwrite:(BOOL)overwrite error:(NSError **)error;
+
+// Downloads a file in its entirety, replacing any existing one at URL. The destination is preallocated at the size reported by a stat, and where possible filled in straight from libssh2 without buffering; see -[CK2SFTPFileHandle readIntoFileAtURL:…]
+- (BOOL)downloadItemAtPath:(NSString *)path toURL:(NSURL *)URL error:(NSError **)error;
+
+// Like NSFileManager, doesn't traverse a symlink at path
+- (NSDictionary *)attributesOfItemAtPath:(NSString *)path error:(NSError **)error;
+
+
+#pragma mark Server Capabilities
+
+// libssh2 doesn't pass on the extensions a server lists in its SSH_FXP_VERSION reply, so instead each capability is learnt the first time it's put to use, and remembered per host for future sessions. After a week, in case the server has changed, it's learnt afresh
+// Returns NSNumber booleans keyed by CK2SFTPCapability… constants. Those not yet learnt are absent
+@property(nonatomic, readonly) NSDictionary *serverCapabilities;
+- (void)removeLearntServerCapabilities; // for the receiver's host, such as after it's been reconfigured
++ (void)removeAllLearntServerCapabilities;
+
+// Like NSFileManager, supplying NSFileSystemSize, NSFileSystemFreeSize, NSFileSystemNodes and NSFileSystemFreeNodes for the volume containing path. Handy for checking there's room before a big upload
+// Requires statvfs@openssh.com; fails with LIBSSH2_FX_OP_UNSUPPORTED otherwise
+- (NSDictionary *)attributesOfFileSystemForPath:(NSString *)path error:(NSError **)error;
+
+
+#pragma mark Metadata Cache
+
+// Set to have attributes, directory listings and resolved paths remembered for this long, saving round trips for repeated queries. Defaults to 0, which disables caching
+// Operations performed through the receiver (or its channels) automatically invalidate affected entries. Changes made by anyone else go unnoticed until the entries expire
+@property(nonatomic) NSTimeInterval metadataCacheTimeout;
+- (void)invalidateCachedMetadataForPath:(NSString *)path;   // includes anything inside it
+- (void)removeAllCachedMetadata;
+
+
+#pragma mark Buffers
+
+// Scratch buffers of CK2SFTPBufferLength bytes, one full read window, recycled rather than allocated afresh by bulk transfers. Don't borrow one for anything small. Shared with the receiver's channels, and safe to use from any thread. Return whatever you borrow
+- (void *)borrowBuffer;
+- (void)returnBuffer:(void *)buffer;
+
+
+#pragma mark Channels
+
+// Opens another SFTP subsystem channel on the receiver's existing connection, presented as a session of its own. Use to work on several files in parallel without paying for further connections, key exchanges and authentication
+// Channels share the connection's transport lock, so can be used on separate threads at the same time; their operations are interleaved over the one socket
+// Cancelling the original session cancels all its channels too. The channel's delegate is the receiver's, and it won't be sent -SFTPSessionDidInitialize:
+- (CK2SFTPSession *)openSFTPChannel:(NSError **)error;
+
 
 #pragma mark Creating Symbolic and Hard Links
 - (NSString *)destinationOfSymbolicLinkAtPath:(NSString *)path error:(NSError **)error;
@@ -90,10 +211,23 @@ extern NSString *const CK2SSHAuthenticationSchemePassword;
 // Like NSFileManager
 - (NSArray *)contentsOfDirectoryAtPath:(NSString *)path error:(NSError **)error;
 
-// Returns an array of dictionaries, one per directory item, with the same keys as NSFileManager uses, but with the addition of cxFilenameKey
+// Returns an array of dictionaries, one per directory item, with the same keys as NSFileManager uses, but with the addition of cxFilenameKey and CK2SFTPFileAccessDate
+// Includes whichever of NSFileType, NSFileSize, NSFileModificationDate, NSFilePosixPermissions, NSFileOwnerAccountID and NSFileGroupOwnerAccountID the server supplies; there's no need to stat each item separately
 - (NSArray *)attributesOfContentsOfDirectoryAtPath:(NSString *)path error:(NSError **)error;
 
+// Calls the block with each item's attributes as they arrive from the server, rather than building up the whole listing first. Memory use stays flat regardless of directory size
+// Set *stop to YES to finish early. Returns NO upon error, possibly after some items have already been passed to the block
+// The attributes dictionary is autoreleased in a pool which is regularly drained during enumeration, so retain it if you want to keep it
+- (BOOL)enumerateContentsOfDirectoryAtPath:(NSString *)path usingBlock:(void (^)(NSDictionary *attributes, BOOL *stop))block error:(NSError **)error;
+
+// Cheapest of all, creating no objects per item. filename is not NUL-terminated, and it and attributes are only valid for the duration of the block. Check attributes->flags for which values the server supplied
+- (BOOL)enumerateEntriesOfDirectoryAtPath:(NSString *)path usingBlock:(void (^)(const char *filename, size_t length, const LIBSSH2_SFTP_ATTRIBUTES *attributes, BOOL *stop))block error:(NSError **)error;
+
+// Converts libssh2's attributes into NSFileManager-style ones. filename may be nil
++ (NSDictionary *)attributesWithFilename:(NSString *)filename SFTPAttributes:(const LIBSSH2_SFTP_ATTRIBUTES *)attributes;
+
 // Some servers ignore the mode, meaning you'll have to call -setPermissions:… afterwards
+// When creating intermediates, that's taken care of for you. The session learns whether the server honours the mode, remembering it for future sessions, so as to only set permissions when needed
 - (BOOL)createDirectoryAtPath:(NSString *)path mode:(long)mode error:(NSError **)error;
 - (BOOL)createDirectoryAtPath:(NSString *)path withIntermediateDirectories:(BOOL)createIntermediates mode:(long)mode error:(NSError **)error;
 
@@ -120,6 +254,24 @@ extern NSString *const CK2SSHAuthenticationSchemePassword;
 // Returns an array of CK2SSHAuthenticationSchemePassword etc. nil in the event of failure, or the server supports unauthenticated usage
 - (NSArray *)supportedAuthenticationSchemesForUser:(NSString *)user;    
 
+// Which scheme, and which SSH-Agent identity, last worked for each user at each host is remembered for a month, so later connections can try it first
+- (void)removeAuthenticationMemos;  // for all users at the receiver's host
++ (void)removeAllAuthenticationMemos;
+
+// Key files are kept in memory once read, shared by all sessions, so reconnecting needn't go to the disk, or the sandbox, again. They're cached by path, so any credential naming the same file gets the benefit, until the key has gone unused for half an hour
+// Requires libssh2 1.6 or later; with earlier versions, including the bundled 1.4.4 build, the cache and these methods are compiled out and the file is read each time
+// libssh2 only accepts keys as stored, so a passphrase-protected one is still decrypted afresh with each authentication
+#if LIBSSH2_VERSION_NUM >= 0x010600
+// Keys read from then on are locked into RAM, never paged out to swap, unless set to NO. Each takes at least a page of locked memory, which counts against the process's limit; once that's used up, keys are kept unlocked. Defaults to YES
++ (void)setLocksCachedPrivateKeysInMemory:(BOOL)lock;
++ (void)removeAllCachedPrivateKeys; // e.g. once the user has replaced their keys
+#endif
+
+
+#pragma mark Diagnostics
+// How long each phase of connecting took. Filled in as the session starts up; nil for channels
+@property(nonatomic, readonly) CK2SFTPConnectionTimings *connectionTimings;
+
 
 #pragma mark Error Handling
 // The last error produced by the system. If a method provides an error directly (or via the delegate), you should use that instead, as it has more contextual information available than -sessionError.
@@ -128,13 +280,57 @@ extern NSString *const CK2SSHAuthenticationSchemePassword;
 
 #pragma mark libssh2
 @property(nonatomic, readonly) LIBSSH2_SFTP *libssh2_sftp;
-@property(nonatomic, readonly) LIBSSH2_SESSION *libssh2_session;
+@property(nonatomic, readonly) LIBSSH2_SESSION *libssh2_session;   // non-blocking; see CK2SFTPRetry()
+
+// Blocks until the socket is ready in whichever direction(s) libssh2 is waiting on. Returns NO if the timeout elapses first, or the session has been torn down
+// When channels share the connection, each call into libssh2 must complete within the timeout, as traffic on the socket may be for another channel
+- (BOOL)waitForSocket;
+
+// CK2SFTPRetry() calls this after each attempt, holding the transport lock. Records the receiver's own error for -sessionError, so channels don't report each other's, and wakes any other channels waiting on the connection
+- (void)libssh2CallDidFinish:(BOOL)failed;
+
+// Hold while calling into libssh2 directly. CK2SFTPRetry() takes care of this for you
+@property(nonatomic, readonly) NSRecursiveLock *transportLock;
 
 
 @end
 
 
 
+#pragma mark -
+
+
+extern NSString *const CK2SFTPTimingAuthenticationSchemeKey;    // one of the CK2SSHAuthenticationScheme… constants
+extern NSString *const CK2SFTPTimingDurationKey;                // NSNumber, seconds
+extern NSString *const CK2SFTPTimingSucceededKey;               // NSNumber, BOOL
+
+
+// Wall-clock durations of a session's connection phases, in seconds, for attributing slow connects to the resolver, the network, crypto or the server. Phases not reached are 0
+// Time spent waiting for the delegate to supply a credential is excluded
+@interface CK2SFTPConnectionTimings : NSObject
+{
+  @private
+    NSTimeInterval  _resolutionDuration;
+    NSTimeInterval  _connectDuration;
+    NSTimeInterval  _handshakeDuration;
+    NSTimeInterval  _authenticationListDuration;
+    NSMutableArray  *_authenticationAttempts;
+    NSTimeInterval  _SFTPInitializationDuration;
+}
+
+@property(nonatomic, readonly) NSTimeInterval resolutionDuration;           // DNS. 0 when the addresses were already cached
+@property(nonatomic, readonly) NSTimeInterval connectDuration;              // TCP connect, including any fallback between addresses
+@property(nonatomic, readonly) NSTimeInterval handshakeDuration;            // banner and key exchange, which libssh2 performs as a single step
+@property(nonatomic, readonly) NSTimeInterval authenticationListDuration;   // asking which auth schemes the server supports; summed if asked more than once
+@property(nonatomic, readonly) NSArray *authenticationAttempts;             // one dictionary per attempt, in order. SSH-Agent attempts are per identity
+@property(nonatomic, readonly) NSTimeInterval SFTPInitializationDuration;   // starting the SFTP subsystem
+
+@end
+
+
+#pragma mark -
+
+
 @protocol CK2SFTPSessionDelegate
 
 - (void)SFTPSessionDidInitialize:(CK2SFTPSession *)session; // session is now ready to read/write files etc.
@@ -149,6 +345,10 @@ extern NSString *const CK2SSHAuthenticationSchemePassword;
 - (void)SFTPSession:(CK2SFTPSession *)session didReceiveAuthenticationChallenge:(NSURLAuthenticationChallenge *)challenge;
 - (void)SFTPSession:(CK2SFTPSession *)session didCancelAuthenticationChallenge:(NSURLAuthenticationChallenge *)challenge;
 
+@optional
+// Sent once connecting is finished with, successfully or not, just before -SFTPSessionDidInitialize: or -SFTPSession:didFailWithError:
+- (void)SFTPSession:(CK2SFTPSession *)session didRecordConnectionTimings:(CK2SFTPConnectionTimings *)timings;
+
 
 @end
 
@@ -30,11 +30,19 @@
 #import "CK2SSHCredential.h"
 
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
 #include <pwd.h>
+#include <sys/event.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <libssh2_sftp.h>
 #include <libssh2.h>
 
+#include <CommonCrypto/CommonDigest.h>
+
 
 NSString *const CK2SSHDisconnectErrorDomain = @"org.ietf.SSH.disconnect";
 NSString *const CK2LibSSH2ErrorDomain = @"org.libssh2.libssh2";
@@ -44,6 +52,36 @@ NSString *const CK2SSHAuthenticationSchemePublicKey = @"publickey";
 NSString *const CK2SSHAuthenticationSchemeKeyboardInteractive = @"keyboard-interactive";
 NSString *const CK2SSHAuthenticationSchemePassword = @"password";
 
+NSString *const CK2SFTPFileAccessDate = @"CK2SFTPFileAccessDate";
+
+NSString *const CK2SFTPTimingAuthenticationSchemeKey = @"scheme";
+NSString *const CK2SFTPTimingDurationKey = @"duration";
+NSString *const CK2SFTPTimingSucceededKey = @"succeeded";
+
+NSString *const CK2SFTPCapabilityPOSIXRename = @"posix-rename@openssh.com";
+NSString *const CK2SFTPCapabilityStatVFS = @"statvfs@openssh.com";
+NSString *const CK2SFTPCapabilityFsync = @"fsync@openssh.com";
+NSString *const CK2SFTPCapabilityHonoursMkdirMode = @"honoursMkdirMode";
+NSString *const CK2SFTPCapabilityHonoursOpenMode = @"honoursOpenMode";
+
+
+#define CK2SFTPTeardownTimeout 5.0  // how long cancelling waits on each step of shutting down the connection
+#define CK2SFTPWakeEvent 1          // EVFILT_USER identifier, triggered when another channel has been at the shared connection
+
+
+// A kqueue for waiting on the socket, which other channels sharing the connection can also wake
+static int CK2SFTPCreateKqueue(void)
+{
+    int result = kqueue();
+    if (result >= 0)
+    {
+        struct kevent wake;
+        EV_SET(&wake, CK2SFTPWakeEvent, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+        kevent(result, &wake, 1, NULL, 0, NULL);
+    }
+    return result;
+}
+
 
 #pragma mark -
 
@@ -54,591 +92,2282 @@ NSString *const CK2SSHAuthenticationSchemePassword = @"password";
 @end
 
 
+#pragma mark -
 
-@implementation CK2SFTPSession
 
-static int waitsocket(int socket_fd, LIBSSH2_SESSION *session)
+// Remembers what the server told us about paths for a limited time. Shared between a session and its channels, so access is synchronized
+@interface CK2SFTPMetadataCache : NSObject
 {
-    struct timeval timeout;
-    int rc;
-    fd_set fd;
-    fd_set *writefd = NULL;
-    fd_set *readfd = NULL;
-    int dir;
-    
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
-    
-    FD_ZERO(&fd);
-    
-    FD_SET(socket_fd, &fd);
-    
-    /* now make sure we wait in the correct direction */
-    dir = libssh2_session_block_directions(session);
-    
-    if(dir & LIBSSH2_SESSION_BLOCK_INBOUND)
-        readfd = &fd;
-    
-    if(dir & LIBSSH2_SESSION_BLOCK_OUTBOUND)
-        writefd = &fd;
+  @private
+    NSMutableDictionary *_entries;  // path -> kind -> [object, expiry]
+    NSTimeInterval      _timeout;
+    CFAbsoluteTime      _nextSweep;
+}
+
+- (id)objectForPath:(NSString *)path kind:(NSString *)kind;
+- (void)setObject:(id)object forPath:(NSString *)path kind:(NSString *)kind;
+
+// Also forgets the parent directory's listing, since that includes the item
+- (void)removeObjectsForPath:(NSString *)path includingDescendants:(BOOL)descendants;
+- (void)removeAllObjects;
+
+@property(nonatomic) NSTimeInterval timeout;    // 0 disables caching
+
+@end
+
+
+#define CK2SFTPBufferPoolCapacity 8
+#define CK2SFTPMetadataCacheCapacity 10000  // paths; walking a big tree shouldn't grow the cache without limit
+
+
+static NSString *const CK2SFTPCachedAttributes = @"attributes";
+static NSString *const CK2SFTPCachedContents = @"contents";
+static NSString *const CK2SFTPCachedRealpath = @"realpath";
+
+
+@implementation CK2SFTPMetadataCache
+
+// So that different spellings of the same path share an entry. -stringByStandardizingPath would also expand ~ against the local home folder, and resolve local symlinks, so this is done by hand. Relative paths stay relative, as only the server knows what they're relative to
++ (NSString *)keyForPath:(NSString *)path;
+{
+    BOOL absolute = [path isAbsolutePath];
+    NSMutableArray *components = [NSMutableArray array];
     
-    rc = select(socket_fd + 1, readfd, writefd, NULL, &timeout);
+    for (NSString *aComponent in [path componentsSeparatedByString:@"/"])
+    {
+        if ([aComponent length] == 0 || [aComponent isEqualToString:@"."]) continue;
+        
+        if ([aComponent isEqualToString:@".."] && [components count] && ![[components lastObject] isEqualToString:@".."])
+        {
+            [components removeLastObject];
+        }
+        else if (!([aComponent isEqualToString:@".."] && absolute))  // can't go above the root
+        {
+            [components addObject:aComponent];
+        }
+    }
     
-    return rc;
+    NSString *result = [components componentsJoinedByString:@"/"];
+    if (absolute) result = [@"/" stringByAppendingString:result];
+    else if (![result length]) result = @".";
+    return result;
 }
 
-- (NSInteger)portForURL:(NSURL *)URL;
+- (id)init;
 {
-    NSNumber *result = [URL port];
-    return (result ? [result integerValue] : 22);
+    if (self = [super init])
+    {
+        _entries = [[NSMutableDictionary alloc] init];
+    }
+    return self;
 }
 
-#pragma mark Lifecycle
-
-- (id)initWithURL:(NSURL *)URL delegate:(id <CK2SFTPSessionDelegate>)delegate;
+- (void)dealloc;
 {
-    return [self initWithURL:URL delegate:delegate startImmediately:YES];
+    [_entries release];
+    [super dealloc];
 }
 
-- (id)initWithURL:(NSURL *)URL delegate:(id <CK2SFTPSessionDelegate>)delegate startImmediately:(BOOL)startImmediately;
+- (id)objectForPath:(NSString *)path kind:(NSString *)kind;
 {
-    NSParameterAssert(URL);
+    // Disabled is the common case, so don't pay for normalising the path
+    if (!path || _timeout <= 0.0) return nil;
+    path = [[self class] keyForPath:path];
     
-    if (self = [self init])
+    @synchronized(self)
     {
-        _URL = [URL copy];
-        _delegate = delegate;
+        NSArray *entry = [[_entries objectForKey:path] objectForKey:kind];
+        if (!entry) return nil;
+        
+        if ([[entry objectAtIndex:1] doubleValue] < CFAbsoluteTimeGetCurrent())
+        {
+            [[_entries objectForKey:path] removeObjectForKey:kind];
+            return nil;
+        }
+        
+        return [[[entry objectAtIndex:0] retain] autorelease];
     }
-    
-    if (startImmediately) [self start];
-    
-    return self;
 }
 
-void disconnect_callback(LIBSSH2_SESSION *session, int reason, const char *message, int message_len, const char *language, int language_len, void **abstract)
+- (void)setObject:(id)object forPath:(NSString *)path kind:(NSString *)kind;
 {
-    CK2SFTPSession *self = *abstract;
+    if (!path || _timeout <= 0.0) return;
+    path = [[self class] keyForPath:path];
     
-    // Build a raw error to encapsulate the disconnect
-    NSMutableDictionary *userInfo = [[NSMutableDictionary alloc] initWithCapacity:2];
-    if (message)
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    NSArray *entry = [NSArray arrayWithObjects:object, [NSNumber numberWithDouble:(now + _timeout)], nil];
+    
+    @synchronized(self)
     {
-        NSString *string = [[NSString alloc] initWithBytes:message length:message_len encoding:NSUTF8StringEncoding];
-        [userInfo setObject:string forKey:NSLocalizedDescriptionKey];
-        [string release];
+        // Expired entries are otherwise only dropped when looked up again, so every so often, clear them all out
+        if (now >= _nextSweep || [_entries count] >= CK2SFTPMetadataCacheCapacity)
+        {
+            [self removeObjectsExpiredBefore:now];
+            _nextSweep = now + _timeout;
+            
+            // Still full means it's all fresh; make a clean start rather than pick and choose
+            if ([_entries count] >= CK2SFTPMetadataCacheCapacity) [_entries removeAllObjects];
+        }
+        
+        NSMutableDictionary *kinds = [_entries objectForKey:path];
+        if (!kinds)
+        {
+            kinds = [NSMutableDictionary dictionaryWithCapacity:1];
+            [_entries setObject:kinds forKey:path];
+        }
+        [kinds setObject:entry forKey:kind];
     }
-    if (language)
+}
+
+// Must be called while synchronized
+- (void)removeObjectsExpiredBefore:(CFAbsoluteTime)time;
+{
+    for (NSString *aPath in [_entries allKeys])
     {
-        NSString *string = [[NSString alloc] initWithBytes:language length:language_len encoding:NSUTF8StringEncoding];
-        [userInfo setObject:string forKey:@"language"];
-        [string release];
+        NSMutableDictionary *kinds = [_entries objectForKey:aPath];
+        for (NSString *aKind in [kinds allKeys])
+        {
+            if ([[[kinds objectForKey:aKind] objectAtIndex:1] doubleValue] < time) [kinds removeObjectForKey:aKind];
+        }
+        
+        if (![kinds count]) [_entries removeObjectForKey:aPath];
     }
-    
-    NSError *error = [NSError errorWithDomain:CK2SSHDisconnectErrorDomain code:reason userInfo:userInfo];
-    [userInfo release];
-    
-    [self failWithError:error];
 }
 
-- (void)start;
+- (void)removeObjectsForPath:(NSString *)path includingDescendants:(BOOL)descendants;
 {
-    if (_session) return;   // already started
-    
+    if (!path) return;
+    path = [[self class] keyForPath:path];
     
-    unsigned long hostaddr;
-    struct sockaddr_in sin;
-#if defined(HAVE_IOCTLSOCKET)
-    long flag = 1;
-#endif
-    
-    
-    /* Create a session instance */
-    _session = libssh2_session_init_ex(NULL, NULL, NULL, self);
-    if (!_session)
+    @synchronized(self)
     {
-        NSError *error = [NSError errorWithDomain:CK2LibSSH2ErrorDomain
-                                             code:0
-                                         userInfo:[NSDictionary dictionaryWithObject:@"libssh2 session initialization failed"
-                                                                              forKey:NSLocalizedDescriptionKey]];
+        [_entries removeObjectForKey:path];
+        [[_entries objectForKey:[[self class] keyForPath:[path stringByDeletingLastPathComponent]]] removeObjectForKey:CK2SFTPCachedContents];
         
-        return [self failWithError:error];
+        if (descendants)
+        {
+            NSString *prefix = ([path hasSuffix:@"/"] ? path : [path stringByAppendingString:@"/"]);
+            for (NSString *aPath in [_entries allKeys])
+            {
+                if ([aPath hasPrefix:prefix]) [_entries removeObjectForKey:aPath];
+                
+                // Other paths may have resolved through this one. Simplest to forget them all
+                [[_entries objectForKey:aPath] removeObjectForKey:CK2SFTPCachedRealpath];
+            }
+        }
     }
-    
-    
-    /*
-     * The application code is responsible for creating the socket
-     * and establishing the connection
-     */
-    // FIXME: NSHost is not threadsafe; use CF-level API instead
-    NSString *hostName = [_URL host];
-    NSString *transcript = [NSString stringWithFormat:@"Connecting to %@", hostName];
-    NSNumber *port = [_URL port];
-    if (port) transcript = [transcript stringByAppendingFormat:@":%@", port];
-    [_delegate SFTPSession:self appendStringToTranscript:transcript received:NO];
-    
-    NSHost *host = [NSHost hostWithName:hostName];
-    NSString *address = [host address];
-    if (!address)
+}
+
+- (void)removeAllObjects;
+{
+    @synchronized(self)
     {
-        NSError *error = [NSError errorWithDomain:NSURLErrorDomain
-                                             code:NSURLErrorCannotFindHost
-                                         userInfo:[NSDictionary dictionaryWithObject:@"Cannot find host"
-                                                                              forKey:NSLocalizedDescriptionKey]];
-        
-        return [self failWithError:error];
+        [_entries removeAllObjects];
     }
-    
-    hostaddr = inet_addr([address UTF8String]);
-    
-    _socket = CFSocketCreate(NULL, AF_INET, SOCK_STREAM, 0, 0, NULL, NULL);
-    if (!_socket)
+}
+
+@synthesize timeout = _timeout;
+
+@end
+
+
+
+// Recycles CK2SFTPBufferLength scratch buffers. Shared between a session and its channels, so access is synchronized
+@interface CK2SFTPBufferPool : NSObject
+{
+  @private
+    void        *_buffers[CK2SFTPBufferPoolCapacity];
+    NSUInteger  _count;
+}
+
+- (void *)borrowBuffer;
+- (void)returnBuffer:(void *)buffer;
+
+@end
+
+
+@implementation CK2SFTPBufferPool
+
+- (void)dealloc;
+{
+    while (_count) free(_buffers[--_count]);
+    [super dealloc];
+}
+
+- (void *)borrowBuffer;
+{
+    @synchronized(self)
     {
-        NSError *error = [NSError errorWithDomain:NSURLErrorDomain
-                                             code:NSURLErrorUnknown
-                                         userInfo:[NSDictionary dictionaryWithObject:@"Error creating socket"
-                                                                              forKey:NSLocalizedDescriptionKey]];
-        
-        return [self failWithError:error];
+        if (_count) return _buffers[--_count];
     }
     
-    // Should the connection be broken, we'd rather fail with an error than head into SIGPIPE
-    int yes=1;
-    setsockopt(CFSocketGetNative(_socket), SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(int));
-    
-    sin.sin_family = AF_INET;
-    sin.sin_port = htons([self portForURL:_URL]);
-    sin.sin_addr.s_addr = hostaddr;
-    
-    CFDataRef addressData = CFDataCreate(NULL, (UInt8 *)&sin, sizeof(struct sockaddr_in));
-    CFSocketError socketError = CFSocketConnectToAddress(_socket, addressData, 60.0);
-    CFRelease(addressData);
+    return malloc(CK2SFTPBufferLength);
+}
+
+- (void)returnBuffer:(void *)buffer;
+{
+    if (!buffer) return;
     
-    if (socketError != kCFSocketSuccess)
+    @synchronized(self)
     {
-        NSError *error = [NSError errorWithDomain:NSURLErrorDomain
-                                             code:NSURLErrorCannotConnectToHost
-                                         userInfo:[NSDictionary dictionaryWithObject:@"Cannot connect to host"
-                                                                              forKey:NSLocalizedDescriptionKey]];
-        
-        return [self failWithError:error];
+        // Keep enough for the usual number of concurrent operations; any more were a burst, so let them go
+        if (_count < CK2SFTPBufferPoolCapacity)
+        {
+            _buffers[_count++] = buffer;
+            return;
+        }
     }
     
+    free(buffer);
+}
+
+@end
+
+
+
+// Only libssh2 1.6 and later can take keys from memory, so there's nothing to cache otherwise
+#if LIBSSH2_VERSION_NUM >= 0x010600
+
+// A key file's contents, as libssh2_userauth_publickey_frommemory() wants them. Wiped when deallocated, rather than left lying around in freed memory
+// Each key gets whole pages of its own, since locking isn't counted: unlocking one key's memory would otherwise unlock any other sharing its pages
+@interface CK2SFTPKeyMaterial : NSObject
+{
+  @private
+    char            *_bytes;
+    size_t          _length;
+    size_t          _allocatedLength;   // whole pages, as mapped and locked
+    BOOL            _locked;
     
-    /* Since we have set non-blocking, tell libssh2 we are non-blocking */
-    //libssh2_session_set_blocking(_session, 0);
-    
-    
-    /* ... start it up. This will trade welcome banners, exchange keys,
-     * and setup crypto, compression, and MAC layers
-     */
+    off_t           _fileSize;
+    struct timespec _modificationDate;
     
-    if (libssh2_session_handshake(_session, CFSocketGetNative(_socket)))
+    NSTimeInterval  _lastUsed;
+}
+
+// Pass YES for lock to keep the contents in RAM, never paged out to swap
+- (id)initWithContentsOfURL:(NSURL *)URL lock:(BOOL)lock;
+
+@property(nonatomic, readonly) const char *bytes;
+@property(nonatomic, readonly) size_t length;
+
+// Whether the file's size and modification date are still those it had when read in. NO if it can't be looked at
+- (BOOL)matchesFileAtURL:(NSURL *)URL;
+
+@property(nonatomic) NSTimeInterval lastUsed;   // reference date; kept up to date by the cache
+
+@end
+
+
+@implementation CK2SFTPKeyMaterial
+
+- (id)initWithContentsOfURL:(NSURL *)URL lock:(BOOL)lock;
+{
+    if (self = [super init])
     {
-        NSError *error = [self sessionError];
+        int fd = open([[URL path] fileSystemRepresentation], O_RDONLY);
+        if (fd == -1)
+        {
+            [self release];
+            return nil;
+        }
         
-        // Fill in more user-friendly description when it looks like the server booted us off
-        if ([[error domain] isEqualToString:CK2LibSSH2ErrorDomain] && [error code] == LIBSSH2_ERROR_SOCKET_RECV)
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0)
         {
-            NSMutableDictionary *userInfo = [[NSMutableDictionary alloc] initWithDictionary:[error userInfo]];
-            [userInfo setObject:@"Connection closed by remote host" forKey:NSLocalizedDescriptionKey];
-            [userInfo setObject:error forKey:NSUnderlyingErrorKey];
+            _fileSize = info.st_size;
+            _modificationDate = info.st_mtimespec;
             
-            error = [NSError errorWithDomain:[error domain] code:[error code] userInfo:userInfo];
-            [userInfo release];
+            long pageSize = getpagesize();
+            _allocatedLength = (size_t)((info.st_size + pageSize - 1) / pageSize) * pageSize;
+            
+            _bytes = mmap(NULL, _allocatedLength, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+            if (_bytes == MAP_FAILED) _bytes = NULL;
+            
+            // Lock before filling in, so the contents never reach swap. Not all processes are allowed to lock as much as they like, in which case carry on without
+            if (_bytes && lock) _locked = (mlock(_bytes, _allocatedLength) == 0);
+            
+            size_t offset = 0;
+            while (_bytes && offset < (size_t)info.st_size)
+            {
+                ssize_t count = read(fd, _bytes + offset, info.st_size - offset);
+                if (count <= 0)
+                {
+                    if (count < 0 && errno == EINTR) continue;
+                    break;
+                }
+                offset += count;
+            }
+            
+            _length = offset;
         }
         
-        // Normally when tearing down after an error, the session is disconnected. For some scenarios that triggers a SIGPIPE since the session was never started up successfully, so do our own teardown here to avoid that. #169357
-        libssh2_session_free(_session); _session = NULL;
+        close(fd);
         
-        return [self failWithError:error];
+        if (!_length)
+        {
+            [self release];
+            return nil;
+        }
     }
-    
-    
-    // Want to know if get disconnected
-    libssh2_session_callback_set(_session, LIBSSH2_CALLBACK_DISCONNECT, &disconnect_callback);
-    
-    
-    [self startAuthentication];
+    return self;
 }
 
-- (void)cancel;
+- (void)dealloc;
 {
-    // Cancel current auth. e.g had too many auth attempts and so server disconnected us
-    if (_challenge)
-    {
-        [_delegate SFTPSession:self didCancelAuthenticationChallenge:_challenge];
-        [_challenge release]; _challenge = nil;
-    }
-    
-    [_URL release]; _URL = nil;
-    
-    libssh2_sftp_shutdown(_sftp); _sftp = NULL;
-    
-    
-    BOOL logged = NO;
-    if (_session)
-    {
-        [_delegate SFTPSession:self appendStringToTranscript:@"Disconnecting from server…" received:NO];
-        logged = YES;
-        
-        libssh2_session_disconnect(_session, "Normal Shutdown, Thank you");
-        libssh2_session_free(_session); _session = NULL;
-    }
-    
-    if (_socket)
+    if (_bytes)
     {
-        if (!logged) [_delegate SFTPSession:self appendStringToTranscript:@"Disconnecting from server…" received:NO];
+        // Through a volatile pointer, so the compiler can't decide the writes are dead and skip them
+        volatile char *byte = _bytes;
+        size_t count = _length;
+        while (count--) *byte++ = 0;
         
-        CFSocketInvalidate(_socket);
-        CFRelease(_socket); _socket = NULL;
+        if (_locked) munlock(_bytes, _allocatedLength);
+        munmap(_bytes, _allocatedLength);
     }
     
-    _delegate = nil;    // do once all messages have been sent to it
+    [super dealloc];
+}
+
+@synthesize bytes = _bytes;
+@synthesize length = _length;
+
+- (BOOL)matchesFileAtURL:(NSURL *)URL;
+{
+    struct stat info;
+    if (stat([[URL path] fileSystemRepresentation], &info) != 0) return NO;
+    
+    return (info.st_size == _fileSize &&
+            info.st_mtimespec.tv_sec == _modificationDate.tv_sec &&
+            info.st_mtimespec.tv_nsec == _modificationDate.tv_nsec);
+}
+
+@synthesize lastUsed = _lastUsed;
+
+@end
+
+
+
+#define CK2SFTPPrivateKeyIdleLifetime (30 * 60.0)   // how long a cached key may go unused before it's dropped
+
+
+// Key files read in so far, shared between all sessions so reconnecting doesn't touch the disk (or a sandboxed app's security-scoped access) again. Access is synchronized
+// Keys are cached by path, so any credential naming the same file gets the benefit. That's limited to keys in recent use: once idle for CK2SFTPPrivateKeyIdleLifetime they have to be read in again, which means going through the sandbox afresh
+@interface CK2SFTPPrivateKeyCache : NSObject
+{
+  @private
+    NSMutableDictionary *_keys; // path -> CK2SFTPKeyMaterial
+    BOOL                _locksMemory;
+}
+
++ (CK2SFTPPrivateKeyCache *)sharedCache;
+
+@property BOOL locksMemory; // applies to keys read from then on. Defaults to YES
+
+- (CK2SFTPKeyMaterial *)keyMaterialForURL:(NSURL *)URL;
+
+// Reads the file in, replacing any cached copy. nil if it can't be read; it's left for libssh2 to report why
+- (CK2SFTPKeyMaterial *)addKeyMaterialWithContentsOfURL:(NSURL *)URL;
+
+- (void)removeKeyMaterialForURL:(NSURL *)URL;
+- (void)removeAllKeyMaterial;
+
+@end
+
+
+@implementation CK2SFTPPrivateKeyCache
+
++ (CK2SFTPPrivateKeyCache *)sharedCache;
+{
+    static CK2SFTPPrivateKeyCache *cache;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        cache = [[CK2SFTPPrivateKeyCache alloc] init];
+    });
+    
+    return cache;
+}
+
+- (id)init;
+{
+    if (self = [super init])
+    {
+        _keys = [[NSMutableDictionary alloc] init];
+        _locksMemory = YES;
+    }
+    return self;
+}
+
+- (void)dealloc;
+{
+    [_keys release];
+    [super dealloc];
+}
+
+@synthesize locksMemory = _locksMemory;
+
+// Call while synchronized
+- (void)removeIdleKeyMaterial;
+{
+    NSTimeInterval cutoff = [NSDate timeIntervalSinceReferenceDate] - CK2SFTPPrivateKeyIdleLifetime;
+    
+    NSString *aPath;
+    for (aPath in [_keys allKeys])
+    {
+        if ([[_keys objectForKey:aPath] lastUsed] < cutoff) [_keys removeObjectForKey:aPath];
+    }
+}
+
+- (CK2SFTPKeyMaterial *)keyMaterialForURL:(NSURL *)URL;
+{
+    @synchronized(self)
+    {
+        [self removeIdleKeyMaterial];
+        
+        CK2SFTPKeyMaterial *result = [_keys objectForKey:[[URL path] stringByStandardizingPath]];
+        [result setLastUsed:[NSDate timeIntervalSinceReferenceDate]];
+        
+        // Retain so a concurrent removal doesn't wipe the key out from under the caller
+        return [[result retain] autorelease];
+    }
+}
+
+- (CK2SFTPKeyMaterial *)addKeyMaterialWithContentsOfURL:(NSURL *)URL;
+{
+    CK2SFTPKeyMaterial *result = [[CK2SFTPKeyMaterial alloc] initWithContentsOfURL:URL lock:[self locksMemory]];
+    if (!result) return nil;
+    
+    [result setLastUsed:[NSDate timeIntervalSinceReferenceDate]];
+    
+    @synchronized(self)
+    {
+        [self removeIdleKeyMaterial];
+        [_keys setObject:result forKey:[[URL path] stringByStandardizingPath]];
+    }
+    
+    return [result autorelease];
+}
+
+- (void)removeKeyMaterialForURL:(NSURL *)URL;
+{
+    @synchronized(self)
+    {
+        [_keys removeObjectForKey:[[URL path] stringByStandardizingPath]];
+    }
+}
+
+- (void)removeAllKeyMaterial;
+{
+    @synchronized(self)
+    {
+        [_keys removeAllObjects];
+    }
+}
+
+@end
+
+#endif
+
+
+
+#define CK2SFTPResolutionDelay 0.05         // how long RFC 8305 waits for IPv6 addresses once IPv4 ones are in
+#define CK2SFTPConnectionAttemptDelay 0.25  // how long RFC 8305 gives each connection attempt before starting the next alongside
+#define CK2SFTPResolvedAddressLifetime 60.0 // getaddrinfo doesn't pass on record TTLs, so results are trusted for this long
+
+
+// Connects in the style of RFC 8305 ("Happy Eyeballs"). IPv6 and IPv4 addresses are looked up in parallel, off the calling thread, and connection attempts alternate between the two families, a short while apart, using whichever connects first
+// Resolved addresses are remembered for a while, shared between all sessions, so access is synchronized
+@interface CK2SFTPHostConnector : NSObject
+{
+  @private
+    NSMutableDictionary *_addresses;    // "host:port" -> [addresses, expiry]
+}
+
++ (CK2SFTPHostConnector *)sharedConnector;
+
+// Returns a connected, non-blocking socket, or -1 upon error. address is filled in with the sockaddr connected to, and resolutionDuration with how long it took for the first addresses to be ready
+- (int)connectToHost:(NSString *)host port:(NSInteger)port timeout:(NSTimeInterval)timeout address:(NSData **)address resolutionDuration:(NSTimeInterval *)resolutionDuration error:(NSError **)error;
+
+@end
+
+
+// Returns an array of sockaddr NSData objects, retained, or nil and fills in status upon failure
+static NSArray *CK2SFTPCreateResolvedAddresses(NSString *host, NSInteger port, int family, int *status)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    
+    char service[8];
+    snprintf(service, sizeof(service), "%ld", (long)port);
+    
+    struct addrinfo *info;
+    *status = getaddrinfo([host UTF8String], service, &hints, &info);
+    if (*status != 0) return nil;
+    
+    NSMutableArray *result = [[NSMutableArray alloc] init];
+    struct addrinfo *anInfo;
+    for (anInfo = info; anInfo; anInfo = anInfo->ai_next)
+    {
+        NSData *address = [[NSData alloc] initWithBytes:anInfo->ai_addr length:anInfo->ai_addrlen];
+        [result addObject:address];
+        [address release];
+    }
+    
+    freeaddrinfo(info);
+    return result;
+}
+
+
+@implementation CK2SFTPHostConnector
+
++ (CK2SFTPHostConnector *)sharedConnector;
+{
+    static CK2SFTPHostConnector *connector;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        connector = [[CK2SFTPHostConnector alloc] init];
+    });
+    
+    return connector;
+}
+
+- (id)init;
+{
+    if (self = [super init])
+    {
+        _addresses = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc;
+{
+    [_addresses release];
+    [super dealloc];
+}
+
+#pragma mark Address Cache
+
+- (NSArray *)cachedAddressesForKey:(NSString *)key;
+{
+    @synchronized(self)
+    {
+        NSArray *entry = [_addresses objectForKey:key];
+        if (!entry) return nil;
+        
+        if ([[entry objectAtIndex:1] doubleValue] < CFAbsoluteTimeGetCurrent())
+        {
+            [_addresses removeObjectForKey:key];
+            return nil;
+        }
+        
+        return [[[entry objectAtIndex:0] retain] autorelease];
+    }
+}
+
+- (void)cacheAddresses:(NSArray *)addresses forKey:(NSString *)key;
+{
+    @synchronized(self)
+    {
+        if (addresses)
+        {
+            NSNumber *expiry = [NSNumber numberWithDouble:(CFAbsoluteTimeGetCurrent() + CK2SFTPResolvedAddressLifetime)];
+            [_addresses setObject:[NSArray arrayWithObjects:addresses, expiry, nil] forKey:key];
+        }
+        else
+        {
+            [_addresses removeObjectForKey:key];
+        }
+    }
+}
+
+#pragma mark Connecting
+
+- (int)connectToHost:(NSString *)host port:(NSInteger)port timeout:(NSTimeInterval)timeout address:(NSData **)address resolutionDuration:(NSTimeInterval *)resolutionDuration error:(NSError **)error;
+{
+    NSParameterAssert(host);
+    
+    NSString *key = [NSString stringWithFormat:@"%@:%ld", [host lowercaseString], (long)port];
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    CFAbsoluteTime deadline = start + timeout;
+    if (resolutionDuration) *resolutionDuration = 0.0;
+    
+    NSMutableArray *addresses6 = [NSMutableArray array];    // yet to be tried
+    NSMutableArray *addresses4 = [NSMutableArray array];
+    NSMutableArray *allAddresses = [NSMutableArray array];
+    BOOL have6 = NO, have4 = NO;    // whether each family's lookup has been taken into account
+    int nextFamily = AF_INET6;
+    
+    // Lookups complete into here, keyed by family, signalling as they do. nil until a new lookup is needed
+    NSMutableDictionary *lookups = nil;
+    dispatch_semaphore_t resolved = NULL;
+    CFAbsoluteTime lookup4CompletedAt = 0.0;
+    
+    NSArray *cached = [self cachedAddressesForKey:key];
+    if (cached)
+    {
+        for (NSData *anAddress in cached)
+        {
+            [(((const struct sockaddr *)[anAddress bytes])->sa_family == AF_INET6 ? addresses6 : addresses4) addObject:anAddress];
+        }
+        [allAddresses addObjectsFromArray:cached];
+        have6 = have4 = YES;
+        
+        // Start with whichever family worked last time
+        if ([cached count]) nextFamily = ((const struct sockaddr *)[[cached objectAtIndex:0] bytes])->sa_family;
+    }
+    else
+    {
+        lookups = [NSMutableDictionary dictionaryWithCapacity:2];
+        resolved = dispatch_semaphore_create(0);
+        
+        int families[] = { AF_INET6, AF_INET };
+        int i;
+        for (i = 0; i < 2; i++)
+        {
+            int family = families[i];
+            dispatch_retain(resolved);  // a lookup can outlast connecting
+            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+                int status;
+                NSArray *result = CK2SFTPCreateResolvedAddresses(host, port, family, &status);
+                @synchronized(lookups)
+                {
+                    [lookups setObject:(result ? (id)result : [NSNumber numberWithInt:status]) forKey:[NSNumber numberWithInt:family]];
+                }
+                [result release];
+                
+                dispatch_semaphore_signal(resolved);
+                dispatch_release(resolved);
+            });
+        }
+    }
+    
+    
+    NSMutableArray *attempts = [NSMutableArray array];          // in-flight sockets
+    NSMutableArray *attemptAddresses = [NSMutableArray array];
+    CFAbsoluteTime nextAttemptAt = 0.0;
+    int lastErrno = 0;
+    int lookupStatus = 0;
+    int result = -1;
+    NSData *winner = nil;
+    
+    while (result < 0)
+    {
+        CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+        
+        // Take in lookups as they complete. IPv4 addresses are held back briefly in the hope IPv6 ones are about to follow
+        if (lookups && !(have6 && have4))
+        {
+            @synchronized(lookups)
+            {
+                id lookup6 = [lookups objectForKey:[NSNumber numberWithInt:AF_INET6]];
+                if (lookup6 && !have6)
+                {
+                    have6 = YES;
+                    if ([lookup6 isKindOfClass:[NSArray class]]) [addresses6 addObjectsFromArray:lookup6];
+                    else lookupStatus = [lookup6 intValue];
+                }
+                
+                id lookup4 = [lookups objectForKey:[NSNumber numberWithInt:AF_INET]];
+                if (lookup4 && !have4)
+                {
+                    if (lookup4CompletedAt == 0.0) lookup4CompletedAt = now;
+                    if (have6 || now >= lookup4CompletedAt + CK2SFTPResolutionDelay)
+                    {
+                        have4 = YES;
+                        if ([lookup4 isKindOfClass:[NSArray class]]) [addresses4 addObjectsFromArray:lookup4];
+                        else lookupStatus = [lookup4 intValue];
+                    }
+                }
+                
+                if (have6 && have4)
+                {
+                    if ([lookup6 isKindOfClass:[NSArray class]]) [allAddresses addObjectsFromArray:lookup6];
+                    if ([lookup4 isKindOfClass:[NSArray class]]) [allAddresses addObjectsFromArray:lookup4];
+                }
+            }
+        }
+        
+        
+        // Start another attempt if the previous one's had long enough
+        if (([addresses6 count] || [addresses4 count]) && now >= nextAttemptAt)
+        {
+            if (nextAttemptAt == 0.0 && resolutionDuration) *resolutionDuration = now - start;  // the first attempt marks the end of resolving
+            
+            NSMutableArray *candidates = (nextFamily == AF_INET6 ? addresses6 : addresses4);
+            if (![candidates count]) candidates = (candidates == addresses6 ? addresses4 : addresses6);
+            
+            NSData *candidate = [[candidates objectAtIndex:0] retain];
+            [candidates removeObjectAtIndex:0];
+            
+            const struct sockaddr *sockaddr = [candidate bytes];
+            nextFamily = (sockaddr->sa_family == AF_INET6 ? AF_INET : AF_INET6);
+            
+            int sock = socket(sockaddr->sa_family, SOCK_STREAM, 0);
+            if (sock >= 0)
+            {
+                // Should the connection be broken, we'd rather fail with an error than head into SIGPIPE
+                int yes = 1;
+                setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(int));
+                fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+                
+                if (connect(sock, sockaddr, (socklen_t)[candidate length]) == 0 || errno == EINPROGRESS)
+                {
+                    [attempts addObject:[NSNumber numberWithInt:sock]];
+                    [attemptAddresses addObject:candidate];
+                    nextAttemptAt = now + CK2SFTPConnectionAttemptDelay;
+                }
+                else
+                {
+                    lastErrno = errno;
+                    close(sock);
+                    nextAttemptAt = now;    // no point waiting on a lost cause
+                }
+            }
+            else
+            {
+                lastErrno = errno;
+            }
+            
+            [candidate release];
+        }
+        
+        
+        BOOL resolving = (lookups && !(have6 && have4));
+        BOOL pending = ([addresses6 count] || [addresses4 count]);
+        if (![attempts count] && !pending && !resolving) break;     // nothing left to try
+        if (now >= deadline)
+        {
+            lastErrno = ETIMEDOUT;
+            break;
+        }
+        
+        // Wait on the attempts so far, until it's time to take in lookups or start another attempt
+        NSTimeInterval wait = deadline - now;
+        if (pending) wait = MIN(wait, nextAttemptAt - now);
+        
+        NSUInteger count = [attempts count];
+        if (resolving && !count && !pending)
+        {
+            // Nothing to do but wait for a lookup. IPv4 addresses held back in the hope of IPv6 ones are taken in once the resolution delay is up, without being signalled again
+            dispatch_semaphore_wait(resolved, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(MIN(wait, CK2SFTPResolutionDelay) * NSEC_PER_SEC)));
+            continue;
+        }
+        
+        // With attempts underway, more addresses are only wanted once it's time for another attempt, or one fails, which poll() hears about anyway
+        if (resolving) wait = MIN(wait, MAX(nextAttemptAt - now, CK2SFTPResolutionDelay));
+        
+        struct pollfd *fds = calloc(MAX(count, 1), sizeof(struct pollfd));
+        NSUInteger i;
+        for (i = 0; i < count; i++)
+        {
+            fds[i].fd = [[attempts objectAtIndex:i] intValue];
+            fds[i].events = POLLOUT;
+        }
+        
+        int ready = poll(fds, (nfds_t)count, (int)(MAX(wait, 0.0) * 1000.0));
+        
+        if (ready > 0)
+        {
+            for (i = count; i > 0; i--)
+            {
+                struct pollfd *aPollfd = &fds[i - 1];
+                if (!aPollfd->revents) continue;
+                
+                int socketError = 0;
+                socklen_t length = sizeof(socketError);
+                if (getsockopt(aPollfd->fd, SOL_SOCKET, SO_ERROR, &socketError, &length) != 0) socketError = errno;
+                
+                if (socketError == 0 && (aPollfd->revents & POLLOUT) && result < 0)
+                {
+                    result = aPollfd->fd;
+                    winner = [[[attemptAddresses objectAtIndex:(i - 1)] retain] autorelease];
+                }
+                else
+                {
+                    lastErrno = (socketError ? socketError : ECONNREFUSED);
+                    close(aPollfd->fd);
+                    nextAttemptAt = now;    // a failure is the cue to try the next address straight away
+                }
+                
+                [attempts removeObjectAtIndex:(i - 1)];
+                [attemptAddresses removeObjectAtIndex:(i - 1)];
+            }
+        }
+        
+        free(fds);
+    }
+    
+    // Abandon whichever attempts lost the race
+    for (NSNumber *aSocket in attempts)
+    {
+        close([aSocket intValue]);
+    }
+    
+    if (resolved) dispatch_release(resolved);
+    
+    
+    if (result >= 0)
+    {
+        // Remember what worked, putting it first for next time. Only once both lookups are in though, else a family would be left out
+        if (have6 && have4)
+        {
+            NSMutableArray *ordered = [NSMutableArray arrayWithArray:allAddresses];
+            [ordered removeObject:winner];
+            [ordered insertObject:winner atIndex:0];
+            [self cacheAddresses:ordered forKey:key];
+        }
+        
+        if (address) *address = winner;
+        return result;
+    }
+    
+    
+    // Something stale may be to blame
+    [self cacheAddresses:nil forKey:key];
+    
+    if (error)
+    {
+        if (![allAddresses count] && have6 && have4 && lastErrno == 0)
+        {
+            NSString *description = (lookupStatus ? [NSString stringWithUTF8String:gai_strerror(lookupStatus)] : @"No addresses found");
+            *error = [NSError errorWithDomain:NSURLErrorDomain
+                                         code:NSURLErrorCannotFindHost
+                                     userInfo:[NSDictionary dictionaryWithObjectsAndKeys:
+                                               @"Cannot find host", NSLocalizedDescriptionKey,
+                                               description, NSLocalizedFailureReasonErrorKey,
+                                               nil]];
+        }
+        else
+        {
+            NSError *underlyingError = [NSError errorWithDomain:NSPOSIXErrorDomain code:lastErrno userInfo:nil];
+            *error = [NSError errorWithDomain:NSURLErrorDomain
+                                         code:(lastErrno == ETIMEDOUT ? NSURLErrorTimedOut : NSURLErrorCannotConnectToHost)
+                                     userInfo:[NSDictionary dictionaryWithObjectsAndKeys:
+                                               @"Cannot connect to host", NSLocalizedDescriptionKey,
+                                               underlyingError, NSUnderlyingErrorKey,
+                                               nil]];
+        }
+    }
+    
+    return -1;
+}
+
+@end
+
+
+
+#pragma mark -
+
+
+@interface CK2SFTPConnectionTimings ()
+@property(nonatomic, readwrite) NSTimeInterval resolutionDuration;
+@property(nonatomic, readwrite) NSTimeInterval connectDuration;
+@property(nonatomic, readwrite) NSTimeInterval handshakeDuration;
+@property(nonatomic, readwrite) NSTimeInterval authenticationListDuration;
+@property(nonatomic, readwrite) NSTimeInterval SFTPInitializationDuration;
+- (void)addAuthenticationAttemptWithScheme:(NSString *)scheme startTime:(CFAbsoluteTime)start succeeded:(BOOL)succeeded;
+@end
+
+
+@implementation CK2SFTPConnectionTimings
+
+- (id)init;
+{
+    if (self = [super init])
+    {
+        _authenticationAttempts = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc;
+{
+    [_authenticationAttempts release];
+    [super dealloc];
+}
+
+@synthesize resolutionDuration = _resolutionDuration;
+@synthesize connectDuration = _connectDuration;
+@synthesize handshakeDuration = _handshakeDuration;
+@synthesize authenticationListDuration = _authenticationListDuration;
+@synthesize SFTPInitializationDuration = _SFTPInitializationDuration;
+
+- (NSArray *)authenticationAttempts; { return [[_authenticationAttempts copy] autorelease]; }
+
+- (void)addAuthenticationAttemptWithScheme:(NSString *)scheme startTime:(CFAbsoluteTime)start succeeded:(BOOL)succeeded;
+{
+    [_authenticationAttempts addObject:[NSDictionary dictionaryWithObjectsAndKeys:
+                                        scheme, CK2SFTPTimingAuthenticationSchemeKey,
+                                        [NSNumber numberWithDouble:(CFAbsoluteTimeGetCurrent() - start)], CK2SFTPTimingDurationKey,
+                                        [NSNumber numberWithBool:succeeded], CK2SFTPTimingSucceededKey,
+                                        nil]];
+}
+
+- (NSString *)description;
+{
+    return [NSString stringWithFormat:@"%@ resolution: %.3fs, connect: %.3fs, handshake: %.3fs, auth list: %.3fs, auth attempts: %lu, SFTP init: %.3fs",
+            [super description],
+            _resolutionDuration, _connectDuration, _handshakeDuration, _authenticationListDuration,
+            (unsigned long)[_authenticationAttempts count],
+            _SFTPInitializationDuration];
+}
+
+@end
+
+
+#pragma mark -
+
+
+
+@implementation CK2SFTPSession
+
+- (NSInteger)portForURL:(NSURL *)URL;
+{
+    NSNumber *result = [URL port];
+    return (result ? [result integerValue] : 22);
+}
+
+#pragma mark Lifecycle
+
+- (id)initWithURL:(NSURL *)URL delegate:(id <CK2SFTPSessionDelegate>)delegate;
+{
+    return [self initWithURL:URL delegate:delegate startImmediately:YES];
+}
+
+- (id)initWithURL:(NSURL *)URL delegate:(id <CK2SFTPSessionDelegate>)delegate startImmediately:(BOOL)startImmediately;
+{
+    NSParameterAssert(URL);
+    
+    if (self = [self init])
+    {
+        _URL = [URL copy];
+        _delegate = delegate;
+        _kqueue = -1;
+        _timeout = 60.0;
+        _transportLock = [[NSRecursiveLock alloc] init];
+        _metadataCache = [[CK2SFTPMetadataCache alloc] init];
+        _bufferPool = [[CK2SFTPBufferPool alloc] init];
+    }
+    
+    if (startImmediately) [self start];
+    
+    return self;
+}
+
+void disconnect_callback(LIBSSH2_SESSION *session, int reason, const char *message, int message_len, const char *language, int language_len, void **abstract)
+{
+    CK2SFTPSession *self = *abstract;
+    
+    // Build a raw error to encapsulate the disconnect
+    NSMutableDictionary *userInfo = [[NSMutableDictionary alloc] initWithCapacity:2];
+    if (message)
+    {
+        NSString *string = [[NSString alloc] initWithBytes:message length:message_len encoding:NSUTF8StringEncoding];
+        [userInfo setObject:string forKey:NSLocalizedDescriptionKey];
+        [string release];
+    }
+    if (language)
+    {
+        NSString *string = [[NSString alloc] initWithBytes:language length:language_len encoding:NSUTF8StringEncoding];
+        [userInfo setObject:string forKey:@"language"];
+        [string release];
+    }
+    
+    NSError *error = [NSError errorWithDomain:CK2SSHDisconnectErrorDomain code:reason userInfo:userInfo];
+    [userInfo release];
+    
+    [self failWithError:error];
+}
+
+- (void)start;
+{
+    if (_session) return;   // already started
+    
+    
+    // libssh2's global state (the crypto backend chiefly) is set up once for the life of the process. Sessions come and go on many threads at once, and neither libssh2_init() nor libssh2_exit() is thread-safe, so it's never torn down
+    static dispatch_once_t initOnce;
+    dispatch_once(&initOnce, ^{
+        libssh2_init(0);
+    });
+    
+    /* Create a session instance */
+    _session = libssh2_session_init_ex(NULL, NULL, NULL, self);
+    if (!_session)
+    {
+        NSError *error = [NSError errorWithDomain:CK2LibSSH2ErrorDomain
+                                             code:0
+                                         userInfo:[NSDictionary dictionaryWithObject:@"libssh2 session initialization failed"
+                                                                              forKey:NSLocalizedDescriptionKey]];
+        
+        return [self failWithError:error];
+    }
+    
+    
+    /*
+     * The application code is responsible for creating the socket
+     * and establishing the connection
+     */
+    NSString *hostName = [_URL host];
+    NSString *transcript = [NSString stringWithFormat:@"Connecting to %@", hostName];
+    NSNumber *port = [_URL port];
+    if (port) transcript = [transcript stringByAppendingFormat:@":%@", port];
+    [_delegate SFTPSession:self appendStringToTranscript:transcript received:NO];
+    
+    [_connectionTimings release]; _connectionTimings = [[CK2SFTPConnectionTimings alloc] init];
+    CFAbsoluteTime phaseStart = CFAbsoluteTimeGetCurrent();
+    
+    NSError *connectError;
+    NSData *address;
+    NSTimeInterval resolutionDuration;
+    int sock = [[CK2SFTPHostConnector sharedConnector] connectToHost:hostName
+                                                                port:[self portForURL:_URL]
+                                                             timeout:_timeout
+                                                             address:&address
+                                                  resolutionDuration:&resolutionDuration
+                                                               error:&connectError];
+    
+    [_connectionTimings setResolutionDuration:resolutionDuration];
+    [_connectionTimings setConnectDuration:(CFAbsoluteTimeGetCurrent() - phaseStart - resolutionDuration)];
+    
+    if (sock < 0) return [self failWithError:connectError];
+    
+    char addressString[NI_MAXHOST];
+    if (getnameinfo([address bytes], (socklen_t)[address length], addressString, sizeof(addressString), NULL, 0, NI_NUMERICHOST) == 0)
+    {
+        [_delegate SFTPSession:self
+      appendStringToTranscript:[NSString stringWithFormat:@"Connected to %s", addressString]
+                      received:YES];
+    }
+    
+    _socket = CFSocketCreateWithNative(NULL, sock, 0, NULL, NULL);  // closes the socket once invalidated
+    if (!_socket)
+    {
+        close(sock);
+        
+        NSError *error = [NSError errorWithDomain:NSURLErrorDomain
+                                             code:NSURLErrorUnknown
+                                         userInfo:[NSDictionary dictionaryWithObject:@"Error creating socket"
+                                                                              forKey:NSLocalizedDescriptionKey]];
+        
+        return [self failWithError:error];
+    }
+    
+    
+    /* Run libssh2 non-blocking, waiting on the socket ourselves through a kqueue
+     * rather than having libssh2 do so internally
+     */
+    _kqueue = CK2SFTPCreateKqueue();
+    if (_kqueue < 0)
+    {
+        NSError *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        return [self failWithError:error];
+    }
+    
+    libssh2_session_set_blocking(_session, 0);
+    
+    
+    /* ... start it up. This will trade welcome banners, exchange keys,
+     * and setup crypto, compression, and MAC layers
+     */
+    
+    phaseStart = CFAbsoluteTimeGetCurrent();
+    int handshakeResult = CK2SFTPRetry(self, libssh2_session_handshake(_session, CFSocketGetNative(_socket)));
+    [_connectionTimings setHandshakeDuration:(CFAbsoluteTimeGetCurrent() - phaseStart)];
+    
+    if (handshakeResult)
+    {
+        NSError *error = [self sessionError];
+        
+        // Fill in more user-friendly description when it looks like the server booted us off
+        if ([[error domain] isEqualToString:CK2LibSSH2ErrorDomain] && [error code] == LIBSSH2_ERROR_SOCKET_RECV)
+        {
+            NSMutableDictionary *userInfo = [[NSMutableDictionary alloc] initWithDictionary:[error userInfo]];
+            [userInfo setObject:@"Connection closed by remote host" forKey:NSLocalizedDescriptionKey];
+            [userInfo setObject:error forKey:NSUnderlyingErrorKey];
+            
+            error = [NSError errorWithDomain:[error domain] code:[error code] userInfo:userInfo];
+            [userInfo release];
+        }
+        
+        // Normally when tearing down after an error, the session is disconnected. For some scenarios that triggers a SIGPIPE since the session was never started up successfully, so do our own teardown here to avoid that. #169357
+        libssh2_session_free(_session); _session = NULL;
+        
+        return [self failWithError:error];
+    }
+    
+    
+    // Want to know if get disconnected
+    libssh2_session_callback_set(_session, LIBSSH2_CALLBACK_DISCONNECT, &disconnect_callback);
+    
+    
+    [self startAuthentication];
+}
+
+- (void)cancel;
+{
+    // Shutting down politely is only worth a short wait; a dead connection shouldn't hold up cancelling for the full timeout at each step
+    _timeout = MIN(_timeout, CK2SFTPTeardownTimeout);
+    
+    // Channels go first, while the connection they share is still up. They remove themselves from _channels as they go, under the transport lock, so work through a snapshot of it
+    [_transportLock lock];
+    NSArray *channels = [[_channels valueForKey:@"nonretainedObjectValue"] copy];
+    [_transportLock unlock];
+    
+    [channels makeObjectsPerformSelector:@selector(cancel)];
+    [channels release];
+    
+    [_transportLock lock];
+    [_channels release]; _channels = nil;
+    [_transportLock unlock];
+    
+    if (_transportOwner) return [self cancelChannel];
+    
+    
+    // Cancel current auth. e.g had too many auth attempts and so server disconnected us
+    if (_challenge)
+    {
+        [_delegate SFTPSession:self didCancelAuthenticationChallenge:_challenge];
+        [_challenge release]; _challenge = nil;
+    }
+    
+    [_URL release]; _URL = nil;
+    
+    if (_sftp)
+    {
+        CK2SFTPRetry(self, libssh2_sftp_shutdown(_sftp)); _sftp = NULL;
+    }
+    
+    
+    BOOL logged = NO;
+    if (_session)
+    {
+        [_delegate SFTPSession:self appendStringToTranscript:@"Disconnecting from server…" received:NO];
+        logged = YES;
+        
+        CK2SFTPRetry(self, libssh2_session_disconnect(_session, "Normal Shutdown, Thank you"));
+        libssh2_session_free(_session); _session = NULL;
+    }
+    
+    if (_socket)
+    {
+        if (!logged) [_delegate SFTPSession:self appendStringToTranscript:@"Disconnecting from server…" received:NO];
+        
+        CFSocketInvalidate(_socket);
+        CFRelease(_socket); _socket = NULL;
+    }
+    
+    if (_kqueue >= 0)
+    {
+        close(_kqueue); _kqueue = -1;
+    }
+    
+    _delegate = nil;    // do once all messages have been sent to it
+}
+
+- (void)dealloc
+{
+    [self cancel];  // performs all teardown of ivars
+    [_transportLock release];
+    [_metadataCache release];
+    [_bufferPool release];
+    [_connectionTimings release];
+    [_lastErrorMessage release];
+    [super dealloc];
+}
+
+#pragma mark Flow Control
+
+@synthesize receiveWindowSize = _receiveWindowSize;
+- (void)setReceiveWindowSize:(unsigned long)size;
+{
+    _receiveWindowSize = size;
+    [self maintainReceiveWindow];
+}
+
+- (void)maintainReceiveWindow;
+{
+#if LIBSSH2_VERSION_NUM >= 0x010400
+    if (!_receiveWindowSize || !_sftp) return;
+    
+    [_transportLock lock];
+    LIBSSH2_CHANNEL *channel = libssh2_sftp_get_channel(_sftp);
+    unsigned long window = libssh2_channel_window_read_ex(channel, NULL, NULL);
+    [_transportLock unlock];
+    
+    // Adjusting costs a packet, so wait until a good part of the window is used up
+    if (window < _receiveWindowSize / 2)
+    {
+        CK2SFTPRetry(self, libssh2_channel_receive_window_adjust2(channel, (_receiveWindowSize - window), 1, NULL));
+    }
+#endif
+}
+
+#pragma mark Buffers
+
+- (void *)borrowBuffer; { return [_bufferPool borrowBuffer]; }
+- (void)returnBuffer:(void *)buffer; { [_bufferPool returnBuffer:buffer]; }
+
+#pragma mark Channels
+
+- (id)initWithSFTPChannel:(LIBSSH2_SFTP *)sftp transportOwner:(CK2SFTPSession *)owner;
+{
+    if (self = [self initWithURL:owner->_URL delegate:owner->_delegate startImmediately:NO])
+    {
+        _sftp = sftp;
+        _transportOwner = [owner retain];
+        
+        // Borrow the owner's connection
+        _session = owner->_session;
+        _socket = owner->_socket;
+        [_transportLock release]; _transportLock = [owner->_transportLock retain];
+        [_metadataCache release]; _metadataCache = [owner->_metadataCache retain];
+        [_bufferPool release]; _bufferPool = [owner->_bufferPool retain];
+        _timeout = owner->_timeout;
+        _receiveWindowSize = owner->_receiveWindowSize;
+        
+        // Each channel waits through its own kqueue so they don't steal each other's events
+        _kqueue = CK2SFTPCreateKqueue();
+    }
+    
+    return self;
+}
+
+- (CK2SFTPSession *)openSFTPChannel:(NSError **)error;
+{
+    CK2SFTPSession *owner = (_transportOwner ? _transportOwner : self);
+    
+    LIBSSH2_SFTP *sftp = (_sftp ? CK2SFTPRetryPointer(self, libssh2_sftp_init(_session)) : NULL);
+    if (!sftp)
+    {
+        if (error) *error = [self sessionError];
+        return nil;
+    }
+    
+    [_delegate SFTPSession:self appendStringToTranscript:@"Opened additional SFTP channel" received:NO];
+    
+    CK2SFTPSession *result = [[CK2SFTPSession alloc] initWithSFTPChannel:sftp transportOwner:owner];
+    [result setReceiveWindowSize:_receiveWindowSize];
+    
+    [_transportLock lock];
+    if (!owner->_channels) owner->_channels = [[NSMutableArray alloc] init];
+    [owner->_channels addObject:[NSValue valueWithNonretainedObject:result]];
+    [_transportLock unlock];
+    
+    return [result autorelease];
+}
+
+- (void)cancelChannel;
+{
+    _timeout = MIN(_timeout, CK2SFTPTeardownTimeout);
+    
+    if (_sftp)
+    {
+        CK2SFTPRetry(self, libssh2_sftp_shutdown(_sftp)); _sftp = NULL;
+    }
+    
+    [_transportLock lock];
+    [_transportOwner->_channels removeObject:[NSValue valueWithNonretainedObject:self]];
+    [_transportLock unlock];
+    
+    // The connection belongs to the owner, so merely forget it
+    _session = NULL;
+    _socket = NULL;
+    
+    if (_kqueue >= 0)
+    {
+        close(_kqueue); _kqueue = -1;
+    }
+    
+    [_URL release]; _URL = nil;
+    _delegate = nil;
+    [_transportOwner release]; _transportOwner = nil;
+}
+
+#pragma mark Error Handling
+
+- (NSError *)sessionErrorWithPath:(NSString *)path;
+{
+    if (!_session) return nil;
+    
+    // Prefer what was recorded for our own last call, as libssh2's last error is shared by all channels on the connection
+    [_transportLock lock];
+    int code = _lastErrorCode;
+    NSString *description = [_lastErrorMessage retain];
+    unsigned long sftpCode = _lastSFTPErrorCode;
+    
+    if (!code)
+    {
+        char *errormsg;
+        code = libssh2_session_last_error(_session, &errormsg, NULL, 0);
+        if (code) description = [[NSString alloc] initWithCString:errormsg encoding:NSUTF8StringEncoding];
+        if (code == LIBSSH2_ERROR_SFTP_PROTOCOL && _sftp) sftpCode = libssh2_sftp_last_error(_sftp);
+    }
+    [_transportLock unlock];
+    
+    if (code == 0) return nil;
+    
+    NSError *result = [NSError errorWithDomain:CK2LibSSH2ErrorDomain
+                                          code:code
+                                      userInfo:[NSDictionary dictionaryWithObjectsAndKeys:
+                                                description, NSLocalizedDescriptionKey,
+                                                path, NSFilePathErrorKey,
+                                                nil]];
+    [description release];
+    
+    
+    // Still being told to try again means -waitForSocket gave up
+    if (code == LIBSSH2_ERROR_EAGAIN)
+    {
+        result = [NSError errorWithDomain:NSURLErrorDomain
+                                     code:NSURLErrorTimedOut
+                                 userInfo:[NSDictionary dictionaryWithObjectsAndKeys:
+                                           @"The server stopped responding", NSLocalizedDescriptionKey,
+                                           result, NSUnderlyingErrorKey,
+                                           path, NSFilePathErrorKey,
+                                           nil]];
+    }
+    else if (code == LIBSSH2_ERROR_SFTP_PROTOCOL)
+    {
+        result = [NSError errorWithDomain:CK2LibSSH2SFTPErrorDomain
+                                     code:sftpCode
+                                 userInfo:[NSDictionary dictionaryWithObjectsAndKeys:
+                                           result, NSUnderlyingErrorKey,
+                                           path, NSFilePathErrorKey,
+                                           nil]];
+    }
+    
+    return result;
+}
+
+- (NSError *)sessionError;
+{
+    return [self sessionErrorWithPath:nil];
+}
+
+- (void)failWithError:(NSError *)error
+{
+    id delegate = _delegate;    // because -cancel will set it to nil
+    [self cancel];
+    
+    [delegate SFTPSession:self appendStringToTranscript:[error description] received:YES];
+    [self reportConnectionTimingsToDelegate:delegate];
+    [delegate SFTPSession:self didFailWithError:error];
+}
+
+#pragma mark Path Translation
+
+- (NSString *)resolveSymlink:(NSString *)path complex:(BOOL)complex error:(NSError **)error;
+{
+    if (complex)
+    {
+        NSString *cached = [_metadataCache objectForPath:path kind:CK2SFTPCachedRealpath];
+        if (cached) return cached;
+    }
+    
+    // Paths are short, so there's no call for a pooled buffer. This is plenty for the longest path a server's file system will hand back
+    char buffer[4 * PATH_MAX];
+    
+    const char *pathChar = [path UTF8String];
+    int linkType = (complex ? LIBSSH2_SFTP_REALPATH : LIBSSH2_SFTP_READLINK);
+    
+    int pathLength = CK2SFTPRetry(self, libssh2_sftp_symlink_ex(_sftp, pathChar, strlen(pathChar), buffer, sizeof(buffer), linkType));
+    
+    NSString *result = nil;
+    if ( pathLength >= 0 )
+    {
+        result = [[[NSString alloc] initWithBytes:buffer
+                                           length:pathLength
+                                         encoding:NSUTF8StringEncoding] autorelease];
+        
+        if (complex) [_metadataCache setObject:result forPath:path kind:CK2SFTPCachedRealpath];
+    }
+    else
+    {
+        if (error)
+        {
+            // I think it only makes sense to include the path in the error when resolving a symlink *file*
+            *error = (complex ? [self sessionError] : [self sessionErrorWithPath:path]);
+        }
+    }
+    
+    return result;
+}
+
+- (NSString *)destinationOfSymbolicLinkAtPath:(NSString *)path error:(NSError **)error;
+{
+    return [self resolveSymlink:path complex:NO error:error];
+}
+
+- (NSString *)currentDirectoryPath:(NSError **)error;
+{
+    return [self resolveSymlink:@"." complex:YES error:error];
+}
+
+#pragma mark Directories
+
+// Keep compatibility with CK without having to link to it
+#define cxFilenameKey @"cxFilenameKey"
+
+- (NSArray *)contentsOfDirectoryAtPath:(NSString *)path error:(NSError **)error;
+{
+    return [[self attributesOfContentsOfDirectoryAtPath:path error:error] valueForKey:cxFilenameKey];
+}
+
+- (NSArray *)attributesOfContentsOfDirectoryAtPath:(NSString *)path error:(NSError **)error;
+{
+    NSArray *cached = [_metadataCache objectForPath:path kind:CK2SFTPCachedContents];
+    if (cached) return cached;  // immutable, so safe to share between callers
+    
+    NSMutableArray *result = [NSMutableArray array];
+    
+    BOOL enumerated = [self enumerateContentsOfDirectoryAtPath:path usingBlock:^(NSDictionary *attributes, BOOL *stop) {
+        [result addObject:attributes];
+        
+        // Listings are as good as a stat of each item. A stat doesn't supply the name though, so leave it out for the cached attributes to match
+        if ([_metadataCache timeout] > 0.0)
+        {
+            NSMutableDictionary *itemAttributes = [attributes mutableCopy];
+            [itemAttributes removeObjectForKey:cxFilenameKey];
+            
+            [_metadataCache setObject:itemAttributes
+                              forPath:[path stringByAppendingPathComponent:[attributes objectForKey:cxFilenameKey]]
+                                 kind:CK2SFTPCachedAttributes];
+            [itemAttributes release];
+        }
+    } error:error];
+    
+    if (!enumerated) return nil;
+    
+    NSArray *listing = [[result copy] autorelease];
+    [_metadataCache setObject:listing forPath:path kind:CK2SFTPCachedContents];
+    return listing;
+}
+
+- (BOOL)enumerateContentsOfDirectoryAtPath:(NSString *)path usingBlock:(void (^)(NSDictionary *attributes, BOOL *stop))block error:(NSError **)error;
+{
+    NSParameterAssert(block);
+    
+    // Drain regularly so memory doesn't build up over large directories
+#define ENTRIES_PER_POOL 256
+    __block NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    __block NSUInteger count = 0;
+    
+    BOOL result = [self enumerateEntriesOfDirectoryAtPath:path usingBlock:^(const char *filename, size_t length, const LIBSSH2_SFTP_ATTRIBUTES *attributes, BOOL *stop) {
+        
+        NSString *name = [[NSString alloc] initWithBytes:filename length:length encoding:NSUTF8StringEncoding];
+        block([[self class] attributesWithFilename:name SFTPAttributes:attributes], stop);
+        [name release];
+        
+        if (++count % ENTRIES_PER_POOL == 0)
+        {
+            [pool drain]; pool = [[NSAutoreleasePool alloc] init];
+        }
+    } error:error];
+    
+    if (!result && error) [*error retain];  // keep alive past the pool
+    [pool drain];
+    if (!result && error) [*error autorelease];
+    
+    return result;
+}
+
+- (BOOL)enumerateEntriesOfDirectoryAtPath:(NSString *)path usingBlock:(void (^)(const char *filename, size_t length, const LIBSSH2_SFTP_ATTRIBUTES *attributes, BOOL *stop))block error:(NSError **)error;
+{
+    NSParameterAssert(block);
+    
+    LIBSSH2_SFTP_HANDLE *handle = CK2SFTPRetryPointer(self, libssh2_sftp_opendir(_sftp, [path UTF8String]));
+    if (!handle)
+    {
+        if (error) *error = [self sessionErrorWithPath:path];
+        return NO;
+    }
+    
+#define BUFFER_LENGTH 1024
+    char buffer[BUFFER_LENGTH];
+    BOOL stop = NO;
+    
+    // libssh2 hands out entries one at a time from each SSH_FXP_NAME batch as it arrives
+    int filenameLength;
+    do
+    {
+        LIBSSH2_SFTP_ATTRIBUTES attributes;
+        filenameLength = CK2SFTPRetry(self, libssh2_sftp_readdir(handle, buffer, BUFFER_LENGTH, &attributes));
+        
+        // Exclude . and .. as they're not Cocoa-like
+        if (filenameLength > 0 &&
+            !(filenameLength == 1 && buffer[0] == '.') &&
+            !(filenameLength == 2 && buffer[0] == '.' && buffer[1] == '.'))
+        {
+            block(buffer, filenameLength, &attributes, &stop);
+        }
+    }
+    while (filenameLength > 0 && !stop);
+    
+    BOOL result = YES;
+    if (filenameLength < 0) // an error!
+    {
+        result = NO;
+        if (error) *error = [self sessionErrorWithPath:path];
+    }
+    
+    CK2SFTPRetry(self, libssh2_sftp_closedir(handle));
+    return result;
+}
+
++ (NSString *)fileTypeWithSFTPPermissions:(unsigned long)permissions;
+{
+    if (LIBSSH2_SFTP_S_ISREG(permissions))
+    {
+        return NSFileTypeRegular;
+    }
+    else if (LIBSSH2_SFTP_S_ISDIR(permissions))
+    {
+        return NSFileTypeDirectory;
+    }
+    else if (LIBSSH2_SFTP_S_ISLNK(permissions))
+    {
+        return NSFileTypeSymbolicLink;
+    }
+    else if (LIBSSH2_SFTP_S_ISSOCK(permissions))
+    {
+        return NSFileTypeSocket;
+    }
+    else if (LIBSSH2_SFTP_S_ISCHR(permissions))
+    {
+        return NSFileTypeCharacterSpecial;
+    }
+    else if (LIBSSH2_SFTP_S_ISBLK(permissions))
+    {
+        return NSFileTypeBlockSpecial;
+    }
+    
+    return NSFileTypeUnknown;
+}
+
++ (NSDictionary *)attributesWithFilename:(NSString *)filename SFTPAttributes:(const LIBSSH2_SFTP_ATTRIBUTES *)attributes;
+{
+    NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:8];
+    if (filename) [result setObject:filename forKey:cxFilenameKey];
+    
+    // Servers only send what they choose to, as indicated by the flags
+    unsigned long flags = attributes->flags;
+    
+    if (flags & LIBSSH2_SFTP_ATTR_PERMISSIONS)
+    {
+        [result setObject:[self fileTypeWithSFTPPermissions:attributes->permissions] forKey:NSFileType];
+        [result setObject:[NSNumber numberWithUnsignedLong:(attributes->permissions & 07777)] forKey:NSFilePosixPermissions];
+    }
+    else
+    {
+        [result setObject:NSFileTypeUnknown forKey:NSFileType];
+    }
+    
+    if (flags & LIBSSH2_SFTP_ATTR_SIZE)
+    {
+        [result setObject:[NSNumber numberWithUnsignedLongLong:attributes->filesize] forKey:NSFileSize];
+    }
+    
+    if (flags & LIBSSH2_SFTP_ATTR_UIDGID)
+    {
+        [result setObject:[NSNumber numberWithUnsignedLong:attributes->uid] forKey:NSFileOwnerAccountID];
+        [result setObject:[NSNumber numberWithUnsignedLong:attributes->gid] forKey:NSFileGroupOwnerAccountID];
+    }
+    
+    if (flags & LIBSSH2_SFTP_ATTR_ACMODTIME)
+    {
+        [result setObject:[NSDate dateWithTimeIntervalSince1970:attributes->mtime] forKey:NSFileModificationDate];
+        [result setObject:[NSDate dateWithTimeIntervalSince1970:attributes->atime] forKey:CK2SFTPFileAccessDate];
+    }
+    
+    return result;
+}
+
+- (BOOL)createDirectoryAtPath:(NSString *)path mode:(long)mode error:(NSError **)error;
+{
+    int result = CK2SFTPRetry(self, libssh2_sftp_mkdir(_sftp, [path UTF8String], mode));
+    [_metadataCache removeObjectsForPath:path includingDescendants:NO];
+    
+    if (result == 0)
+    {
+        return YES;
+    }
+    else
+    {
+        if (error) *error = [self sessionErrorWithPath:path];
+        return NO;
+    }
+}
+
+- (BOOL)createDirectoryAtPath:(NSString *)path withIntermediateDirectories:(BOOL)createIntermediates mode:(long)mode error:(NSError **)outError;
+{
+    if (!createIntermediates) return [self createDirectoryAtPath:path mode:mode error:outError];
+    
+    // Commonly the parent already exists, so a single mkdir does the job
+    NSError *error;
+    if ([self createDirectoryAtPath:path mode:mode error:&error])
+    {
+        return [self correctModeOfCreatedDirectories:[NSMutableArray arrayWithObject:path] mode:mode error:outError];
+    }
+    
+    // Like NSFileManager, an existing directory is fine. It's not ours though, so its permissions are left alone
+    if (!([[error domain] isEqualToString:CK2LibSSH2SFTPErrorDomain] && [error code] == LIBSSH2_FX_NO_SUCH_FILE))
+    {
+        if ([[[self attributesOfItemAtPath:path error:NULL] fileType] isEqualToString:NSFileTypeDirectory]) return YES;
+        
+        if (outError) *outError = error;
+        return NO;
+    }
+    
+    
+    // Gather up the ancestors, shallowest first. The root (or working directory for relative paths) can be taken as existing, so without any, there's nothing more to try
+    NSMutableArray *ancestors = [NSMutableArray array];
+    NSString *ancestor = [path stringByDeletingLastPathComponent];
+    while ([ancestor length] && ![ancestor isEqualToString:@"/"])
+    {
+        [ancestors insertObject:ancestor atIndex:0];
+        ancestor = [ancestor stringByDeletingLastPathComponent];
+    }
+    
+    if (![ancestors count])
+    {
+        if (outError) *outError = error;
+        return NO;
+    }
+    
+    
+    // Existence is monotonic along the path, so binary search for the shallowest missing ancestor, rather than trying each in turn. We already know the parent is missing
+    NSUInteger low = 0;
+    NSUInteger high = [ancestors count] - 1;
+    while (low < high)
+    {
+        NSUInteger middle = (low + high) / 2;
+        if ([self itemExistsAtPath:[ancestors objectAtIndex:middle]])
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    
+    
+    // Then make only what's missing, working down. libssh2 only allows one mkdir in flight per channel, and each must land before the next anyway
+    NSMutableArray *created = [NSMutableArray arrayWithArray:[ancestors subarrayWithRange:NSMakeRange(low, [ancestors count] - low)]];
+    [created addObject:path];
+    
+    for (NSString *aPath in [[created copy] autorelease])
+    {
+        if (![self createDirectoryAtPath:aPath mode:mode error:&error])
+        {
+            // Someone else may have beaten us to an intermediate directory. It's theirs, so leave its permissions alone
+            BOOL isFinal = [aPath isEqualToString:path];
+            if (isFinal || ![[[self attributesOfItemAtPath:aPath error:NULL] fileType] isEqualToString:NSFileTypeDirectory])
+            {
+                if (outError) *outError = error;
+                return NO;
+            }
+            
+            [created removeObject:aPath];
+        }
+    }
+    
+    return [self correctModeOfCreatedDirectories:created mode:mode error:outError];
+}
+
+// Some servers don't respect the mode, so have to set permissions again afterwards on whatever got created
+// Only pay for that on servers known to need it. Until we know, check with the first directory
+- (BOOL)correctModeOfCreatedDirectories:(NSMutableArray *)created mode:(long)mode error:(NSError **)error;
+{
+    if (![created count]) return YES;
+    
+    NSNumber *honoursMode = [self learntModeCapabilityForKey:CK2SFTPCapabilityHonoursMkdirMode mode:mode];
+    if (!honoursMode)
+    {
+        NSNumber *actualMode = [[self attributesOfItemAtPath:[created objectAtIndex:0] error:NULL] objectForKey:NSFilePosixPermissions];
+        if (actualMode)
+        {
+            honoursMode = [self learnCapabilityForKey:CK2SFTPCapabilityHonoursMkdirMode
+                                          requestedMode:mode
+                                             actualMode:[actualMode unsignedLongValue]];
+            
+            // No need to fix the one we checked if it came out right
+            if (([actualMode unsignedLongValue] & 07777) == (mode & 07777)) [created removeObjectAtIndex:0];
+        }
+    }
+    
+    if (!honoursMode || ![honoursMode boolValue])
+    {
+        for (NSString *aPath in created)
+        {
+            if (![self setPermissions:mode forItemAtPath:aPath error:error]) return NO;
+        }
+    }
+    
+    return YES;
+}
+
+// Anything other than a definite "no such file" is taken as existing, leaving mkdir to report any real problem
+- (BOOL)itemExistsAtPath:(NSString *)path;
+{
+    NSError *error;
+    if ([self attributesOfItemAtPath:path error:&error]) return YES;
+    return !([[error domain] isEqualToString:CK2LibSSH2SFTPErrorDomain] && [error code] == LIBSSH2_FX_NO_SUCH_FILE);
+}
+
+
+- (BOOL)removeDirectoryAtPath:(NSString *)path error:(NSError **)error {
+    NSParameterAssert(path);
+    
+    [_delegate SFTPSession:self
+  appendStringToTranscript:[NSString stringWithFormat:@"Deleting directory %@", [path lastPathComponent]]
+                  received:NO];
+    
+    int result = CK2SFTPRetry(self, libssh2_sftp_rmdir(_sftp, [path UTF8String]));
+    [_metadataCache removeObjectsForPath:path includingDescendants:YES];
+    
+    if (result == 0)
+    {
+        return YES;
+    }
+    else
+    {
+        if (error) *error = [self sessionErrorWithPath:path];
+        return NO;
+    }    
+}
+
+
+#pragma mark Files
+
+- (NSDictionary *)attributesOfItemAtPath:(NSString *)path error:(NSError **)error;
+{
+    NSParameterAssert(path);
+    
+    id cached = [_metadataCache objectForPath:path kind:CK2SFTPCachedAttributes];
+    if ([cached isKindOfClass:[NSError class]])
+    {
+        if (error) *error = cached;
+        return nil;
+    }
+    else if (cached)
+    {
+        return cached;
+    }
+    
+    
+    LIBSSH2_SFTP_ATTRIBUTES attributes;
+    if (CK2SFTPRetry(self, libssh2_sftp_lstat(_sftp, [path UTF8String], &attributes)) != LIBSSH2_ERROR_NONE)
+    {
+        NSError *anError = [self sessionErrorWithPath:path];
+        
+        // Knowing something doesn't exist is just as handy to remember
+        if ([[anError domain] isEqualToString:CK2LibSSH2SFTPErrorDomain] && [anError code] == LIBSSH2_FX_NO_SUCH_FILE)
+        {
+            [_metadataCache setObject:anError forPath:path kind:CK2SFTPCachedAttributes];
+        }
+        
+        if (error) *error = anError;
+        return nil;
+    }
+    
+    NSDictionary *result = [[self class] attributesWithFilename:nil SFTPAttributes:&attributes];
+    [_metadataCache setObject:result forPath:path kind:CK2SFTPCachedAttributes];
+    return result;
+}
+
+- (CK2SFTPFileHandle *)openHandleAtPath:(NSString *)path flags:(unsigned long)flags mode:(long)mode error:(NSError **)error;
+{
+    NSParameterAssert(path);
+    
+    [_delegate SFTPSession:self
+  appendStringToTranscript:[NSString stringWithFormat:@"Opening file (mode %lo) at path: %@", mode, path]
+                  received:NO];
+    
+    LIBSSH2_SFTP_HANDLE *handle = CK2SFTPRetryPointer(self, libssh2_sftp_open(_sftp, [path UTF8String], flags, mode));
+    if (flags & (LIBSSH2_FXF_WRITE | LIBSSH2_FXF_APPEND | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC))
+    {
+        [_metadataCache removeObjectsForPath:path includingDescendants:NO];
+    }
+    
+    if (!handle)
+    {
+        if (error) *error = [self sessionErrorWithPath:path];
+        return nil;
+    }
+    
+    
+    // Exclusive creation guarantees the file is new, so it's worth making sure the mode took
+    if ((flags & LIBSSH2_FXF_CREAT) && (flags & LIBSSH2_FXF_EXCL))
+    {
+        NSNumber *honoursMode = [self learntModeCapabilityForKey:CK2SFTPCapabilityHonoursOpenMode mode:mode];
+        if (!honoursMode)
+        {
+            LIBSSH2_SFTP_ATTRIBUTES attributes;
+            if (CK2SFTPRetry(self, libssh2_sftp_fstat(handle, &attributes)) == LIBSSH2_ERROR_NONE &&
+                (attributes.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS))
+            {
+                honoursMode = [self learnCapabilityForKey:CK2SFTPCapabilityHonoursOpenMode
+                                              requestedMode:mode
+                                                 actualMode:attributes.permissions];
+            }
+        }
+        
+        if (honoursMode && ![honoursMode boolValue])
+        {
+            LIBSSH2_SFTP_ATTRIBUTES attributes;
+            attributes.permissions = mode;
+            attributes.flags = LIBSSH2_SFTP_ATTR_PERMISSIONS;
+            CK2SFTPRetry(self, libssh2_sftp_fsetstat(handle, &attributes));    // failure isn't worth losing the handle over
+        }
+    }
+    
+    return [[[CK2SFTPFileHandle alloc] initWithSFTPHandle:handle session:self path:path] autorelease];
+}
+
+- (BOOL)removeFileAtPath:(NSString *)path error:(NSError **)error;
+{
+    NSParameterAssert(path);
+    
+    [_delegate SFTPSession:self
+  appendStringToTranscript:[NSString stringWithFormat:@"Deleting file %@", [path lastPathComponent]]
+                  received:NO];
+    
+    int result = CK2SFTPRetry(self, libssh2_sftp_unlink(_sftp, [path UTF8String]));
+    [_metadataCache removeObjectsForPath:path includingDescendants:NO];
+    
+    if (result == LIBSSH2_ERROR_NONE)
+    {
+        return YES;
+    }
+    else
+    {
+        if (error) *error = [self sessionErrorWithPath:path];
+        return NO;
+    }
+}
+
+- (BOOL)setPermissions:(unsigned long)permissions forItemAtPath:(NSString *)path error:(NSError **)error;
+{
+    LIBSSH2_SFTP_ATTRIBUTES attributes;
+    attributes.permissions = permissions;
+    attributes.flags = LIBSSH2_SFTP_ATTR_PERMISSIONS;
+    
+    BOOL result = CK2SFTPRetry(self, libssh2_sftp_setstat(_sftp, [path UTF8String], &attributes)) == LIBSSH2_ERROR_NONE;
+    [_metadataCache removeObjectsForPath:path includingDescendants:NO];
+    if (!result && error)
+    {
+        *error = [self sessionErrorWithPath:path];
+    }
     
-    libssh2_exit();
+    return result;
 }
 
-- (void)dealloc
+#pragma mark Server Capabilities
+
+// Learnt capabilities are remembered per host in user defaults, so only need discovering once in a while. Each is stored as [value, expiry date]; servers get upgraded and reconfigured, so after a week it's relearnt
+#define CK2SFTPLearntCapabilitiesDefaultsKey @"CK2SFTPServerCapabilities"
+#define CK2SFTPLearntCapabilityLifetime (7 * 24 * 60 * 60.0)
+
+// Appended to the mode capabilities' keys, for what's known of modes without group or other write permission. Those come out right under a typical umask, so are easier to vouch for than any mode at all
+static NSString *const CK2SFTPCapabilityModeWithoutWriteSuffix = @"WithoutGroupOtherWrite";
+
++ (NSMutableDictionary *)learntCapabilities;
 {
-    [self cancel];  // performs all teardown of ivars
-    [super dealloc];
+    static NSMutableDictionary *capabilities;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSDictionary *stored = [[NSUserDefaults standardUserDefaults] dictionaryForKey:CK2SFTPLearntCapabilitiesDefaultsKey];
+        capabilities = [[NSMutableDictionary alloc] initWithDictionary:stored];
+    });
+    
+    return capabilities;
 }
 
-#pragma mark Error Handling
+// nil once cancelled, so nothing is learnt against a host of "(null)"
+- (NSString *)capabilitiesHostKey;
+{
+    NSString *host = [[_URL host] lowercaseString];
+    if (!host) return nil;
+    return [NSString stringWithFormat:@"%@:%li", host, (long)[self portForURL:_URL]];
+}
 
-- (NSError *)sessionErrorWithPath:(NSString *)path;
+// nil if the entry has expired, or was stored by an older version without an expiry date
+static NSNumber *CK2SFTPUnexpiredCapability(id entry)
 {
-    if (!_session) return nil;
-    
-    char *errormsg;
-    int code = libssh2_session_last_error(_session, &errormsg, NULL, 0);
-    if (code == 0) return nil;
-    
-    NSString *description = [[NSString alloc] initWithCString:errormsg encoding:NSUTF8StringEncoding];
-    
-    NSError *result = [NSError errorWithDomain:CK2LibSSH2ErrorDomain
-                                          code:code
-                                      userInfo:[NSDictionary dictionaryWithObjectsAndKeys:
-                                                description, NSLocalizedDescriptionKey,
-                                                path, NSFilePathErrorKey,
-                                                nil]];
-    [description release];
+    if (![entry isKindOfClass:[NSArray class]] || [entry count] < 2) return nil;
+    if ([[entry objectAtIndex:1] timeIntervalSinceNow] < 0.0) return nil;
+    return [entry objectAtIndex:0];
+}
+
+// nil if not yet known
+- (NSNumber *)learntCapabilityForKey:(NSString *)key;
+{
+    NSMutableDictionary *capabilities = [[self class] learntCapabilities];
+    @synchronized(capabilities)
+    {
+        id entry = [[capabilities objectForKey:[self capabilitiesHostKey]] objectForKey:key];
+        return [[CK2SFTPUnexpiredCapability(entry) retain] autorelease];
+    }
+}
+
+- (void)learnCapability:(BOOL)capability forKey:(NSString *)key;
+{
+    NSString *hostKey = [self capabilitiesHostKey];
+    if (!hostKey) return;
     
+    NSArray *entry = [NSArray arrayWithObjects:
+                      [NSNumber numberWithBool:capability],
+                      [NSDate dateWithTimeIntervalSinceNow:CK2SFTPLearntCapabilityLifetime],
+                      nil];
     
-    if (code == LIBSSH2_ERROR_SFTP_PROTOCOL)
+    NSMutableDictionary *capabilities = [[self class] learntCapabilities];
+    @synchronized(capabilities)
     {
-        code = libssh2_sftp_last_error(_sftp);
-                
-        result = [NSError errorWithDomain:CK2LibSSH2SFTPErrorDomain
-                                     code:code
-                                 userInfo:[NSDictionary dictionaryWithObjectsAndKeys:
-                                           result, NSUnderlyingErrorKey,
-                                           path, NSFilePathErrorKey,
-                                           nil]];
+        NSMutableDictionary *hostCapabilities = [[capabilities objectForKey:hostKey] mutableCopy];
+        if (!hostCapabilities) hostCapabilities = [[NSMutableDictionary alloc] initWithCapacity:1];
+        
+        [hostCapabilities setObject:entry forKey:key];
+        [capabilities setObject:hostCapabilities forKey:hostKey];
+        [hostCapabilities release];
+        
+        [[NSUserDefaults standardUserDefaults] setObject:capabilities forKey:CK2SFTPLearntCapabilitiesDefaultsKey];
     }
     
-    return result;
+    [_delegate SFTPSession:self
+  appendStringToTranscript:[NSString stringWithFormat:@"Server %@ %@", (capability ? @"supports" : @"doesn't support"), key]
+                  received:YES];
 }
 
-- (NSError *)sessionError;
+// Whether the server is known to honour the mode for key, as far as it matters for this particular mode. nil if not yet known
+- (NSNumber *)learntModeCapabilityForKey:(NSString *)key mode:(unsigned long)mode;
 {
-    return [self sessionErrorWithPath:nil];
+    NSNumber *result = [self learntCapabilityForKey:key];
+    if (!result && !(mode & 022)) result = [self learntCapabilityForKey:[key stringByAppendingString:CK2SFTPCapabilityModeWithoutWriteSuffix]];
+    return result;
 }
 
-- (void)failWithError:(NSError *)error
+// A mismatch is conclusive. A match only is if the mode includes bits a typical umask would strip; otherwise it only vouches for other such modes
+- (NSNumber *)learnCapabilityForKey:(NSString *)key requestedMode:(unsigned long)requested actualMode:(unsigned long)actual;
 {
-    id delegate = _delegate;    // because -cancel will set it to nil
-    [self cancel];
+    BOOL honoured = ((requested & 07777) == (actual & 07777));
+    if (honoured && !(requested & 022)) key = [key stringByAppendingString:CK2SFTPCapabilityModeWithoutWriteSuffix];
     
-    [delegate SFTPSession:self appendStringToTranscript:[error description] received:YES];
-    [delegate SFTPSession:self didFailWithError:error];
+    [self learnCapability:honoured forKey:key];
+    return [NSNumber numberWithBool:honoured];
 }
 
-#pragma mark Path Translation
+- (void)learnCapabilityIfNeeded:(BOOL)capability forKey:(NSString *)key;
+{
+    NSNumber *learnt = [self learntCapabilityForKey:key];
+    if (!learnt || [learnt boolValue] != capability) [self learnCapability:capability forKey:key];
+}
 
-- (NSString *)resolveSymlink:(NSString *)path complex:(BOOL)complex error:(NSError **)error;
+- (NSDictionary *)serverCapabilities;
 {
-    NSMutableData *buffer = [[NSMutableData alloc] initWithLength:256]; // seems plenty for a common path
-    
-    const char *pathChar = [path UTF8String];
-    int linkType = (complex ? LIBSSH2_SFTP_REALPATH : LIBSSH2_SFTP_READLINK);
-    
-    int pathLength = libssh2_sftp_symlink_ex(_sftp, pathChar, strlen(pathChar), [buffer mutableBytes], [buffer length], linkType);
-    while (pathLength == LIBSSH2_ERROR_BUFFER_TOO_SMALL)
-    {
-        [buffer increaseLengthBy:[buffer length]];  // grow exponentially so don't get bogged down too long
-        pathLength = libssh2_sftp_symlink_ex(_sftp, pathChar, strlen(pathChar), [buffer mutableBytes], [buffer length], linkType);
-    }
+    NSMutableDictionary *result = [NSMutableDictionary dictionary];
     
-    NSString *result = nil;
-    if ( pathLength >= 0 )
-    {
-        result = [[[NSString alloc] initWithBytes:[buffer bytes]
-                                           length:pathLength
-                                         encoding:NSUTF8StringEncoding] autorelease];
-    }
-    else
+    NSMutableDictionary *capabilities = [[self class] learntCapabilities];
+    @synchronized(capabilities)
     {
-        if (error)
+        NSDictionary *hostCapabilities = [capabilities objectForKey:[self capabilitiesHostKey]];
+        for (NSString *aKey in hostCapabilities)
         {
-            // I think it only makes sense to include the path in the error when resolving a symlink *file*
-            *error = (complex ? [self sessionError] : [self sessionErrorWithPath:path]);
+            if ([aKey hasSuffix:CK2SFTPCapabilityModeWithoutWriteSuffix]) continue; // only of use internally
+            
+            NSNumber *value = CK2SFTPUnexpiredCapability([hostCapabilities objectForKey:aKey]);
+            if (value) [result setObject:value forKey:aKey];
         }
     }
     
-    [buffer release];
-    
     return result;
 }
 
-- (NSString *)destinationOfSymbolicLinkAtPath:(NSString *)path error:(NSError **)error;
+- (void)removeLearntServerCapabilities;
 {
-    return [self resolveSymlink:path complex:NO error:error];
+    NSString *hostKey = [self capabilitiesHostKey];
+    if (!hostKey) return;
+    
+    NSMutableDictionary *capabilities = [[self class] learntCapabilities];
+    @synchronized(capabilities)
+    {
+        [capabilities removeObjectForKey:hostKey];
+        [[NSUserDefaults standardUserDefaults] setObject:capabilities forKey:CK2SFTPLearntCapabilitiesDefaultsKey];
+    }
 }
 
-- (NSString *)currentDirectoryPath:(NSError **)error;
++ (void)removeAllLearntServerCapabilities;
 {
-    return [self resolveSymlink:@"." complex:YES error:error];
+    NSMutableDictionary *capabilities = [self learntCapabilities];
+    @synchronized(capabilities)
+    {
+        [capabilities removeAllObjects];
+        [[NSUserDefaults standardUserDefaults] removeObjectForKey:CK2SFTPLearntCapabilitiesDefaultsKey];
+    }
 }
 
-#pragma mark Directories
-
-// Keep compatibility with CK without having to link to it
-#define cxFilenameKey @"cxFilenameKey"
+// Servers reply to extended requests they don't recognise with SSH_FX_OP_UNSUPPORTED
+- (BOOL)isUnsupportedError:(NSError *)error;
+{
+    return ([[error domain] isEqualToString:CK2LibSSH2SFTPErrorDomain] && [error code] == LIBSSH2_FX_OP_UNSUPPORTED);
+}
 
-- (NSArray *)contentsOfDirectoryAtPath:(NSString *)path error:(NSError **)error;
+- (NSError *)unsupportedErrorForCapability:(NSString *)key path:(NSString *)path;
 {
-    return [[self attributesOfContentsOfDirectoryAtPath:path error:error] valueForKey:cxFilenameKey];
+    NSString *description = [NSString stringWithFormat:@"The server doesn't support %@", key];
+    return [NSError errorWithDomain:CK2LibSSH2SFTPErrorDomain
+                               code:LIBSSH2_FX_OP_UNSUPPORTED
+                           userInfo:[NSDictionary dictionaryWithObjectsAndKeys:
+                                     description, NSLocalizedDescriptionKey,
+                                     path, NSFilePathErrorKey,
+                                     nil]];
 }
 
-- (NSArray *)attributesOfContentsOfDirectoryAtPath:(NSString *)path error:(NSError **)error;
+#pragma mark File System Attributes
+
+- (NSDictionary *)attributesOfFileSystemForPath:(NSString *)path error:(NSError **)error;
 {
-    LIBSSH2_SFTP_HANDLE *handle = libssh2_sftp_opendir(_sftp, [path UTF8String]);
-    if (!handle)
+    NSParameterAssert(path);
+    
+    if ([[self learntCapabilityForKey:CK2SFTPCapabilityStatVFS] isEqual:[NSNumber numberWithBool:NO]])
     {
-        if (error) *error = [self sessionErrorWithPath:path];
+        if (error) *error = [self unsupportedErrorForCapability:CK2SFTPCapabilityStatVFS path:path];
         return nil;
     }
     
-    NSMutableArray *result = [NSMutableArray array];
-    
-#define BUFFER_LENGTH 1024
-    char buffer[BUFFER_LENGTH];
-
+    const char *pathString = [path UTF8String];
+    LIBSSH2_SFTP_STATVFS statvfs;
     
-    int filenameLength;
-    do
+    int result = CK2SFTPRetry(self, libssh2_sftp_statvfs(_sftp, pathString, strlen(pathString), &statvfs));
+    if (result != LIBSSH2_ERROR_NONE)
     {
-        LIBSSH2_SFTP_ATTRIBUTES attributes;
-        filenameLength = libssh2_sftp_readdir(handle, buffer, BUFFER_LENGTH, &attributes);
+        NSError *statError = [self sessionErrorWithPath:path];
+        if ([self isUnsupportedError:statError]) [self learnCapability:NO forKey:CK2SFTPCapabilityStatVFS];
         
-        if (filenameLength > 0)
-        {
-            NSString *filename = [[NSString alloc] initWithBytes:buffer
-                                                          length:filenameLength
-                                                        encoding:NSUTF8StringEncoding];
-            
-            // Exclude . and .. as they're not Cocoa-like
-            if (![filename isEqualToString:@"."] && ![filename isEqualToString:@".."])
-            {
-                NSString *type = NSFileTypeUnknown;
-                if (LIBSSH2_SFTP_S_ISREG(attributes.permissions))
-                {
-                    type = NSFileTypeRegular;
-                }
-                else if (LIBSSH2_SFTP_S_ISDIR(attributes.permissions))
-                {
-                    type = NSFileTypeDirectory;
-                }
-                else if (LIBSSH2_SFTP_S_ISLNK(attributes.permissions))
-                {
-                    type = NSFileTypeSymbolicLink;
-                }
-                else if (LIBSSH2_SFTP_S_ISSOCK(attributes.permissions))
-                {
-                    type = NSFileTypeSocket;
-                }
-                else if (LIBSSH2_SFTP_S_ISCHR(attributes.permissions))
-                {
-                    type = NSFileTypeCharacterSpecial;
-                }
-                else if (LIBSSH2_SFTP_S_ISBLK(attributes.permissions))
-                {
-                    type = NSFileTypeBlockSpecial;
-                }
-                
-                [result addObject:[NSDictionary dictionaryWithObjectsAndKeys:
-                                   filename, cxFilenameKey,
-                                   type, NSFileType,
-                                   nil]];
-            }
-            
-            [filename release];
-        }
+        if (error) *error = statError;
+        return nil;
     }
-    while (filenameLength > 0);
     
-    if (filenameLength < 0) // an error!
-    {
-        result = nil;
-        if (error) *error = [self sessionErrorWithPath:path];
-    }
+    [self learnCapabilityIfNeeded:YES forKey:CK2SFTPCapabilityStatVFS];
     
-    libssh2_sftp_closedir(handle);
-    return result;
+    // Space available to unprivileged users is what matters to us, so use f_bavail rather than f_bfree
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+            [NSNumber numberWithUnsignedLongLong:statvfs.f_blocks * statvfs.f_frsize], NSFileSystemSize,
+            [NSNumber numberWithUnsignedLongLong:statvfs.f_bavail * statvfs.f_frsize], NSFileSystemFreeSize,
+            [NSNumber numberWithUnsignedLongLong:statvfs.f_files], NSFileSystemNodes,
+            [NSNumber numberWithUnsignedLongLong:statvfs.f_favail], NSFileSystemFreeNodes,
+            nil];
 }
 
-- (BOOL)createDirectoryAtPath:(NSString *)path mode:(long)mode error:(NSError **)error;
+#pragma mark Rename
+
+- (BOOL)moveItemAtPath:(NSString*) oldPath toPath:(NSString*) newPath error:(NSError **)error
 {
-    int result = libssh2_sftp_mkdir(_sftp, [path UTF8String], mode);
-    
-    if (result == 0)
-    {
-        return YES;
-    }
-    else
-    {
-        if (error) *error = [self sessionErrorWithPath:path];
-        return NO;
-    }
+    return [self moveItemAtPath:oldPath toPath:newPath overwrite:NO error:error];
 }
 
-- (BOOL)createDirectoryAtPath:(NSString *)path withIntermediateDirectories:(BOOL)createIntermediates mode:(long)mode error:(NSError **)outError;
+- (BOOL)moveItemAtPath:(NSString *)oldPath toPath:(NSString *)newPath overwrite:(BOOL)overwrite error:(NSError **)error;
 {
-    if (!createIntermediates) return [self createDirectoryAtPath:path mode:mode error:outError];
+    NSParameterAssert(oldPath);
+    NSParameterAssert(newPath);
     
-    NSError *error;
-    BOOL result = [self createDirectoryAtPath:path mode:mode error:&error];
+    [_delegate SFTPSession:self
+  appendStringToTranscript:[NSString stringWithFormat:@"Renaming %@ to %@", [oldPath lastPathComponent],[newPath lastPathComponent]]
+                  received:NO];
     
-    if (!result)
+    [_metadataCache removeObjectsForPath:oldPath includingDescendants:YES];
+    [_metadataCache removeObjectsForPath:newPath includingDescendants:YES];
+    
+#if LIBSSH2_VERSION_NUM >= 0x010b00
+    // posix-rename replaces the destination atomically, in a single request
+    if (overwrite && ![[self learntCapabilityForKey:CK2SFTPCapabilityPOSIXRename] isEqual:[NSNumber numberWithBool:NO]])
     {
-        if (outError) *outError = error;
+        int result = CK2SFTPRetry(self, libssh2_sftp_posix_rename(_sftp, [oldPath UTF8String], [newPath UTF8String]));
+        if (result == LIBSSH2_ERROR_NONE)
+        {
+            [self learnCapabilityIfNeeded:YES forKey:CK2SFTPCapabilityPOSIXRename];
+            return YES;
+        }
         
-        if ([[error domain] isEqualToString:CK2LibSSH2SFTPErrorDomain] && [error code] == LIBSSH2_FX_NO_SUCH_FILE)
+        NSError *renameError = [self sessionErrorWithPath:oldPath];
+        if (![self isUnsupportedError:renameError])
         {
-            if ([self createDirectoryAtPath:[path stringByDeletingLastPathComponent]
-                withIntermediateDirectories:createIntermediates
-                                       mode:mode
-                                      error:outError])
-            {
-                result = [self createDirectoryAtPath:path mode:mode error:outError];
-            }
+            if (error) *error = renameError;
+            return NO;
         }
+        
+        [self learnCapability:NO forKey:CK2SFTPCapabilityPOSIXRename];
     }
+#endif
     
+    int result = CK2SFTPRetry(self, libssh2_sftp_rename(_sftp, [oldPath UTF8String], [newPath UTF8String]));
     
-    // Some servers don't respect the mode, so have to set permissions again afterwards
-    // TODO: Handle that scenario better by making client handle it, or caching whether there's any need to
-    if (result)
+    // SFTPv3 servers refuse to rename over an existing file, so the fallback is to remove it and try again
+    if (result == LIBSSH2_ERROR_SFTP_PROTOCOL && overwrite)
     {
-        result = [self setPermissions:mode forItemAtPath:path error:outError];
+        NSError *renameError = [self sessionErrorWithPath:oldPath];
+        
+        if (![self shouldRemoveDestinationAfterRenameError:renameError oldPath:oldPath newPath:newPath] ||
+            ![self removeFileAtPath:newPath error:NULL])
+        {
+            // Report why the rename failed, rather than the removal
+            if (error) *error = renameError;
+            return NO;
+        }
+        
+        result = CK2SFTPRetry(self, libssh2_sftp_rename(_sftp, [oldPath UTF8String], [newPath UTF8String]));
     }
     
-    
-    return result;
-}
-
-
-- (BOOL)removeDirectoryAtPath:(NSString *)path error:(NSError **)error {
-    NSParameterAssert(path);
-    
-    [_delegate SFTPSession:self
-  appendStringToTranscript:[NSString stringWithFormat:@"Deleting directory %@", [path lastPathComponent]]
-                  received:NO];
-    
-    int result=libssh2_sftp_rmdir(_sftp, [path UTF8String]);
-    
-    if (result == 0)
+    if (result == LIBSSH2_ERROR_NONE)
     {
         return YES;
     }
     else
     {
-        if (error) *error = [self sessionErrorWithPath:path];
+        if (error) *error = [self sessionErrorWithPath:oldPath];
         return NO;
     }    
 }
 
-
-#pragma mark Files
-
-- (CK2SFTPFileHandle *)openHandleAtPath:(NSString *)path flags:(unsigned long)flags mode:(long)mode error:(NSError **)error;
+// Removing the destination loses data, so only do so when the failure can only be down to it existing: the server's generic failure (SFTPv3 has no more specific code) or an explicit "already exists", with the source still in place, and the two not being one and the same
+- (BOOL)shouldRemoveDestinationAfterRenameError:(NSError *)error oldPath:(NSString *)oldPath newPath:(NSString *)newPath;
 {
-    NSParameterAssert(path);
-    
-    [_delegate SFTPSession:self
-  appendStringToTranscript:[NSString stringWithFormat:@"Opening file (mode %lo) at path: %@", mode, path]
-                  received:NO];
+    if (![[error domain] isEqualToString:CK2LibSSH2SFTPErrorDomain]) return NO;
+    if ([error code] != LIBSSH2_FX_FAILURE && [error code] != LIBSSH2_FX_FILE_ALREADY_EXISTS) return NO;
     
-    LIBSSH2_SFTP_HANDLE *handle = libssh2_sftp_open(_sftp, [path UTF8String], flags, mode);
+    if (![self attributesOfItemAtPath:oldPath error:NULL]) return NO;
     
-    if (!handle)
-    {
-        if (error) *error = [self sessionErrorWithPath:path];
-        return nil;
-    }
+    NSString *oldCanonicalPath = [self resolveSymlink:oldPath complex:YES error:NULL];
+    NSString *newCanonicalPath = [self resolveSymlink:newPath complex:YES error:NULL];
+    if (!oldCanonicalPath || !newCanonicalPath || [oldCanonicalPath isEqualToString:newCanonicalPath]) return NO;
     
-    return [[[CK2SFTPFileHandle alloc] initWithSFTPHandle:handle session:self path:path] autorelease];
+    return YES;
 }
 
-- (BOOL)removeFileAtPath:(NSString *)path error:(NSError **)error;
+#pragma mark Copying
+
+- (BOOL)copyItemAtPath:(NSString *)srcPath toPath:(NSString *)dstPath error:(NSError **)error;
 {
-    NSParameterAssert(path);
+    return [self copyItemAtPath:srcPath toPath:dstPath overwrite:NO error:error];
+}
+
+- (BOOL)copyItemAtPath:(NSString *)srcPath toPath:(NSString *)dstPath overwrite:(BOOL)overwrite error:(NSError **)error;
+{
+    NSParameterAssert(srcPath);
+    NSParameterAssert(dstPath);
     
     [_delegate SFTPSession:self
-  appendStringToTranscript:[NSString stringWithFormat:@"Deleting file %@", [path lastPathComponent]]
+  appendStringToTranscript:[NSString stringWithFormat:@"Copying %@ to %@", [srcPath lastPathComponent], [dstPath lastPathComponent]]
                   received:NO];
     
-    int result = libssh2_sftp_unlink(_sftp, [path UTF8String]);
+    // libssh2 can't send copy-data, so stream the file through instead
+    NSNumber *permissions = [[self attributesOfItemAtPath:srcPath error:error] objectForKey:NSFilePosixPermissions];
+    if (!permissions) return NO;
     
-    if (result == LIBSSH2_ERROR_NONE)
+    // Truncating the destination would destroy the source if they're one and the same. A destination that can't be resolved doesn't exist yet, so is safe
+    if (overwrite)
     {
-        return YES;
+        NSString *srcCanonicalPath = [self resolveSymlink:srcPath complex:YES error:error];
+        if (!srcCanonicalPath) return NO;
+        
+        if ([srcCanonicalPath isEqualToString:[self resolveSymlink:dstPath complex:YES error:NULL]])
+        {
+            if (error) *error = [NSError errorWithDomain:NSPOSIXErrorDomain
+                                                    code:EINVAL
+                                                userInfo:[NSDictionary dictionaryWithObject:dstPath forKey:NSFilePathErrorKey]];
+            return NO;
+        }
     }
-    else
+    
+    CK2SFTPFileHandle *source = [self openHandleAtPath:srcPath flags:LIBSSH2_FXF_READ mode:0 error:error];
+    if (!source) return NO;
+    
+    unsigned long flags = LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | (overwrite ? LIBSSH2_FXF_TRUNC : LIBSSH2_FXF_EXCL);
+    CK2SFTPFileHandle *destination = [self openHandleAtPath:dstPath flags:flags mode:[permissions longValue] error:error];
+    if (!destination)
     {
-        if (error) *error = [self sessionErrorWithPath:path];
+        [source closeFile];
         return NO;
     }
-}
-
-- (BOOL)setPermissions:(unsigned long)permissions forItemAtPath:(NSString *)path error:(NSError **)error;
-{
-    LIBSSH2_SFTP_ATTRIBUTES attributes;
-    attributes.permissions = permissions;
-    attributes.flags = LIBSSH2_SFTP_ATTR_PERMISSIONS;
     
-    BOOL result = libssh2_sftp_setstat(_sftp, [path UTF8String], &attributes) == LIBSSH2_ERROR_NONE;
-    if (!result && error)
+    // Each window of the file is read into a recycled buffer, then queued up as pipelined writes. The queue holds its own copy, so the next window is read while the last is still being acknowledged
+    char *buffer = [self borrowBuffer];
+    [destination setMaximumWriteBytesInFlight:CK2SFTPBufferLength];
+    
+    BOOL result = YES;
+    BOOL atEnd = NO;
+    while (result && !atEnd)
     {
-        *error = [self sessionErrorWithPath:path];
+        NSUInteger length = 0;
+        while (length < CK2SFTPBufferLength)
+        {
+            NSInteger read = [source read:(uint8_t *)buffer + length maxLength:(CK2SFTPBufferLength - length) error:error];
+            if (read <= 0)
+            {
+                result = (read == 0);
+                atEnd = YES;
+                break;
+            }
+            length += read;
+        }
+        
+        if (result && length)
+        {
+            NSData *window = [[NSData alloc] initWithBytesNoCopy:buffer length:length freeWhenDone:NO];
+            result = [destination writeData:window error:error];
+            [window release];
+        }
     }
     
-    return YES;
+    [self returnBuffer:buffer];
+    
+    if (result)
+    {
+        result = [destination closeFile:error];
+    }
+    else
+    {
+        [destination closeFile];
+    }
+    [source closeFile];
+    
+    // Whatever was at the destination before is gone by now, so don't leave half a copy in its place
+    if (!result) [self removeFileAtPath:dstPath error:NULL];
+    
+    return result;
 }
 
-#pragma mark Rename
+#pragma mark Downloading
 
-- (BOOL)moveItemAtPath:(NSString*) oldPath toPath:(NSString*) newPath error:(NSError **)error
+- (BOOL)downloadItemAtPath:(NSString *)path toURL:(NSURL *)URL error:(NSError **)error;
 {
-    NSParameterAssert(oldPath);
-    NSParameterAssert(newPath);
+    NSParameterAssert(path);
+    NSParameterAssert(URL);
     
     [_delegate SFTPSession:self
-  appendStringToTranscript:[NSString stringWithFormat:@"Renaming %@ to %@", [oldPath lastPathComponent],[newPath lastPathComponent]]
+  appendStringToTranscript:[NSString stringWithFormat:@"Downloading %@", [path lastPathComponent]]
                   received:NO];
-  
-    int result = libssh2_sftp_rename(_sftp, [oldPath UTF8String], [newPath UTF8String]);
     
-    if (result == LIBSSH2_ERROR_NONE)
+    NSNumber *size = [[self attributesOfItemAtPath:path error:error] objectForKey:NSFileSize];
+    if (!size) return NO;
+    
+    CK2SFTPFileHandle *handle = [self openHandleAtPath:path flags:LIBSSH2_FXF_READ mode:0 error:error];
+    if (!handle) return NO;
+    
+    BOOL result = [handle readIntoFileAtURL:URL offset:0 length:[size unsignedLongLongValue] progressHandler:nil error:error];
+    if (result)
     {
-        return YES;
+        result = [handle closeFile:error];
     }
     else
     {
-        if (error) *error = [self sessionErrorWithPath:oldPath];
-        return NO;
-    }    
+        [handle closeFile];
+    }
+    
+    return result;
 }
 
 #pragma mark Host's Public Key
@@ -955,33 +2684,43 @@ static void kbd_callback(const char *name, int name_len,
 
 - (void)initializeSFTP;
 {
-    do {
-        _sftp = libssh2_sftp_init(_session);
-        
-        if (!_sftp)
-        {
-            int lastErrNo = libssh2_session_last_errno(_session);
-            
-            if (lastErrNo == LIBSSH2_ERROR_EAGAIN)
-            {
-                waitsocket(CFSocketGetNative(_socket), _session); /* now we wait */
-            }
-            else
-            {
-                [self failWithError:[self sessionError]];
-                return;
-            }
-        }
-    } while (!_sftp);
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    _sftp = CK2SFTPRetryPointer(self, libssh2_sftp_init(_session));
+    [_connectionTimings setSFTPInitializationDuration:(CFAbsoluteTimeGetCurrent() - start)];
+    
+    if (!_sftp)
+    {
+        [self failWithError:[self sessionError]];
+        return;
+    }
     
+    [self maintainReceiveWindow];
+    [self reportConnectionTimingsToDelegate:_delegate];
     [_delegate SFTPSessionDidInitialize:self];
 }
 
+- (void)reportConnectionTimingsToDelegate:(id)delegate;
+{
+    if (!_connectionTimings || _reportedConnectionTimings) return;
+    _reportedConnectionTimings = YES;
+    
+    [delegate SFTPSession:self appendStringToTranscript:[_connectionTimings description] received:NO];
+    
+    if ([delegate respondsToSelector:@selector(SFTPSession:didRecordConnectionTimings:)])
+    {
+        [delegate SFTPSession:self didRecordConnectionTimings:_connectionTimings];
+    }
+}
+
+@synthesize connectionTimings = _connectionTimings;
+
 - (NSArray *)supportedAuthenticationSchemesForUser:(NSString *)user;
 {
-    char *userauthlist = libssh2_userauth_list(_session,
-                                               [user UTF8String],
-                                               [user lengthOfBytesUsingEncoding:NSUTF8StringEncoding]);
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    char *userauthlist = CK2SFTPRetryPointer(self, libssh2_userauth_list(_session,
+                                                                         [user UTF8String],
+                                                                         [user lengthOfBytesUsingEncoding:NSUTF8StringEncoding]));
+    [_connectionTimings setAuthenticationListDuration:([_connectionTimings authenticationListDuration] + CFAbsoluteTimeGetCurrent() - start)];
     
     if (!userauthlist) return nil;  // TODO: Note that this could be because server supports being unathenticated. Should we distinguish between these for delegate?
     
@@ -991,6 +2730,176 @@ static void kbd_callback(const char *name, int name_len,
     return result;
 }
 
+// Registering the standard keys costs spawning ssh-add, so is only done the once per process
+// Should ssh-add be missing (or the sandbox forbid running it), authentication carries on with whatever identities the agent already holds, as listed by libssh2_agent_list_identities()
++ (void)prepareSSHAgent;
+{
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSString *launchPath = @"/usr/bin/ssh-add";
+        if (![[NSFileManager defaultManager] isExecutableFileAtPath:launchPath]) return;
+        
+        NSTask *sshAgentTask = [[NSTask alloc] init];
+        [sshAgentTask setLaunchPath:launchPath];
+        [sshAgentTask setStandardInput:[NSPipe pipe]];  // so xcode doesn't start prompting for passphrase!
+        
+        // -launch raises rather than returning an error, and an exception escaping dispatch_once would leave it wedged for every later caller
+        @try
+        {
+            [sshAgentTask launch];
+            [sshAgentTask waitUntilExit];
+        }
+        @catch (NSException *exception)
+        {
+            NSLog(@"Couldn't run %@ to register the standard keys with SSH-Agent: %@", launchPath, exception);
+        }
+        
+        [sshAgentTask release];
+    });
+}
+
+#pragma mark Authentication Memo
+
+// Which scheme, and for SSH-Agent which identity, last got each user in to each host. Remembered in user defaults, so the next connection can go straight to it
+// The two are kept apart, so logging in another way doesn't lose track of the agent identity. Like learnt capabilities, each is stored as [value, expiry date], and forgotten after a month unused
+#define CK2SFTPAuthenticationMemosDefaultsKey @"CK2SFTPAuthenticationMemos"
+#define CK2SFTPAuthenticationMemoLifetime (30 * 24 * 60 * 60.0)
+
+static NSString *const CK2SFTPMemoSchemeKey = @"scheme";
+static NSString *const CK2SFTPMemoIdentityKey = @"identity";    // SHA-256 fingerprint of the public key
+
+static NSString *CK2SFTPFingerprintOfPublicKey(const unsigned char *blob, size_t length)
+{
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256(blob, (CC_LONG)length, digest);
+    
+    NSMutableString *result = [NSMutableString stringWithCapacity:(2 * CC_SHA256_DIGEST_LENGTH)];
+    int i;
+    for (i = 0; i < CC_SHA256_DIGEST_LENGTH; i++)
+    {
+        [result appendFormat:@"%02x", digest[i]];
+    }
+    return result;
+}
+
+// nil if the entry has expired, or was stored by an older version without an expiry date
+static NSString *CK2SFTPUnexpiredMemo(id entry)
+{
+    if (![entry isKindOfClass:[NSArray class]] || [entry count] < 2) return nil;
+    if ([[entry objectAtIndex:1] timeIntervalSinceNow] < 0.0) return nil;
+    return [entry objectAtIndex:0];
+}
+
++ (NSMutableDictionary *)authenticationMemos;
+{
+    static NSMutableDictionary *memos;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSDictionary *stored = [[NSUserDefaults standardUserDefaults] dictionaryForKey:CK2SFTPAuthenticationMemosDefaultsKey];
+        memos = [[NSMutableDictionary alloc] initWithDictionary:stored];
+    });
+    
+    return memos;
+}
+
+- (NSString *)authenticationMemoKeyForUser:(NSString *)user;
+{
+    return [NSString stringWithFormat:@"%@@%@", user, [self capabilitiesHostKey]];
+}
+
+// key is CK2SFTPMemoSchemeKey or CK2SFTPMemoIdentityKey. nil if not remembered
+- (NSString *)authenticationMemo:(NSString *)key forUser:(NSString *)user;
+{
+    NSMutableDictionary *memos = [[self class] authenticationMemos];
+    @synchronized(memos)
+    {
+        id entry = [[memos objectForKey:[self authenticationMemoKeyForUser:user]] objectForKey:key];
+        return [[CK2SFTPUnexpiredMemo(entry) retain] autorelease];
+    }
+}
+
+// Pass nil to forget
+- (void)rememberAuthenticationMemo:(NSString *)value forKey:(NSString *)key user:(NSString *)user;
+{
+    NSMutableDictionary *memos = [[self class] authenticationMemos];
+    @synchronized(memos)
+    {
+        NSString *userKey = [self authenticationMemoKeyForUser:user];
+        NSMutableDictionary *userMemos = [NSMutableDictionary dictionaryWithDictionary:[memos objectForKey:userKey]];
+        
+        if (value)
+        {
+            [userMemos setObject:[NSArray arrayWithObjects:value, [NSDate dateWithTimeIntervalSinceNow:CK2SFTPAuthenticationMemoLifetime], nil]
+                          forKey:key];
+        }
+        else
+        {
+            [userMemos removeObjectForKey:key];
+        }
+        
+        if ([userMemos count])
+        {
+            [memos setObject:userMemos forKey:userKey];
+        }
+        else
+        {
+            [memos removeObjectForKey:userKey];
+        }
+        
+        [[NSUserDefaults standardUserDefaults] setObject:memos forKey:CK2SFTPAuthenticationMemosDefaultsKey];
+    }
+}
+
+- (void)removeAuthenticationMemos;
+{
+    NSMutableDictionary *memos = [[self class] authenticationMemos];
+    @synchronized(memos)
+    {
+        NSString *suffix = [@"@" stringByAppendingString:[self capabilitiesHostKey]];
+        
+        NSString *aKey;
+        for (aKey in [memos allKeys])
+        {
+            if ([aKey hasSuffix:suffix]) [memos removeObjectForKey:aKey];
+        }
+        
+        [[NSUserDefaults standardUserDefaults] setObject:memos forKey:CK2SFTPAuthenticationMemosDefaultsKey];
+    }
+}
+
++ (void)removeAllAuthenticationMemos;
+{
+    NSMutableDictionary *memos = [self authenticationMemos];
+    @synchronized(memos)
+    {
+        [memos removeAllObjects];
+        [[NSUserDefaults standardUserDefaults] removeObjectForKey:CK2SFTPAuthenticationMemosDefaultsKey];
+    }
+}
+
+#pragma mark SSH-Agent
+
+- (BOOL)authenticateUser:(NSString *)user withAgent:(LIBSSH2_AGENT *)agent identity:(struct libssh2_agent_publickey *)identity;
+{
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    BOOL result = (CK2SFTPRetry(self, libssh2_agent_userauth(agent, [user UTF8String], identity)) == LIBSSH2_ERROR_NONE);
+    [_connectionTimings addAuthenticationAttemptWithScheme:CK2SSHAuthenticationSchemePublicKey startTime:start succeeded:result];
+    
+    if (!result)
+    {
+        // Log each rejected key
+        [_delegate SFTPSession:self
+      appendStringToTranscript:
+         [NSString stringWithFormat:
+          @"%@ (%@)",
+          [[self sessionError] localizedDescription],
+          [NSString stringWithUTF8String:(*identity).comment]]
+                      received:YES];
+    }
+    
+    return result;
+}
+
 - (BOOL)useSSHAgentToAuthenticateUser:(NSString *)user error:(NSError **)error;
 {
     LIBSSH2_AGENT *agent = libssh2_agent_init(_session);
@@ -1002,12 +2911,7 @@ static void kbd_callback(const char *name, int name_len,
     
     
     // Before we actually connect, make sure all standard keys are registered
-    NSTask *sshAgentTask = [[NSTask alloc] init];
-    [sshAgentTask setLaunchPath:@"/usr/bin/ssh-add"];
-    [sshAgentTask setStandardInput:[NSPipe pipe]];  // so xcode doesn't start prompting for passphrase!
-    [sshAgentTask launch];
-    [sshAgentTask waitUntilExit];
-    [sshAgentTask release];
+    [[self class] prepareSSHAgent];
     
     
     if (libssh2_agent_connect(agent) != LIBSSH2_ERROR_NONE)
@@ -1025,8 +2929,31 @@ static void kbd_callback(const char *name, int name_len,
         return NO;
     }
     
+    
+    // Each rejected identity costs a round trip, so start with whichever worked last time
+    // Servers' MaxAuthTries can run out before the right one is reached, too
+    NSString *preferredFingerprint = [self authenticationMemo:CK2SFTPMemoIdentityKey forUser:user];
+    
     struct libssh2_agent_publickey *identity = NULL;
-    while (YES)
+    struct libssh2_agent_publickey *preferred = NULL;
+    BOOL authenticated = NO;
+    
+    if (preferredFingerprint)
+    {
+        while (libssh2_agent_get_identity(agent, &identity, identity) == LIBSSH2_ERROR_NONE)
+        {
+            if ([CK2SFTPFingerprintOfPublicKey(identity->blob, identity->blob_len) isEqualToString:preferredFingerprint])
+            {
+                preferred = identity;
+                authenticated = [self authenticateUser:user withAgent:agent identity:preferred];
+                break;
+            }
+        }
+        
+        if (!authenticated) identity = NULL;    // start again from the top
+    }
+    
+    while (!authenticated)
     {
         int rc = libssh2_agent_get_identity(agent, &identity, identity);
         if (rc != LIBSSH2_ERROR_NONE)
@@ -1051,21 +2978,14 @@ static void kbd_callback(const char *name, int name_len,
             return NO;
         }
         
-        if (libssh2_agent_userauth(agent, [user UTF8String], identity) == LIBSSH2_ERROR_NONE)
-        {
-            break;
-        }
+        if (identity == preferred) continue;    // already tried
         
-        // Log each rejected key
-        [_delegate SFTPSession:self
-      appendStringToTranscript:
-         [NSString stringWithFormat:
-          @"%@ (%@)",
-          [[self sessionError] localizedDescription],
-          [NSString stringWithUTF8String:(*identity).comment]]
-                      received:YES];
+        authenticated = [self authenticateUser:user withAgent:agent identity:identity];
     }
     
+    [self rememberAuthenticationMemo:CK2SSHAuthenticationSchemePublicKey forKey:CK2SFTPMemoSchemeKey user:user];
+    [self rememberAuthenticationMemo:CK2SFTPFingerprintOfPublicKey(identity->blob, identity->blob_len) forKey:CK2SFTPMemoIdentityKey user:user];
+    
     libssh2_agent_disconnect(agent);
     libssh2_agent_free(agent); agent = NULL;
     
@@ -1073,6 +2993,94 @@ static void kbd_callback(const char *name, int name_len,
     return YES;
 }
 
+#if LIBSSH2_VERSION_NUM >= 0x010600
+- (int)authenticateUser:(NSString *)user privateKey:(CK2SFTPKeyMaterial *)privateKey publicKey:(CK2SFTPKeyMaterial *)publicKey passphrase:(NSString *)passphrase;
+{
+    // Without a public key, libssh2 derives it from the private one
+    return CK2SFTPRetry(self, libssh2_userauth_publickey_frommemory(_session,
+                                                                    [user UTF8String], strlen([user UTF8String]),
+                                                                    [publicKey bytes], [publicKey length],
+                                                                    [privateKey bytes], [privateKey length],
+                                                                    [passphrase UTF8String]));
+}
+#endif
+
+- (int)authenticateUser:(NSString *)user privateKeyURL:(NSURL *)privateKeyURL publicKeyURL:(NSURL *)publicKeyURL passphrase:(NSString *)passphrase;
+{
+    int result;
+    
+#if LIBSSH2_VERSION_NUM >= 0x010600
+    // Keys already read in save going to the disk, and the sandbox, again
+    CK2SFTPPrivateKeyCache *cache = [CK2SFTPPrivateKeyCache sharedCache];
+    CK2SFTPKeyMaterial *privateKey = [cache keyMaterialForURL:privateKeyURL];
+    CK2SFTPKeyMaterial *publicKey = (publicKeyURL ? [cache keyMaterialForURL:publicKeyURL] : nil);
+    
+    BOOL cached = (privateKey && (publicKey || !publicKeyURL));
+    if (cached)
+    {
+        result = [self authenticateUser:user privateKey:privateKey publicKey:publicKey passphrase:passphrase];
+        if (result != LIBSSH2_ERROR_AUTHENTICATION_FAILED && result != LIBSSH2_ERROR_PUBLICKEY_UNVERIFIED && result != LIBSSH2_ERROR_FILE) return result;
+    }
+#endif
+    
+    // When sandboxed, gain access to the URL temporarily
+    BOOL access = NO;
+    if ([privateKeyURL respondsToSelector:@selector(startAccessingSecurityScopedResource)])
+    {
+        access = [privateKeyURL startAccessingSecurityScopedResource];
+        if (!access)
+        {
+            NSLog(@"Unable to start accessing private key: %@", [privateKeyURL path]);
+        }
+    }
+    
+#if LIBSSH2_VERSION_NUM >= 0x010600
+    // Another go is only worthwhile if the files have been changed since; sending the same key again would just use up another of the server's MaxAuthTries
+    if (cached)
+    {
+        if ([privateKey matchesFileAtURL:privateKeyURL] && (!publicKeyURL || [publicKey matchesFileAtURL:publicKeyURL]))
+        {
+            if (access) [privateKeyURL stopAccessingSecurityScopedResource];
+            return result;
+        }
+        
+        [cache removeKeyMaterialForURL:privateKeyURL];
+        if (publicKeyURL) [cache removeKeyMaterialForURL:publicKeyURL];
+    }
+    
+    privateKey = [cache addKeyMaterialWithContentsOfURL:privateKeyURL];
+    publicKey = (publicKeyURL ? [cache addKeyMaterialWithContentsOfURL:publicKeyURL] : nil);
+    
+    if (privateKey && (publicKey || !publicKeyURL))
+    {
+        result = [self authenticateUser:user privateKey:privateKey publicKey:publicKey passphrase:passphrase];
+    }
+    else    // leave libssh2 to report the problem
+#endif
+    {
+        result = CK2SFTPRetry(self, libssh2_userauth_publickey_fromfile(_session,
+                                                                        [user UTF8String],
+                                                                        [[publicKeyURL path] fileSystemRepresentation],
+                                                                        [[privateKeyURL path] fileSystemRepresentation],
+                                                                        [passphrase UTF8String]));
+    }
+    
+    if (access) [privateKeyURL stopAccessingSecurityScopedResource];
+    return result;
+}
+
+#if LIBSSH2_VERSION_NUM >= 0x010600
++ (void)setLocksCachedPrivateKeysInMemory:(BOOL)lock;
+{
+    [[CK2SFTPPrivateKeyCache sharedCache] setLocksMemory:lock];
+}
+
++ (void)removeAllCachedPrivateKeys;
+{
+    [[CK2SFTPPrivateKeyCache sharedCache] removeAllKeyMaterial];
+}
+#endif
+
 - (BOOL)usePublicKeyCredential:(NSURLCredential *)credential error:(NSError **)error;
 {
     NSURL *privateKeyURL = [credential ck2_privateKeyURL];
@@ -1085,26 +3093,12 @@ static void kbd_callback(const char *name, int name_len,
     }
     else
     {
-        // When sandboxed, gain access to the URL temporarily
-        BOOL access = NO;
-        if ([privateKeyURL respondsToSelector:@selector(startAccessingSecurityScopedResource)])
-        {
-            access = [privateKeyURL startAccessingSecurityScopedResource];
-            if (!access)
-            {
-                NSLog(@"Unable to start accessing private key: %@", [privateKeyURL path]);
-            }
-        }
-        
-        NSString *password = [credential password];
-        
-        int result = libssh2_userauth_publickey_fromfile(_session,
-                                                         [[credential user] UTF8String],
-                                                         [publicKey fileSystemRepresentation],
-                                                         [privateKey fileSystemRepresentation],
-                                                         [password UTF8String]);
-        
-        if (access) [privateKeyURL stopAccessingSecurityScopedResource];
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        int result = [self authenticateUser:[credential user]
+                              privateKeyURL:privateKeyURL
+                               publicKeyURL:[credential ck2_publicKeyURL]
+                                 passphrase:[credential password]];
+        [_connectionTimings addAuthenticationAttemptWithScheme:CK2SSHAuthenticationSchemePublicKey startTime:start succeeded:(result == LIBSSH2_ERROR_NONE)];
         
         if (result)
         {
@@ -1127,6 +3121,7 @@ static void kbd_callback(const char *name, int name_len,
         }
         else
         {
+            [self rememberAuthenticationMemo:CK2SSHAuthenticationSchemePublicKey forKey:CK2SFTPMemoSchemeKey user:[credential user]];
             [[NSURLCredentialStorage sharedCredentialStorage] ck2_setPrivateKeyCredential:credential];
         }
         
@@ -1136,6 +3131,28 @@ static void kbd_callback(const char *name, int name_len,
     return YES;
 }
 
+- (int)authenticateUser:(NSString *)user credential:(NSURLCredential *)credential scheme:(NSString *)scheme;
+{
+    int result;
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    
+    if ([scheme isEqualToString:CK2SSHAuthenticationSchemeKeyboardInteractive])
+    {
+        _keyboardInteractiveCredential = credential;    // weak, temporary
+        result = CK2SFTPRetry(self, libssh2_userauth_keyboard_interactive(_session, [user UTF8String], &kbd_callback));
+        _keyboardInteractiveCredential = nil;
+    }
+    else
+    {
+        NSString *password = [credential password];
+        if (!password) password = @"";  // libssh2 can't handle nil passwords
+        result = CK2SFTPRetry(self, libssh2_userauth_password(_session, [user UTF8String], [password UTF8String]));
+    }
+    
+    [_connectionTimings addAuthenticationAttemptWithScheme:scheme startTime:start succeeded:(result == LIBSSH2_ERROR_NONE)];
+    return result;
+}
+
 - (void)useCredential:(NSURLCredential *)credential forAuthenticationChallenge:(NSURLAuthenticationChallenge *)challenge
 {
     NSParameterAssert(challenge);
@@ -1168,27 +3185,39 @@ static void kbd_callback(const char *name, int name_len,
         NSString *user = [credential user];
         if (!user) user = @"";  // so libssh2 doesn't choke on it
         
-        NSArray *authSchemes = [self supportedAuthenticationSchemesForUser:user];
-        if (!authSchemes)
-        {
-            [self failWithError:[self sessionError]];
-        }
+        // Asking which schemes the server supports costs a round trip, so skip it when we know what worked last time
+        NSString *scheme = [self authenticationMemo:CK2SFTPMemoSchemeKey forUser:user];
+        BOOL remembered = ([scheme isEqualToString:CK2SSHAuthenticationSchemePassword] ||
+                           [scheme isEqualToString:CK2SSHAuthenticationSchemeKeyboardInteractive]);
         
+        int rc = LIBSSH2_ERROR_AUTHENTICATION_FAILED;
+        if (remembered) rc = [self authenticateUser:user credential:credential scheme:scheme];
         
-        // Use Keyboard-Interactive auth only if forced to
-        int rc;
-        if ([authSchemes containsObject:CK2SSHAuthenticationSchemeKeyboardInteractive] &&
-            ![authSchemes containsObject:CK2SSHAuthenticationSchemePassword])
-        {
-            _keyboardInteractiveCredential = credential;    // weak, temporary
-            rc = libssh2_userauth_keyboard_interactive(_session, [user UTF8String], &kbd_callback);
-            _keyboardInteractiveCredential = nil;
-        }
-        else
+        // Failure could mean a wrong password, or that the server has changed what it accepts. Only have another go if it's the latter
+        if (!remembered || (rc == LIBSSH2_ERROR_AUTHENTICATION_FAILED && _session))
         {
-            NSString *password = [credential password];
-            if (!password) password = @"";  // libssh2 can't handle nil passwords
-            rc = libssh2_userauth_password(_session, [user UTF8String], [password UTF8String]);
+            NSArray *authSchemes = [self supportedAuthenticationSchemesForUser:user];
+            if (!authSchemes)
+            {
+                [self failWithError:[self sessionError]];
+                return;
+            }
+            
+            // Use Keyboard-Interactive auth only if forced to
+            NSString *supportedScheme = CK2SSHAuthenticationSchemePassword;
+            if ([authSchemes containsObject:CK2SSHAuthenticationSchemeKeyboardInteractive] &&
+                ![authSchemes containsObject:CK2SSHAuthenticationSchemePassword])
+            {
+                supportedScheme = CK2SSHAuthenticationSchemeKeyboardInteractive;
+            }
+            
+            if (!remembered || ![authSchemes containsObject:scheme])
+            {
+                if (remembered) [self rememberAuthenticationMemo:nil forKey:CK2SFTPMemoSchemeKey user:user];
+                
+                scheme = supportedScheme;
+                rc = [self authenticateUser:user credential:credential scheme:scheme];
+            }
         }
         
         if (rc)
@@ -1214,6 +3243,8 @@ static void kbd_callback(const char *name, int name_len,
         }
         else
         {
+            [self rememberAuthenticationMemo:scheme forKey:CK2SFTPMemoSchemeKey user:user];
+            
             // Add to keychain if requested
             [[NSURLCredentialStorage sharedCredentialStorage] setCredential:credential forProtectionSpace:challenge.protectionSpace];
             [self initializeSFTP];
@@ -1248,6 +3279,111 @@ static void kbd_callback(const char *name, int name_len,
 
 #pragma mark Low-level
 
+- (BOOL)waitForSocket;
+{
+    if (!_session || !_socket || _kqueue < 0) return NO;
+    
+    // Retries wait back-to-back, so a gap since the last wait means this is a fresh call
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    if (!_callStart || now - _lastSocketWait > 1.0) _callStart = now;
+    _lastSocketWait = now;
+    
+    NSTimeInterval remaining = _callStart + _timeout - now;
+    if (remaining <= 0.0) return NO;
+    
+    
+    // Only wait in the direction(s) libssh2 is actually blocked on
+    int socket = CFSocketGetNative(_socket);
+    [_transportLock lock];
+    int directions = libssh2_session_block_directions(_session);
+    BOOL shared = (_transportOwner || [_channels count]);
+    [_transportLock unlock];
+    
+    struct kevent changes[2];
+    int count = 0;
+    if (directions & LIBSSH2_SESSION_BLOCK_INBOUND) EV_SET(&changes[count++], socket, EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+    if (directions & LIBSSH2_SESSION_BLOCK_OUTBOUND) EV_SET(&changes[count++], socket, EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+    
+    if (count == 0) return YES; // libssh2 isn't waiting on the socket, so is worth trying again straight away
+    
+    
+    // When channels share the connection, another thread may read our data off the socket into libssh2's queue while we wait. It then wakes us through CK2SFTPWakeEvent
+    struct timespec timeout;
+    timeout.tv_sec = (time_t)remaining;
+    timeout.tv_nsec = (long)((remaining - timeout.tv_sec) * NSEC_PER_SEC);
+    
+    struct kevent event;
+    int rc = kevent(_kqueue, changes, count, &event, 1, &timeout);
+    
+    // A stray event from an earlier wait is harmless; libssh2 just reports EAGAIN again
+    _lastSocketWait = CFAbsoluteTimeGetCurrent();
+    if (rc > 0 || (rc < 0 && errno == EINTR))
+    {
+        // With the connection to ourselves, activity on it is progress for this call, so restarts the clock. When shared, it may have been for another channel
+        if (!shared) _callStart = _lastSocketWait;
+        return YES;
+    }
+    
+    return NO;
+}
+
+- (void)libssh2CallDidFinish:(BOOL)failed;
+{
+    int code = (failed ? libssh2_session_last_errno(_session) : 0);
+    
+    // Not being told to try again means the call is done with; the next starts its own clock
+    if (code != LIBSSH2_ERROR_EAGAIN) _callStart = 0.0;
+    
+    _lastErrorCode = code;
+    [_lastErrorMessage release]; _lastErrorMessage = nil;
+    _lastSFTPErrorCode = 0;
+    
+    if (code)
+    {
+        char *errormsg;
+        libssh2_session_last_error(_session, &errormsg, NULL, 0);
+        _lastErrorMessage = [[NSString alloc] initWithCString:errormsg encoding:NSUTF8StringEncoding];
+        if (code == LIBSSH2_ERROR_SFTP_PROTOCOL && _sftp) _lastSFTPErrorCode = libssh2_sftp_last_error(_sftp);
+    }
+    
+    
+    // Whatever this call read off the socket may be what another channel is waiting for
+    CK2SFTPSession *owner = (_transportOwner ? _transportOwner : self);
+    if (![owner->_channels count]) return;
+    
+    struct kevent wake;
+    EV_SET(&wake, CK2SFTPWakeEvent, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    
+    if (owner != self && owner->_kqueue >= 0) kevent(owner->_kqueue, &wake, 1, NULL, 0, NULL);
+    for (NSValue *aValue in owner->_channels)
+    {
+        CK2SFTPSession *aChannel = [aValue nonretainedObjectValue];
+        if (aChannel != self && aChannel->_kqueue >= 0) kevent(aChannel->_kqueue, &wake, 1, NULL, 0, NULL);
+    }
+}
+
+@synthesize timeout = _timeout;
+@synthesize transportLock = _transportLock;
+
+#pragma mark Metadata Cache
+
+- (NSTimeInterval)metadataCacheTimeout; { return [_metadataCache timeout]; }
+- (void)setMetadataCacheTimeout:(NSTimeInterval)timeout;
+{
+    [_metadataCache setTimeout:timeout];
+    if (timeout <= 0.0) [_metadataCache removeAllObjects];
+}
+
+- (void)invalidateCachedMetadataForPath:(NSString *)path;
+{
+    [_metadataCache removeObjectsForPath:path includingDescendants:YES];
+}
+
+- (void)removeAllCachedMetadata;
+{
+    [_metadataCache removeAllObjects];
+}
+
 @synthesize libssh2_sftp = _sftp;
 @synthesize libssh2_session = _session;
 @end
@@ -0,0 +1,65 @@
+//
+//  CK2SFTPSessionPool.h
+//  Sandvox
+//
+//  Created by Karelia Software on 17/10/2026.
+//  Copyright © 2026 Karelia Software
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+//  Sessions cost a DNS lookup, TCP connect, key exchange and authentication to set up. A pool keeps them around once checked back in, so later work against the same host, port and user can skip all that.
+//  Like CK2SFTPSession, a checked out session should only be used by one thread at a time. The pool itself is safe to use from any thread.
+
+
+#import "CK2SFTPSession.h"
+
+
+@interface CK2SFTPSessionPool : NSObject
+{
+  @private
+    NSMutableDictionary *_idleConnections;      // host key -> array of connections, most recently used last
+    NSMutableDictionary *_checkedOutConnections;    // session -> connection
+    NSCountedSet        *_connectionCounts;     // user@host:port, once per connection whether idle or checked out
+    NSCondition         *_condition;
+    
+    NSTimeInterval      _idleTimeout;
+    NSUInteger          _maximumSessionsPerHost;
+    dispatch_source_t   _idleTimer;
+}
+
++ (CK2SFTPSessionPool *)sharedPool;
+
+// Returns a session that's authenticated and has SFTP initialized, ready for use. An idle session is reused if available, otherwise a new one is connected
+// If the user already has maximumSessionsPerHost sessions to the host, whatever their credentials, blocks until one is checked back in. An idle session for a different credential is disconnected to make room
+// Idle sessions are only reused for an equivalent credential: the same user and password, or the same key files. The host's key must already be in known_hosts; anything else fails with an error
+- (CK2SFTPSession *)checkOutSessionWithURL:(NSURL *)URL credential:(NSURLCredential *)credential error:(NSError **)error;
+
+// Call once done with a session, rather than cancelling it. Sessions which have failed are disposed of
+- (void)checkInSession:(CK2SFTPSession *)session;
+
+// Disconnects all sessions not currently checked out
+- (void)drainIdleSessions;
+
+// Stops the timer sweeping idle sessions, and drains them. Until then, the timer keeps the pool alive, so call once done with a pool of your own. The shared pool is never invalidated
+- (void)invalidate;
+
+@property(nonatomic) NSTimeInterval idleTimeout;    // idle sessions older than this are disconnected, even if the pool isn't being used. Defaults to 60 seconds
+@property(nonatomic) NSUInteger maximumSessionsPerHost; // counted per user@host:port, across all credentials. Defaults to 4
+
+@end
@@ -0,0 +1,495 @@
+//
+//  CK2SFTPSessionPool.m
+//  Sandvox
+//
+//  Created by Karelia Software on 17/10/2026.
+//  Copyright © 2026 Karelia Software
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import "CK2SFTPSessionPool.h"
+#import "CK2SSHCredential.h"
+
+#include <CommonCrypto/CommonDigest.h>
+
+
+// Connects a single session, and then acts as its delegate for the rest of its life in the pool
+@interface CK2SFTPPooledConnection : NSObject <CK2SFTPSessionDelegate>
+{
+  @private
+    CK2SFTPSession  *_session;
+    NSURLCredential *_credential;
+    NSString        *_hostKey;
+    NSError         *_error;
+    BOOL            _initialized;
+    CFAbsoluteTime  _lastUsed;
+}
+
+- (id)initWithURL:(NSURL *)URL credential:(NSURLCredential *)credential hostKey:(NSString *)hostKey;
+- (BOOL)connect:(NSError **)error;
+- (void)disconnect;
+- (BOOL)isUsable;
+
+@property(nonatomic, readonly) CK2SFTPSession *session;
+@property(nonatomic, readonly) NSString *hostKey;
+@property(nonatomic) CFAbsoluteTime lastUsed;
+
+@end
+
+
+#pragma mark -
+
+
+@implementation CK2SFTPSessionPool
+
++ (CK2SFTPSessionPool *)sharedPool;
+{
+    static CK2SFTPSessionPool *sharedPool;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedPool = [[CK2SFTPSessionPool alloc] init];
+    });
+    
+    return sharedPool;
+}
+
+- (id)init;
+{
+    if (self = [super init])
+    {
+        _idleConnections = [[NSMutableDictionary alloc] init];
+        _checkedOutConnections = [[NSMutableDictionary alloc] init];
+        _connectionCounts = [[NSCountedSet alloc] init];
+        _condition = [[NSCondition alloc] init];
+        
+        _idleTimeout = 60.0;
+        _maximumSessionsPerHost = 4;
+        
+        // Idle sessions are also swept up on a timer, so a pool that's gone quiet doesn't hold connections open indefinitely
+        // The handler retains the pool, so it can't fire against one that's been freed. -invalidate breaks the cycle
+        _idleTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0));
+        dispatch_source_set_event_handler(_idleTimer, ^{
+            [self disconnectExpiredSessions];
+        });
+        [self scheduleIdleTimer];
+        dispatch_resume(_idleTimer);
+    }
+    
+    return self;
+}
+
+- (void)dealloc;
+{
+    dispatch_release(_idleTimer);   // already cancelled, or the pool couldn't have been deallocated
+    
+    [self drainIdleSessions];
+    
+    [_idleConnections release];
+    [_checkedOutConnections release];
+    [_connectionCounts release];
+    [_condition release];
+    
+    [super dealloc];
+}
+
+- (void)invalidate;
+{
+    // Once cancelled, the timer releases its handler, and so the pool
+    dispatch_source_cancel(_idleTimer);
+    [self drainIdleSessions];
+}
+
+// Sessions are only reused for the same credential, so that presenting a wrong password or different key can't get hold of someone else's authenticated session
+// The credential is represented by a digest, salted afresh for each run, so that passwords aren't kept around in the keys
++ (NSString *)hostKeyForURL:(NSURL *)URL credential:(NSURLCredential *)credential;
+{
+    static unsigned char salt[16];
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        arc4random_buf(salt, sizeof(salt));
+    });
+    
+    NSString *user = [credential user];
+    NSNumber *port = [URL port];
+    
+    NSMutableData *secret = [NSMutableData dataWithBytes:salt length:sizeof(salt)];
+    NSString *password = [credential password];
+    if (password) [secret appendData:[password dataUsingEncoding:NSUTF8StringEncoding]];
+    if ([credential ck2_isPublicKeyCredential])
+    {
+        // No private key means SSH-Agent
+        NSString *keyPaths = [NSString stringWithFormat:@"\npublickey\n%@\n%@", [[credential ck2_privateKeyURL] path], [[credential ck2_publicKeyURL] path]];
+        [secret appendData:[keyPaths dataUsingEncoding:NSUTF8StringEncoding]];
+    }
+    
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256([secret bytes], (CC_LONG)[secret length], digest);
+    [secret resetBytesInRange:NSMakeRange(0, [secret length])];
+    
+    NSMutableString *result = [NSMutableString stringWithFormat:@"%@@%@:%@#", (user ? user : @""), [[URL host] lowercaseString], (port ? port : [NSNumber numberWithInt:22])];
+    int i;
+    for (i = 0; i < CC_SHA256_DIGEST_LENGTH; i++)
+    {
+        [result appendFormat:@"%02x", digest[i]];
+    }
+    return result;
+}
+
+// The connection limit applies to the user at the host as a whole, not each credential, so it's the host key minus the credential's digest
+static NSString *CK2SFTPLimitKeyForHostKey(NSString *hostKey)
+{
+    return [hostKey substringToIndex:[hostKey rangeOfString:@"#" options:NSBackwardsSearch].location];
+}
+
+#pragma mark Checking Out & In
+
+- (CK2SFTPSession *)checkOutSessionWithURL:(NSURL *)URL credential:(NSURLCredential *)credential error:(NSError **)error;
+{
+    NSParameterAssert(URL);
+    
+    NSString *hostKey = [[self class] hostKeyForURL:URL credential:credential];
+    NSString *limitKey = CK2SFTPLimitKeyForHostKey(hostKey);
+    NSMutableArray *disposable = [NSMutableArray array];
+    
+    [_condition lock];
+    @try
+    {
+        while (YES)
+        {
+            [self removeExpiredConnectionsIntoArray:disposable];
+            
+            // Favour the most recently used session, as the one least likely to have been dropped by the server
+            NSMutableArray *idle = [_idleConnections objectForKey:hostKey];
+            while ([idle count])
+            {
+                CK2SFTPPooledConnection *connection = [idle lastObject];
+                [disposable addObject:connection];
+                [idle removeLastObject];
+                
+                if ([connection isUsable])
+                {
+                    CK2SFTPSession *session = [connection session];
+                    [_checkedOutConnections setObject:connection forKey:[NSValue valueWithNonretainedObject:session]];
+                    [disposable removeObject:connection];
+                    return session;
+                }
+                
+                [_connectionCounts removeObject:limitKey];
+            }
+            
+            // At the limit, an idle session for another credential can make way
+            if ([_connectionCounts countForObject:limitKey] >= _maximumSessionsPerHost)
+            {
+                [self removeIdleConnectionForLimitKey:limitKey intoArray:disposable];
+            }
+            
+            // Make a new one if there's room. The count is bumped now to reserve a slot while connecting
+            if ([_connectionCounts countForObject:limitKey] < _maximumSessionsPerHost)
+            {
+                [_connectionCounts addObject:limitKey];
+                break;
+            }
+            
+            [_condition wait];
+        }
+    }
+    @finally
+    {
+        [_condition unlock];
+        [disposable makeObjectsPerformSelector:@selector(disconnect)];  // outside the lock as involves the network
+    }
+    
+    
+    // Connect outside the lock so other hosts aren't held up
+    CK2SFTPPooledConnection *result = [[CK2SFTPPooledConnection alloc] initWithURL:URL credential:credential hostKey:hostKey];
+    BOOL connected = [result connect:error];
+    
+    [_condition lock];
+    if (connected)
+    {
+        [_checkedOutConnections setObject:result forKey:[NSValue valueWithNonretainedObject:[result session]]];
+    }
+    else
+    {
+        [_connectionCounts removeObject:limitKey];
+        [_condition broadcast]; // waiters may be after other hosts, so wake them all
+    }
+    [_condition unlock];
+    
+    CK2SFTPSession *session = (connected ? [[[result session] retain] autorelease] : nil);
+    [result release];
+    return session;
+}
+
+- (void)checkInSession:(CK2SFTPSession *)session;
+{
+    NSParameterAssert(session);
+    
+    NSValue *key = [NSValue valueWithNonretainedObject:session];
+    NSMutableArray *disposable = [NSMutableArray array];
+    
+    [_condition lock];
+    
+    CK2SFTPPooledConnection *connection = [[_checkedOutConnections objectForKey:key] retain];
+    if (!connection)
+    {
+        [_condition unlock];
+        NSLog(@"Checking in a session %@ which didn't come from this pool", session);
+        return;
+    }
+    [_checkedOutConnections removeObjectForKey:key];
+    
+    if ([connection isUsable])
+    {
+        [connection setLastUsed:CFAbsoluteTimeGetCurrent()];
+        
+        NSMutableArray *idle = [_idleConnections objectForKey:[connection hostKey]];
+        if (!idle)
+        {
+            idle = [NSMutableArray array];
+            [_idleConnections setObject:idle forKey:[connection hostKey]];
+        }
+        [idle addObject:connection];
+    }
+    else
+    {
+        [_connectionCounts removeObject:CK2SFTPLimitKeyForHostKey([connection hostKey])];
+        [disposable addObject:connection];
+    }
+    
+    [self removeExpiredConnectionsIntoArray:disposable];
+    [_condition broadcast];
+    [_condition unlock];
+    
+    [disposable makeObjectsPerformSelector:@selector(disconnect)];
+    [connection release];
+}
+
+#pragma mark Idle Sessions
+
+// Must be called with the lock held. The connections are then disconnected by the caller, once outside of the lock
+- (void)removeExpiredConnectionsIntoArray:(NSMutableArray *)expired;
+{
+    CFAbsoluteTime cutoff = CFAbsoluteTimeGetCurrent() - _idleTimeout;
+    
+    for (NSString *aHostKey in [_idleConnections allKeys])
+    {
+        NSMutableArray *idle = [_idleConnections objectForKey:aHostKey];
+        
+        // Oldest are first
+        while ([idle count] && [[idle objectAtIndex:0] lastUsed] < cutoff)
+        {
+            [expired addObject:[idle objectAtIndex:0]];
+            [idle removeObjectAtIndex:0];
+            [_connectionCounts removeObject:CK2SFTPLimitKeyForHostKey(aHostKey)];
+        }
+        
+        if (![idle count]) [_idleConnections removeObjectForKey:aHostKey];
+    }
+}
+
+// Must be called with the lock held. Picks the least recently used idle connection for any of the user's credentials, if there is one
+- (void)removeIdleConnectionForLimitKey:(NSString *)limitKey intoArray:(NSMutableArray *)removed;
+{
+    NSString *oldestHostKey = nil;
+    CK2SFTPPooledConnection *oldest = nil;
+    
+    for (NSString *aHostKey in _idleConnections)
+    {
+        if (![CK2SFTPLimitKeyForHostKey(aHostKey) isEqualToString:limitKey]) continue;
+        
+        CK2SFTPPooledConnection *connection = [[_idleConnections objectForKey:aHostKey] objectAtIndex:0];
+        if (!oldest || [connection lastUsed] < [oldest lastUsed])
+        {
+            oldest = connection;
+            oldestHostKey = aHostKey;
+        }
+    }
+    if (!oldest) return;
+    
+    NSMutableArray *idle = [_idleConnections objectForKey:oldestHostKey];
+    [removed addObject:oldest];
+    [idle removeObjectAtIndex:0];
+    if (![idle count]) [_idleConnections removeObjectForKey:oldestHostKey];
+    [_connectionCounts removeObject:limitKey];
+}
+
+- (void)disconnectExpiredSessions;
+{
+    NSMutableArray *disposable = [NSMutableArray array];
+    
+    [_condition lock];
+    [self removeExpiredConnectionsIntoArray:disposable];
+    if ([disposable count]) [_condition broadcast];
+    [_condition unlock];
+    
+    [disposable makeObjectsPerformSelector:@selector(disconnect)];
+}
+
+- (void)scheduleIdleTimer;
+{
+    // Sweeping at half the timeout means sessions outstay it by no more than half again
+    NSTimeInterval interval = MAX(_idleTimeout / 2.0, 1.0);
+    dispatch_source_set_timer(_idleTimer,
+                              dispatch_time(DISPATCH_TIME_NOW, (int64_t)(interval * NSEC_PER_SEC)),
+                              (uint64_t)(interval * NSEC_PER_SEC),
+                              NSEC_PER_SEC);
+}
+
+- (void)drainIdleSessions;
+{
+    NSMutableArray *disposable = [NSMutableArray array];
+    
+    [_condition lock];
+    for (NSString *aHostKey in _idleConnections)
+    {
+        NSArray *idle = [_idleConnections objectForKey:aHostKey];
+        [disposable addObjectsFromArray:idle];
+        
+        NSUInteger i;
+        for (i = 0; i < [idle count]; i++) [_connectionCounts removeObject:CK2SFTPLimitKeyForHostKey(aHostKey)];
+    }
+    [_idleConnections removeAllObjects];
+    [_condition broadcast];
+    [_condition unlock];
+    
+    [disposable makeObjectsPerformSelector:@selector(disconnect)];
+}
+
+@synthesize idleTimeout = _idleTimeout;
+- (void)setIdleTimeout:(NSTimeInterval)timeout;
+{
+    _idleTimeout = timeout;
+    [self scheduleIdleTimer];
+}
+
+@synthesize maximumSessionsPerHost = _maximumSessionsPerHost;
+
+@end
+
+
+#pragma mark -
+
+
+@implementation CK2SFTPPooledConnection
+
+- (id)initWithURL:(NSURL *)URL credential:(NSURLCredential *)credential hostKey:(NSString *)hostKey;
+{
+    if (self = [self init])
+    {
+        _session = [[CK2SFTPSession alloc] initWithURL:URL delegate:self startImmediately:NO];
+        _credential = [credential retain];
+        _hostKey = [hostKey copy];
+    }
+    
+    return self;
+}
+
+- (void)dealloc;
+{
+    [self disconnect];
+    
+    [_session release];
+    [_credential release];
+    [_hostKey release];
+    [_error release];
+    
+    [super dealloc];
+}
+
+- (BOOL)connect:(NSError **)error;
+{
+    // The session runs synchronously right through to initializing SFTP (or failing), calling us back along the way
+    [_session start];
+    
+    if (!_initialized && error)
+    {
+        *error = (_error ? [[_error retain] autorelease] : [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorCannotConnectToHost userInfo:nil]);
+    }
+    
+    return _initialized;
+}
+
+- (void)disconnect;
+{
+    [_session cancel];  // stops delegate messages, so safe to go away after this
+}
+
+- (BOOL)isUsable;
+{
+    return (_initialized && !_error && [_session libssh2_sftp]);
+}
+
+@synthesize session = _session;
+@synthesize hostKey = _hostKey;
+@synthesize lastUsed = _lastUsed;
+
+#pragma mark CK2SFTPSessionDelegate
+
+- (void)SFTPSessionDidInitialize:(CK2SFTPSession *)session;
+{
+    _initialized = YES;
+}
+
+- (void)SFTPSession:(CK2SFTPSession *)session didFailWithError:(NSError *)error;
+{
+    if (!_error) _error = [error retain];   // keep the first, most descriptive, error
+}
+
+- (void)SFTPSession:(CK2SFTPSession *)session appendStringToTranscript:(NSString *)string received:(BOOL)received;
+{
+}
+
+- (void)SFTPSession:(CK2SFTPSession *)session didReceiveAuthenticationChallenge:(NSURLAuthenticationChallenge *)challenge;
+{
+    // There's no one to ask about unknown hosts, so only trust those already known
+    NSError *error = nil;
+    int knownHost = [CK2SFTPSession checkKnownHostsForFingerprintFromSession:session error:&error];
+    if (knownHost != LIBSSH2_KNOWNHOST_CHECK_MATCH)
+    {
+        if (!_error)
+        {
+            NSDictionary *userInfo = [NSDictionary dictionaryWithObjectsAndKeys:
+                                      @"The server's host key isn't in known_hosts", NSLocalizedDescriptionKey,
+                                      error, NSUnderlyingErrorKey,  // nil unless failed to check at all
+                                      nil];
+            
+            _error = [[NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorServerCertificateUntrusted userInfo:userInfo] retain];
+        }
+        
+        [[challenge sender] cancelAuthenticationChallenge:challenge];
+    }
+    else if ([challenge previousFailureCount] == 0)
+    {
+        [[challenge sender] useCredential:_credential forAuthenticationChallenge:challenge];
+    }
+    else
+    {
+        // Our only credential was rejected
+        if (!_error) _error = [[challenge error] retain];
+        [[challenge sender] cancelAuthenticationChallenge:challenge];
+    }
+}
+
+- (void)SFTPSession:(CK2SFTPSession *)session didCancelAuthenticationChallenge:(NSURLAuthenticationChallenge *)challenge;
+{
+}
+
+@end
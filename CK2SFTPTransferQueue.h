@@ -0,0 +1,77 @@
+//
+//  CK2SFTPTransferQueue.h
+//  Sandvox
+//
+//  Created by Karelia Software on 17/10/2026.
+//  Copyright © 2026 Karelia Software
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+//  Spreads a batch of uploads and downloads across several pooled sessions. Large files are bandwidth-bound, so each gets a session to itself with deep pipelining. Small files are latency-bound, so they're grouped into batches which share a session back-to-back, running alongside the large ones to keep the link busy.
+
+
+#import "CK2SFTPSessionPool.h"
+
+
+@interface CK2SFTPTransferQueue : NSObject
+{
+  @private
+    NSURL               *_URL;
+    NSURLCredential     *_credential;
+    CK2SFTPSessionPool  *_pool;
+    
+    NSMutableArray      *_transfers;
+    NSOperationQueue    *_largeQueue;
+    NSOperationQueue    *_smallQueue;
+    
+    unsigned long long  _totalBytes;
+    unsigned long long  _completedBytes;
+    NSError             *_error;
+    
+    NSUInteger          _maximumConcurrentTransfers;
+    unsigned long long  _largeFileThreshold;
+    BOOL                _resumesPartialTransfers;
+    NSUInteger          _resumeVerificationLength;
+    void                (^_progressHandler)(unsigned long long completedBytes, unsigned long long totalBytes);
+    dispatch_queue_t    _progressQueue;
+}
+
+// Pool defaults to the shared one
+- (id)initWithURL:(NSURL *)URL credential:(NSURLCredential *)credential pool:(CK2SFTPSessionPool *)pool;
+
+// Remote files are created with the given mode. Local files with the standard permissions
+- (void)addUploadOfItemAtURL:(NSURL *)localURL toPath:(NSString *)remotePath mode:(long)mode;
+// Size is used to schedule the download and report progress. Directory listings supply it as NSFileSize
+- (void)addDownloadOfItemAtPath:(NSString *)remotePath size:(unsigned long long)size toURL:(NSURL *)localURL;
+
+// Runs all transfers added so far, blocking until they're done. Transfers carry on after one fails, with the first error being reported
+- (BOOL)transferAndWaitUntilFinished:(NSError **)error;
+
+@property(nonatomic) NSUInteger maximumConcurrentTransfers;     // across large and small files combined. Defaults to the pool's maximumSessionsPerHost
+@property(nonatomic) unsigned long long largeFileThreshold;     // defaults to 1MB
+
+// When YES, a destination file no larger than its source is taken to be left over from an interrupted transfer, and carried on from its end rather than from scratch. Defaults to NO
+// Before resuming, up to resumeVerificationLength bytes at the end of the partial file are compared against the source, starting again from scratch if they differ. 0 trusts the partial file as is. Defaults to 64KB
+@property(nonatomic) BOOL resumesPartialTransfers;
+@property(nonatomic) NSUInteger resumeVerificationLength;
+
+// Called as data is sent or received, one call at a time, on a private serial queue. The transfer reporting progress waits for the handler to return, so keep it quick
+@property(nonatomic, copy) void (^progressHandler)(unsigned long long completedBytes, unsigned long long totalBytes);
+
+@end
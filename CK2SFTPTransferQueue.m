@@ -0,0 +1,405 @@
+//
+//  CK2SFTPTransferQueue.m
+//  Sandvox
+//
+//  Created by Karelia Software on 17/10/2026.
+//  Copyright © 2026 Karelia Software
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import "CK2SFTPTransferQueue.h"
+
+
+#define CK2SFTPTransferPipelineDepth 64
+#define CK2SFTPSmallTransferBatchSize 32
+
+
+@interface CK2SFTPTransfer : NSObject
+{
+  @public
+    NSURL               *_localURL;
+    NSString            *_remotePath;
+    BOOL                _isUpload;
+    long                _mode;
+    unsigned long long  _size;
+}
+@end
+
+
+@implementation CK2SFTPTransfer
+
+- (void)dealloc;
+{
+    [_localURL release];
+    [_remotePath release];
+    [super dealloc];
+}
+
+@end
+
+
+#pragma mark -
+
+
+@implementation CK2SFTPTransferQueue
+
+- (id)initWithURL:(NSURL *)URL credential:(NSURLCredential *)credential pool:(CK2SFTPSessionPool *)pool;
+{
+    NSParameterAssert(URL);
+    
+    if (self = [self init])
+    {
+        _URL = [URL copy];
+        _credential = [credential retain];
+        _pool = [(pool ? pool : [CK2SFTPSessionPool sharedPool]) retain];
+        
+        _transfers = [[NSMutableArray alloc] init];
+        _maximumConcurrentTransfers = [_pool maximumSessionsPerHost];
+        _largeFileThreshold = 1024 * 1024;
+        _resumeVerificationLength = 64 * 1024;
+        
+        _progressQueue = dispatch_queue_create("com.karelia.CK2SFTPTransferQueue.progress", DISPATCH_QUEUE_SERIAL);
+    }
+    
+    return self;
+}
+
+- (void)dealloc;
+{
+    [_URL release];
+    [_credential release];
+    [_pool release];
+    [_transfers release];
+    [_largeQueue release];
+    [_smallQueue release];
+    [_error release];
+    [_progressHandler release];
+    dispatch_release(_progressQueue);
+    
+    [super dealloc];
+}
+
+#pragma mark Adding Transfers
+
+- (void)addUploadOfItemAtURL:(NSURL *)localURL toPath:(NSString *)remotePath mode:(long)mode;
+{
+    NSParameterAssert(localURL);
+    NSParameterAssert(remotePath);
+    
+    NSNumber *size = nil;
+    [localURL getResourceValue:&size forKey:NSURLFileSizeKey error:NULL];
+    
+    CK2SFTPTransfer *transfer = [[CK2SFTPTransfer alloc] init];
+    transfer->_localURL = [localURL copy];
+    transfer->_remotePath = [remotePath copy];
+    transfer->_isUpload = YES;
+    transfer->_mode = mode;
+    transfer->_size = [size unsignedLongLongValue];
+    
+    [_transfers addObject:transfer];
+    [transfer release];
+}
+
+- (void)addDownloadOfItemAtPath:(NSString *)remotePath size:(unsigned long long)size toURL:(NSURL *)localURL;
+{
+    NSParameterAssert(remotePath);
+    NSParameterAssert(localURL);
+    
+    CK2SFTPTransfer *transfer = [[CK2SFTPTransfer alloc] init];
+    transfer->_localURL = [localURL copy];
+    transfer->_remotePath = [remotePath copy];
+    transfer->_size = size;
+    
+    [_transfers addObject:transfer];
+    [transfer release];
+}
+
+#pragma mark Running
+
+- (BOOL)transferAndWaitUntilFinished:(NSError **)error;
+{
+    // Largest first, so the run doesn't end up waiting on one big straggler
+    NSArray *transfers = [_transfers sortedArrayUsingComparator:^NSComparisonResult(CK2SFTPTransfer *transfer1, CK2SFTPTransfer *transfer2) {
+        if (transfer1->_size > transfer2->_size) return NSOrderedAscending;
+        if (transfer1->_size < transfer2->_size) return NSOrderedDescending;
+        return NSOrderedSame;
+    }];
+    [_transfers removeAllObjects];
+    
+    NSMutableArray *large = [NSMutableArray array];
+    NSMutableArray *small = [NSMutableArray array];
+    _totalBytes = 0;
+    _completedBytes = 0;
+    [_error release]; _error = nil;
+    
+    for (CK2SFTPTransfer *aTransfer in transfers)
+    {
+        [(aTransfer->_size >= _largeFileThreshold ? large : small) addObject:aTransfer];
+        _totalBytes += aTransfer->_size;
+    }
+    
+    
+    // When there's a mix, split the sessions between the two kinds so small files aren't stuck behind large ones
+    NSUInteger lanes = MAX(_maximumConcurrentTransfers, 1);
+    
+    [_largeQueue release]; _largeQueue = [[NSOperationQueue alloc] init];
+    [_smallQueue release];
+    
+    if ([large count] && [small count] && lanes > 1)
+    {
+        [_largeQueue setMaxConcurrentOperationCount:(lanes - lanes / 2)];
+        _smallQueue = [[NSOperationQueue alloc] init];
+        [_smallQueue setMaxConcurrentOperationCount:(lanes / 2)];
+    }
+    else
+    {
+        // Only one kind, or only one lane, so everything shares the one queue to stay within the limit
+        [_largeQueue setMaxConcurrentOperationCount:lanes];
+        _smallQueue = [_largeQueue retain];
+    }
+    
+    for (CK2SFTPTransfer *aTransfer in large)
+    {
+        [_largeQueue addOperationWithBlock:^{
+            [self runTransfers:[NSArray arrayWithObject:aTransfer] pipelineDepth:CK2SFTPTransferPipelineDepth];
+        }];
+    }
+    
+    NSUInteger i;
+    for (i = 0; i < [small count]; i += CK2SFTPSmallTransferBatchSize)
+    {
+        NSArray *batch = [small subarrayWithRange:NSMakeRange(i, MIN(CK2SFTPSmallTransferBatchSize, [small count] - i))];
+        [_smallQueue addOperationWithBlock:^{
+            [self runTransfers:batch pipelineDepth:CK2SFTPDefaultReadWindow];
+        }];
+    }
+    
+    [_largeQueue waitUntilAllOperationsAreFinished];
+    [_smallQueue waitUntilAllOperationsAreFinished];
+    
+    if (_error && error) *error = [[_error retain] autorelease];
+    return (_error == nil);
+}
+
+- (void)runTransfers:(NSArray *)transfers pipelineDepth:(NSUInteger)depth;
+{
+    NSError *error;
+    CK2SFTPSession *session = [_pool checkOutSessionWithURL:_URL credential:_credential error:&error];
+    if (!session)
+    {
+        [self transfersDidFail:transfers error:error];
+        return;
+    }
+    
+    for (CK2SFTPTransfer *aTransfer in transfers)
+    {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        
+        BOOL result = (aTransfer->_isUpload ?
+                       [self upload:aTransfer session:session pipelineDepth:depth error:&error] :
+                       [self download:aTransfer session:session pipelineDepth:depth error:&error]);
+        
+        if (!result) [self transfersDidFail:[NSArray arrayWithObject:aTransfer] error:error];
+        
+        // Once the session itself has failed, there's no point trying the rest on it
+        BOOL sessionFailed = ([session libssh2_sftp] == NULL);
+        if (sessionFailed)
+        {
+            if (result) error = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorNetworkConnectionLost userInfo:nil];
+            
+            NSUInteger index = [transfers indexOfObject:aTransfer];
+            [self transfersDidFail:[transfers subarrayWithRange:NSMakeRange(index + 1, [transfers count] - index - 1)]
+                             error:error];
+        }
+        
+        [pool drain];
+        if (sessionFailed) break;
+    }
+    
+    [_pool checkInSession:session];
+}
+
+- (BOOL)upload:(CK2SFTPTransfer *)transfer session:(CK2SFTPSession *)session pipelineDepth:(NSUInteger)depth error:(NSError **)error;
+{
+    CK2SFTPFileHandle *destination = nil;
+    unsigned long long offset = 0;
+    
+    if (_resumesPartialTransfers)
+    {
+        NSNumber *partialSize = [[session attributesOfItemAtPath:transfer->_remotePath error:NULL] objectForKey:NSFileSize];
+        if (partialSize && [partialSize unsignedLongLongValue] <= transfer->_size)
+        {
+            NSFileHandle *source = [NSFileHandle fileHandleForReadingFromURL:transfer->_localURL error:NULL];
+            
+            // Opened for reading too, to check the end of it
+            destination = [session openHandleAtPath:transfer->_remotePath flags:(LIBSSH2_FXF_READ | LIBSSH2_FXF_WRITE) mode:transfer->_mode error:NULL];
+            
+            if (source && destination)
+            {
+                offset = [self resumeOffsetForPartialLength:[partialSize unsignedLongLongValue] localFile:source remoteFile:destination];
+            }
+            [source closeFile];
+        }
+    }
+    
+    if (offset)
+    {
+        if (![destination seekToFileOffset:offset error:error])
+        {
+            [destination closeFile];
+            return NO;
+        }
+        
+        [self didTransferBytes:offset];
+    }
+    else
+    {
+        [destination closeFile];
+        destination = [session openHandleAtPath:transfer->_remotePath
+                                          flags:(LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC)
+                                           mode:transfer->_mode
+                                          error:error];
+        if (!destination) return NO;
+    }
+    
+    [destination setMaximumWriteBytesInFlight:depth * CK2SFTPPreferredChunkSize];
+    [destination setAdaptsPipelineDepth:(transfer->_size >= _largeFileThreshold)];  // small files finish before there's anything to measure
+    
+    BOOL result = [destination writeContentsOfURL:transfer->_localURL fromOffset:offset progressHandler:^(NSUInteger bytesWritten) {
+        [self didTransferBytes:bytesWritten];
+    } error:error];
+    
+    if (result) result = [destination closeFile:error];
+    
+    return result;
+}
+
+- (BOOL)download:(CK2SFTPTransfer *)transfer session:(CK2SFTPSession *)session pipelineDepth:(NSUInteger)depth error:(NSError **)error;
+{
+    CK2SFTPFileHandle *source = [session openHandleAtPath:transfer->_remotePath flags:LIBSSH2_FXF_READ mode:0 error:error];
+    if (!source) return NO;
+    [source setReadWindow:depth];
+    [source setAdaptsPipelineDepth:(transfer->_size >= _largeFileThreshold)];
+    
+    // Sized from a fresh stat, since the caller's figure may be out of date
+    NSNumber *size = [[session attributesOfItemAtPath:transfer->_remotePath error:error] objectForKey:NSFileSize];
+    if (!size)
+    {
+        [source closeFile];
+        return NO;
+    }
+    
+    unsigned long long offset = 0;
+    
+    if (_resumesPartialTransfers)
+    {
+        NSNumber *partialSize = nil;
+        [transfer->_localURL getResourceValue:&partialSize forKey:NSURLFileSizeKey error:NULL];
+        if (partialSize && [partialSize unsignedLongLongValue] <= [size unsignedLongLongValue])
+        {
+            NSFileHandle *partialFile = [NSFileHandle fileHandleForReadingFromURL:transfer->_localURL error:NULL];
+            if (partialFile)
+            {
+                offset = [self resumeOffsetForPartialLength:[partialSize unsignedLongLongValue] localFile:partialFile remoteFile:source];
+            }
+            [partialFile closeFile];
+        }
+    }
+    
+    if (offset)
+    {
+        if (![source seekToFileOffset:offset error:error])
+        {
+            [source closeFile];
+            return NO;
+        }
+        
+        [self didTransferBytes:offset];
+    }
+    
+    BOOL result = [source readIntoFileAtURL:transfer->_localURL
+                                     offset:offset
+                                     length:([size unsignedLongLongValue] - offset)
+                            progressHandler:^(NSUInteger bytesRead) {
+                                [self didTransferBytes:bytesRead];
+                            }
+                                      error:error];
+    
+    if (result)
+    {
+        result = [source closeFile:error];
+    }
+    else
+    {
+        [source closeFile];
+    }
+    
+    return result;
+}
+
+#pragma mark Resuming
+
+// The length to carry on from, or 0 if the end of the partial file doesn't match the source. Either file may be the partial one
+// There's no way to have the server hash its copy, so the overlap is simply fetched and compared
+- (unsigned long long)resumeOffsetForPartialLength:(unsigned long long)length localFile:(NSFileHandle *)localFile remoteFile:(CK2SFTPFileHandle *)remoteFile;
+{
+    NSUInteger overlap = (NSUInteger)MIN(length, _resumeVerificationLength);
+    if (overlap == 0) return length;
+    
+    unsigned long long start = length - overlap;
+    if (![remoteFile seekToFileOffset:start error:NULL]) return 0;
+    NSData *remoteData = [remoteFile readDataOfLength:overlap error:NULL];
+    
+    [localFile seekToFileOffset:start];
+    NSData *localData = [localFile readDataOfLength:overlap];
+    
+    return ([remoteData isEqualToData:localData] ? length : 0);
+}
+
+#pragma mark Progress & Errors
+
+- (void)didTransferBytes:(NSUInteger)length;
+{
+    // Counted and reported on a serial queue, so the handler is called one at a time, with the totals in order
+    dispatch_sync(_progressQueue, ^{
+        _completedBytes += length;
+        unsigned long long total = MAX(_totalBytes, _completedBytes);  // sizes supplied for downloads may be out of date
+        
+        if (_progressHandler) _progressHandler(_completedBytes, total);
+    });
+}
+
+- (void)transfersDidFail:(NSArray *)transfers error:(NSError *)error;
+{
+    if (![transfers count]) return;
+    
+    @synchronized(self)
+    {
+        if (!_error) _error = [error retain];
+    }
+}
+
+@synthesize maximumConcurrentTransfers = _maximumConcurrentTransfers;
+@synthesize largeFileThreshold = _largeFileThreshold;
+@synthesize resumesPartialTransfers = _resumesPartialTransfers;
+@synthesize resumeVerificationLength = _resumeVerificationLength;
+@synthesize progressHandler = _progressHandler;
+
+@end
@@ -0,0 +1,69 @@
+//
+//  CK2SFTPTreeWalker.h
+//  Sandvox
+//
+//  Created by Karelia Software on 17/10/2026.
+//  Copyright © 2026 Karelia Software
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+//  Lists a whole remote directory tree. Several directories are listed at once, each on its own SFTP channel of the session, so the walk isn't bound by one round trip per directory.
+
+
+#import "CK2SFTPSession.h"
+
+
+typedef enum {
+    CK2SFTPSymbolicLinkPolicyReport = 0,    // links are reported, but not descended into
+    CK2SFTPSymbolicLinkPolicyFollow,        // links to directories are descended into, skipping any directory already visited
+} CK2SFTPSymbolicLinkPolicy;
+
+
+@interface CK2SFTPTreeWalker : NSObject
+{
+  @private
+    CK2SFTPSession  *_session;
+    
+    NSUInteger                  _maximumDepth;
+    NSArray                     *_excludedPatterns;
+    CK2SFTPSymbolicLinkPolicy   _symbolicLinkPolicy;
+    NSUInteger                  _maximumConcurrentDirectories;
+    
+    // Walk state
+    NSMutableArray  *_pendingDirectories;
+    NSMutableSet    *_visitedDirectories;
+    NSUInteger      _activeDirectories;
+    NSCondition     *_condition;
+    NSError         *_error;
+    BOOL            _stopped;
+}
+
+- (id)initWithSession:(CK2SFTPSession *)session;
+
+// Calls the block for each item below path, not including path itself. depth is 1 for path's immediate contents
+// Items are passed as soon as their directory listing arrives, from whichever thread listed them. So the block is called concurrently, and must be thread-safe. Set *stop to finish early; calls already underway on other threads still complete
+// Items whose names aren't valid UTF-8 are skipped. So are directories which can't be listed, with the first such error being reported at the end; the return value is then NO even though the rest of the tree was walked
+- (BOOL)walkDirectoryAtPath:(NSString *)path usingBlock:(void (^)(NSString *path, NSDictionary *attributes, NSUInteger depth, BOOL *stop))block error:(NSError **)error;
+
+@property(nonatomic) NSUInteger maximumDepth;                               // 0, the default, means no limit
+@property(nonatomic, copy) NSArray *excludedPatterns;                       // shell-style patterns matched against item names, as by fnmatch(). Matching directories aren't descended into
+@property(nonatomic) CK2SFTPSymbolicLinkPolicy symbolicLinkPolicy;
+@property(nonatomic) NSUInteger maximumConcurrentDirectories;               // number of SFTP channels to list with. Defaults to 4
+
+@end
@@ -0,0 +1,282 @@
+//
+//  CK2SFTPTreeWalker.m
+//  Sandvox
+//
+//  Created by Karelia Software on 17/10/2026.
+//  Copyright © 2026 Karelia Software
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import "CK2SFTPTreeWalker.h"
+
+#include <fnmatch.h>
+
+
+@implementation CK2SFTPTreeWalker
+
+- (id)initWithSession:(CK2SFTPSession *)session;
+{
+    NSParameterAssert(session);
+    
+    if (self = [self init])
+    {
+        _session = [session retain];
+        _maximumConcurrentDirectories = 4;
+    }
+    
+    return self;
+}
+
+- (void)dealloc;
+{
+    [_session release];
+    [_excludedPatterns release];
+    
+    [super dealloc];
+}
+
+#pragma mark Walking
+
+- (BOOL)walkDirectoryAtPath:(NSString *)path usingBlock:(void (^)(NSString *path, NSDictionary *attributes, NSUInteger depth, BOOL *stop))block error:(NSError **)error;
+{
+    NSParameterAssert(path);
+    NSParameterAssert(block);
+    
+    
+    // Each worker needs a channel of its own, as libssh2 only tracks one directory request at a time per channel. Servers may limit how many channels they allow, so make do with however many can be opened
+    NSMutableArray *channels = [NSMutableArray arrayWithObject:_session];
+    while ([channels count] < _maximumConcurrentDirectories)
+    {
+        CK2SFTPSession *channel = [_session openSFTPChannel:NULL];
+        if (!channel) break;
+        [channels addObject:channel];
+    }
+    
+    
+    // Directories are queued as path, depth, and when following links, canonical path
+    NSString *canonicalPath = path;
+    if (_symbolicLinkPolicy == CK2SFTPSymbolicLinkPolicyFollow)
+    {
+        canonicalPath = [self canonicalDirectoryPathForPath:path channel:_session];
+        if (!canonicalPath) canonicalPath = path;   // let listing it report the problem
+    }
+    
+    _pendingDirectories = [[NSMutableArray alloc] initWithObjects:[NSArray arrayWithObjects:path, [NSNumber numberWithUnsignedInteger:0], canonicalPath, nil], nil];
+    _visitedDirectories = [[NSMutableSet alloc] initWithObjects:canonicalPath, nil];
+    _activeDirectories = 0;
+    _condition = [[NSCondition alloc] init];
+    _stopped = NO;
+    
+    
+    // The root is special in that failing to list it is failing altogether
+    __block BOOL rootFailed = NO;
+    dispatch_group_t group = dispatch_group_create();
+    
+    for (CK2SFTPSession *aChannel in channels)
+    {
+        dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            [self runWorkerWithChannel:aChannel block:block rootFailed:&rootFailed];
+        });
+    }
+    
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    dispatch_release(group);
+    
+    
+    // Channels are only needed for the walk
+    [channels removeObject:_session];
+    [channels makeObjectsPerformSelector:@selector(cancel)];
+    
+    [_pendingDirectories release]; _pendingDirectories = nil;
+    [_visitedDirectories release]; _visitedDirectories = nil;
+    [_condition release]; _condition = nil;
+    
+    BOOL result = (_error == nil);
+    if (error && _error) *error = [_error autorelease];
+    else [_error release];
+    _error = nil;
+    
+    if (rootFailed) result = NO;
+    return result;
+}
+
+- (void)runWorkerWithChannel:(CK2SFTPSession *)channel block:(void (^)(NSString *path, NSDictionary *attributes, NSUInteger depth, BOOL *stop))block rootFailed:(BOOL *)rootFailed;
+{
+    while (YES)
+    {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        
+        
+        // Take the next directory. Only once nothing is pending *and* nobody is listing, which could discover more, is the walk done
+        [_condition lock];
+        while (![_pendingDirectories count] && _activeDirectories && !_stopped)
+        {
+            [_condition wait];
+        }
+        
+        if (![_pendingDirectories count] || _stopped)
+        {
+            [_condition broadcast];
+            [_condition unlock];
+            [pool drain];
+            return;
+        }
+        
+        NSArray *next = [[_pendingDirectories objectAtIndex:0] retain];
+        [_pendingDirectories removeObjectAtIndex:0];
+        _activeDirectories++;
+        [_condition unlock];
+        
+        
+        NSString *directory = [next objectAtIndex:0];
+        NSUInteger depth = [[next objectAtIndex:1] unsignedIntegerValue] + 1;
+        NSString *canonicalDirectory = [next objectAtIndex:2];
+        NSMutableArray *subdirectories = [NSMutableArray array];
+        NSMutableArray *links = [NSMutableArray array];
+        
+        NSError *error;
+        BOOL listed = [channel enumerateContentsOfDirectoryAtPath:directory usingBlock:^(NSDictionary *attributes, BOOL *stop) {
+            
+            // Names which aren't UTF-8 can't be represented as a path, so are skipped, and reported at the end
+            NSString *filename = [attributes objectForKey:@"cxFilenameKey"];
+            if (!filename)
+            {
+                NSError *encodingError = [NSError errorWithDomain:NSCocoaErrorDomain
+                                                             code:NSFileReadInapplicableStringEncodingError
+                                                         userInfo:[NSDictionary dictionaryWithObjectsAndKeys:
+                                                                   @"An item's name isn't valid UTF-8, so it was skipped", NSLocalizedDescriptionKey,
+                                                                   directory, NSFilePathErrorKey,
+                                                                   nil]];
+                
+                [_condition lock];
+                if (!_error) _error = [encodingError retain];
+                [_condition unlock];
+                return;
+            }
+            
+            if ([self isExcluded:filename]) return;
+            
+            NSString *itemPath = [directory stringByAppendingPathComponent:filename];
+            
+            // Called outside the lock, so workers aren't held up by one another's calls, and the block is free to use the walker
+            BOOL stopWalk = NO;
+            if (!_stopped) block(itemPath, attributes, depth, &stopWalk);
+            if (stopWalk)
+            {
+                [_condition lock];
+                _stopped = YES;
+                [_condition broadcast];
+                [_condition unlock];
+            }
+            if (_stopped) *stop = YES;
+            
+            if (_maximumDepth && depth >= _maximumDepth) return;
+            
+            NSString *type = [attributes objectForKey:NSFileType];
+            if ([type isEqualToString:NSFileTypeDirectory])
+            {
+                [subdirectories addObject:[NSArray arrayWithObjects:
+                                           itemPath,
+                                           [NSNumber numberWithUnsignedInteger:depth],
+                                           [canonicalDirectory stringByAppendingPathComponent:filename],
+                                           nil]];
+            }
+            else if ([type isEqualToString:NSFileTypeSymbolicLink] && _symbolicLinkPolicy == CK2SFTPSymbolicLinkPolicyFollow)
+            {
+                [links addObject:itemPath];    // resolved once the listing is done, so as not to interrupt it
+            }
+        } error:&error];
+        
+        
+        // Only links need a trip to the server to find where they lead
+        for (NSString *aLink in links)
+        {
+            NSString *canonicalPath = [self canonicalDirectoryPathForPath:aLink channel:channel];
+            if (!canonicalPath) continue;   // not a directory, or broken link
+            
+            [subdirectories addObject:[NSArray arrayWithObjects:aLink, [NSNumber numberWithUnsignedInteger:depth], canonicalPath, nil]];
+        }
+        
+        
+        [_condition lock];
+        
+        if (!listed)
+        {
+            if (depth == 1) *rootFailed = YES;
+            if (!_error) _error = [error retain];
+        }
+        
+        // When following links, ensure each directory is only walked once
+        for (NSArray *anEntry in subdirectories)
+        {
+            if (_symbolicLinkPolicy == CK2SFTPSymbolicLinkPolicyFollow)
+            {
+                NSString *canonicalPath = [anEntry objectAtIndex:2];
+                if ([_visitedDirectories containsObject:canonicalPath]) continue;
+                [_visitedDirectories addObject:canonicalPath];
+            }
+            
+            [_pendingDirectories addObject:anEntry];
+        }
+        
+        _activeDirectories--;
+        [_condition broadcast];
+        [_condition unlock];
+        
+        [next release];
+        [pool drain];
+    }
+}
+
+- (BOOL)isExcluded:(NSString *)filename;
+{
+    const char *name = [filename UTF8String];
+    for (NSString *aPattern in _excludedPatterns)
+    {
+        if (fnmatch([aPattern UTF8String], name, 0) == 0) return YES;
+    }
+    
+    return NO;
+}
+
+// Returns nil if path doesn't lead to a directory
+- (NSString *)canonicalDirectoryPathForPath:(NSString *)path channel:(CK2SFTPSession *)channel;
+{
+    const char *pathChars = [path UTF8String];
+    
+    LIBSSH2_SFTP_ATTRIBUTES attributes;
+    int rc = CK2SFTPRetry(channel, libssh2_sftp_stat([channel libssh2_sftp], pathChars, &attributes));   // follows links
+    if (rc != LIBSSH2_ERROR_NONE || !LIBSSH2_SFTP_S_ISDIR(attributes.permissions)) return nil;
+    
+    char buffer[PATH_MAX];
+    int length = CK2SFTPRetry(channel, libssh2_sftp_realpath([channel libssh2_sftp], pathChars, buffer, sizeof(buffer)));
+    if (length < 0) return nil;
+    
+    return [[[NSString alloc] initWithBytes:buffer length:length encoding:NSUTF8StringEncoding] autorelease];
+}
+
+#pragma mark Options
+
+@synthesize maximumDepth = _maximumDepth;
+@synthesize excludedPatterns = _excludedPatterns;
+@synthesize symbolicLinkPolicy = _symbolicLinkPolicy;
+@synthesize maximumConcurrentDirectories = _maximumConcurrentDirectories;
+
+@end
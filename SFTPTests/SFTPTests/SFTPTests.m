@@ -0,0 +1,1887 @@
+//
+//  SFTPTests.m
+//  SFTPTests
+//
+//  Created by Karelia Software on 17/10/2026.
+//  Copyright © 2026 Karelia Software
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+//  Most of these run against a real server. Set CK2SFTPTestURL in the scheme's environment to a scratch directory on it, e.g. sftp://user@localhost/tmp, and CK2SFTPTestPassword if not authenticating through SSH-Agent. The host must already be in known_hosts
+//  The private key cache test also wants CK2SFTPTestPrivateKey, the path of an unencrypted key the server accepts
+//  Without CK2SFTPTestURL, those tests are reported as skipped rather than passed
+
+
+#import <XCTest/XCTest.h>
+
+#import "CK2SFTPSessionPool.h"
+#import "CK2SFTPTransferQueue.h"
+#import "CK2SFTPTreeWalker.h"
+#import "CK2SFTPFileHandle.h"
+#import "CK2SSHCredential.h"
+
+
+#define cxFilenameKey @"cxFilenameKey"   // as listings name their items
+
+
+// Stands in for the pool where a test needs to see what a session tells its delegate. Trusts only known hosts, and offers the one credential
+@interface SFTPTestsDelegate : NSObject <CK2SFTPSessionDelegate>
+{
+  @private
+    NSURLCredential             *_credential;
+    BOOL                        _initialized;
+    NSError                     *_error;
+    CK2SFTPConnectionTimings    *_recordedTimings;
+}
+
+- (id)initWithCredential:(NSURLCredential *)credential;
+
+@property(nonatomic, readonly) BOOL initialized;
+@property(nonatomic, readonly) NSError *error;
+@property(nonatomic, readonly) CK2SFTPConnectionTimings *recordedTimings;
+
+@end
+
+
+@implementation SFTPTestsDelegate
+
+- (id)initWithCredential:(NSURLCredential *)credential;
+{
+    if (self = [self init])
+    {
+        _credential = credential;
+    }
+    return self;
+}
+
+@synthesize initialized = _initialized;
+@synthesize error = _error;
+@synthesize recordedTimings = _recordedTimings;
+
+- (void)SFTPSessionDidInitialize:(CK2SFTPSession *)session;
+{
+    _initialized = YES;
+}
+
+- (void)SFTPSession:(CK2SFTPSession *)session didFailWithError:(NSError *)error;
+{
+    if (!_error) _error = error;
+}
+
+- (void)SFTPSession:(CK2SFTPSession *)session appendStringToTranscript:(NSString *)string received:(BOOL)received;
+{
+}
+
+- (void)SFTPSession:(CK2SFTPSession *)session didReceiveAuthenticationChallenge:(NSURLAuthenticationChallenge *)challenge;
+{
+    if ([CK2SFTPSession checkKnownHostsForFingerprintFromSession:session error:NULL] == LIBSSH2_KNOWNHOST_CHECK_MATCH &&
+        [challenge previousFailureCount] == 0)
+    {
+        [[challenge sender] useCredential:_credential forAuthenticationChallenge:challenge];
+    }
+    else
+    {
+        [[challenge sender] cancelAuthenticationChallenge:challenge];
+    }
+}
+
+- (void)SFTPSession:(CK2SFTPSession *)session didCancelAuthenticationChallenge:(NSURLAuthenticationChallenge *)challenge;
+{
+}
+
+- (void)SFTPSession:(CK2SFTPSession *)session didRecordConnectionTimings:(CK2SFTPConnectionTimings *)timings;
+{
+    _recordedTimings = timings;
+}
+
+@end
+
+
+
+@interface SFTPTests : XCTestCase
+{
+  @private
+    CK2SFTPSessionPool  *_pool;
+    NSURL               *_URL;
+    NSURLCredential     *_credential;
+    CK2SFTPSession      *_session;
+    NSString            *_directory;
+}
+@end
+
+
+@implementation SFTPTests
+
+- (void)setUp;
+{
+    [super setUp];
+    [self setContinueAfterFailure:NO];
+    
+    // A pool of its own, so limits and idle sessions don't leak between tests
+    _pool = [[CK2SFTPSessionPool alloc] init];
+}
+
+- (void)tearDown;
+{
+    if (_session)
+    {
+        [self removeItemAtPath:_directory];
+        [_pool checkInSession:_session];
+    }
+    
+    [_pool invalidate];
+    [super tearDown];
+}
+
+#pragma mark Helpers
+
+// Checks out a session, and makes a scratch directory for the test. Skips the test if there's no server to run it against
+- (void)connect;
+{
+    NSDictionary *environment = [[NSProcessInfo processInfo] environment];
+    NSString *URLString = [environment objectForKey:@"CK2SFTPTestURL"];
+    XCTSkipUnless(URLString != nil, @"Set CK2SFTPTestURL to run tests against a server");
+    
+    _URL = [NSURL URLWithString:URLString];
+    
+    NSString *password = [environment objectForKey:@"CK2SFTPTestPassword"];
+    if (password)
+    {
+        _credential = [NSURLCredential credentialWithUser:[_URL user] password:password persistence:NSURLCredentialPersistenceNone];
+    }
+    else
+    {
+        _credential = [NSURLCredential ck2_SSHAgentCredentialWithUser:[_URL user]];
+    }
+    
+    NSError *error;
+    _session = [_pool checkOutSessionWithURL:_URL credential:_credential error:&error];
+    XCTAssertNotNil(_session, @"%@", error);
+    
+    _directory = [[_URL path] stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+    XCTAssertTrue([_session createDirectoryAtPath:_directory mode:0755 error:&error], @"%@", error);
+}
+
+- (void)removeItemAtPath:(NSString *)path;
+{
+    if ([_session removeFileAtPath:path error:NULL]) return;
+    
+    // Must be a directory then, so empty it first
+    NSArray *contents = [_session contentsOfDirectoryAtPath:path error:NULL];
+    for (NSString *aName in contents)
+    {
+        [self removeItemAtPath:[path stringByAppendingPathComponent:aName]];
+    }
+    [_session removeDirectoryAtPath:path error:NULL];
+}
+
+- (NSString *)pathForName:(NSString *)name;
+{
+    return [_directory stringByAppendingPathComponent:name];
+}
+
+- (void)writeData:(NSData *)data toPath:(NSString *)path;
+{
+    NSError *error;
+    CK2SFTPFileHandle *handle = [_session openHandleAtPath:path
+                                                     flags:(LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC)
+                                                      mode:0644
+                                                     error:&error];
+    XCTAssertNotNil(handle, @"%@", error);
+    XCTAssertTrue([handle writeData:data error:&error], @"%@", error);
+    XCTAssertTrue([handle closeFile:&error], @"%@", error);
+}
+
+- (NSData *)dataAtPath:(NSString *)path;
+{
+    CK2SFTPFileHandle *handle = [_session openHandleAtPath:path flags:LIBSSH2_FXF_READ mode:0 error:NULL];
+    NSData *result = [handle readDataToEndOfFile:NULL];
+    [handle closeFile];
+    return result;
+}
+
+- (NSData *)randomDataOfLength:(NSUInteger)length;
+{
+    NSMutableData *result = [NSMutableData dataWithLength:length];
+    arc4random_buf([result mutableBytes], length);
+    return result;
+}
+
+- (NSURL *)temporaryFileURL;
+{
+    return [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]]];
+}
+
+// Runs the block on another thread, returning whether it finished within the timeout
+- (BOOL)runInBackground:(void (^)(void))block timeout:(NSTimeInterval)timeout;
+{
+    dispatch_semaphore_t finished = dispatch_semaphore_create(0);
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        block();
+        dispatch_semaphore_signal(finished);
+    });
+    return (dispatch_semaphore_wait(finished, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC))) == 0);
+}
+
+#pragma mark Pool
+
+- (void)testCheckOutWaitsForCheckInAtLimit;
+{
+    [self connect];
+    [_pool setMaximumSessionsPerHost:1];
+    
+    dispatch_semaphore_t checkedOut = dispatch_semaphore_create(0);
+    __block CK2SFTPSession *waiter = nil;
+    CK2SFTPSessionPool *pool = _pool;
+    NSURL *URL = _URL;
+    NSURLCredential *credential = _credential;
+    
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        waiter = [pool checkOutSessionWithURL:URL credential:credential error:NULL];
+        dispatch_semaphore_signal(checkedOut);
+    });
+    
+    // The only session allowed is ours, so the other thread has to wait
+    XCTAssertNotEqual(dispatch_semaphore_wait(checkedOut, dispatch_time(DISPATCH_TIME_NOW, NSEC_PER_SEC)), 0L);
+    
+    CK2SFTPSession *session = _session;
+    _session = nil;
+    [_pool checkInSession:session];
+    
+    // Checking in hands the same session over, rather than connecting another
+    XCTAssertEqual(dispatch_semaphore_wait(checkedOut, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0L);
+    XCTAssertEqual(waiter, session);
+    
+    _session = waiter;
+}
+
+- (void)testLimitIsSharedBetweenCredentials;
+{
+    [self connect];
+    [_pool setMaximumSessionsPerHost:1];
+    
+    dispatch_semaphore_t returned = dispatch_semaphore_create(0);
+    __block CK2SFTPSession *other = nil;
+    CK2SFTPSessionPool *pool = _pool;
+    NSURL *URL = _URL;
+    NSURLCredential *credential = [NSURLCredential credentialWithUser:[_URL user] password:@"not the password" persistence:NSURLCredentialPersistenceNone];
+    
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        other = [pool checkOutSessionWithURL:URL credential:credential error:NULL];
+        dispatch_semaphore_signal(returned);
+    });
+    
+    // A different credential for the same user and host still counts against the limit
+    XCTAssertNotEqual(dispatch_semaphore_wait(returned, dispatch_time(DISPATCH_TIME_NOW, NSEC_PER_SEC)), 0L);
+    
+    // Once ours is idle, it makes way for the other credential, which is then turned down by the server
+    CK2SFTPSession *session = _session;
+    _session = nil;
+    [_pool checkInSession:session];
+    
+    XCTAssertEqual(dispatch_semaphore_wait(returned, dispatch_time(DISPATCH_TIME_NOW, 30 * NSEC_PER_SEC)), 0L);
+    XCTAssertNil(other);
+    
+    // Its failed attempt doesn't use up the slot
+    __block CK2SFTPSession *again = nil;
+    NSURLCredential *original = _credential;
+    XCTAssertTrue([self runInBackground:^{
+        again = [pool checkOutSessionWithURL:URL credential:original error:NULL];
+    } timeout:30.0]);
+    XCTAssertNotNil(again);
+    
+    _session = again;
+}
+
+- (void)testInvalidatedPoolIsDeallocated;
+{
+    __weak CK2SFTPSessionPool *weakPool;
+    @autoreleasepool
+    {
+        CK2SFTPSessionPool *pool = [[CK2SFTPSessionPool alloc] init];
+        weakPool = pool;
+        [pool invalidate];
+    }
+    
+    // The timer lets go of the pool once its cancellation has been processed
+    NSDate *limit = [NSDate dateWithTimeIntervalSinceNow:5.0];
+    while (weakPool && [limit timeIntervalSinceNow] > 0) [NSThread sleepForTimeInterval:0.01];
+    XCTAssertNil(weakPool);
+}
+
+#pragma mark Reading
+
+- (void)testReadWindowDefaultsAndClamps;
+{
+    [self connect];
+    [self writeData:[NSData data] toPath:[self pathForName:@"empty"]];
+    
+    CK2SFTPFileHandle *handle = [_session openHandleAtPath:[self pathForName:@"empty"] flags:LIBSSH2_FXF_READ mode:0 error:NULL];
+    XCTAssertEqual([handle readWindow], (NSUInteger)CK2SFTPDefaultReadWindow);
+    
+    // At least one request has to be in flight to make progress
+    [handle setReadWindow:0];
+    XCTAssertEqual([handle readWindow], (NSUInteger)1);
+    [handle closeFile];
+}
+
+- (void)testPipelinedReadsMatchWhateverTheWindow;
+{
+    [self connect];
+    
+    // Not a whole number of chunks or windows, so the last request of each is short
+    NSData *data = [self randomDataOfLength:3 * CK2SFTPBufferLength + 12345];
+    NSString *path = [self pathForName:@"read"];
+    [self writeData:data toPath:path];
+    
+    for (NSUInteger window = 1; window <= 4 * CK2SFTPDefaultReadWindow; window *= 4)
+    {
+        NSError *error;
+        CK2SFTPFileHandle *handle = [_session openHandleAtPath:path flags:LIBSSH2_FXF_READ mode:0 error:&error];
+        XCTAssertNotNil(handle, @"%@", error);
+        [handle setReadWindow:window];
+        
+        NSData *read = [handle readDataToEndOfFile:&error];
+        XCTAssertEqualObjects(read, data, @"window of %lu", (unsigned long)window);
+        XCTAssertTrue([handle closeFile:&error], @"%@", error);
+    }
+}
+
+- (void)testReadOfLengthIsShortOnlyAtEndOfFile;
+{
+    [self connect];
+    
+    NSData *data = [self randomDataOfLength:2 * CK2SFTPBufferLength];
+    NSString *path = [self pathForName:@"read"];
+    [self writeData:data toPath:path];
+    
+    NSError *error;
+    CK2SFTPFileHandle *handle = [_session openHandleAtPath:path flags:LIBSSH2_FXF_READ mode:0 error:&error];
+    XCTAssertNotNil(handle, @"%@", error);
+    
+    // Asking for more than a window's worth still gets it all, not just what the first batch of requests returned
+    NSUInteger first = CK2SFTPBufferLength + CK2SFTPPreferredChunkSize + 1;
+    NSData *read = [handle readDataOfLength:first error:&error];
+    XCTAssertEqualObjects(read, [data subdataWithRange:NSMakeRange(0, first)]);
+    
+    read = [handle readDataOfLength:[data length] error:&error];
+    XCTAssertEqualObjects(read, [data subdataWithRange:NSMakeRange(first, [data length] - first)]);
+    
+    read = [handle readDataOfLength:1 error:&error];
+    XCTAssertNotNil(read, @"%@", error);
+    XCTAssertEqual([read length], (NSUInteger)0);
+    
+    XCTAssertTrue([handle closeFile:&error], @"%@", error);
+}
+
+#pragma mark Writing
+
+- (void)testPipelinedWritesArriveInOrder;
+{
+    [self connect];
+    
+    NSString *path = [self pathForName:@"write"];
+    NSError *error;
+    CK2SFTPFileHandle *handle = [_session openHandleAtPath:path flags:(LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC) mode:0644 error:&error];
+    XCTAssertNotNil(handle, @"%@", error);
+    [handle setMaximumWriteBytesInFlight:CK2SFTPBufferLength];
+    
+    // Pieces both smaller and larger than a chunk, so they're coalesced as well as split
+    NSMutableData *expected = [NSMutableData data];
+    for (NSUInteger i = 0; i < 200; i++)
+    {
+        NSData *piece = [self randomDataOfLength:(1 + arc4random_uniform(2 * CK2SFTPPreferredChunkSize))];
+        XCTAssertTrue([handle writeData:piece error:&error], @"%@", error);
+        [expected appendData:piece];
+    }
+    
+    XCTAssertTrue([handle closeFile:&error], @"%@", error);
+    XCTAssertEqualObjects([self dataAtPath:path], expected);
+}
+
+- (void)testQueuedWritesAreSentBeforeReading;
+{
+    [self connect];
+    
+    NSString *path = [self pathForName:@"write"];
+    NSError *error;
+    CK2SFTPFileHandle *handle = [_session openHandleAtPath:path flags:(LIBSSH2_FXF_READ | LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC) mode:0644 error:&error];
+    XCTAssertNotNil(handle, @"%@", error);
+    [handle setMaximumWriteBytesInFlight:CK2SFTPBufferLength];
+    
+    NSData *data = [self randomDataOfLength:CK2SFTPPreferredChunkSize / 2];
+    XCTAssertTrue([handle writeData:data error:&error], @"%@", error);
+    
+    XCTAssertTrue([handle seekToFileOffset:0 error:&error], @"%@", error);
+    XCTAssertEqualObjects([handle readDataToEndOfFile:&error], data);
+    XCTAssertTrue([handle closeFile:&error], @"%@", error);
+}
+
+- (void)testSynchronizeFileSendsQueuedWrites;
+{
+    [self connect];
+    
+    NSString *path = [self pathForName:@"write"];
+    NSError *error;
+    CK2SFTPFileHandle *handle = [_session openHandleAtPath:path flags:(LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC) mode:0644 error:&error];
+    XCTAssertNotNil(handle, @"%@", error);
+    [handle setMaximumWriteBytesInFlight:CK2SFTPBufferLength];
+    
+    NSData *data = [self randomDataOfLength:CK2SFTPPreferredChunkSize / 2];
+    XCTAssertTrue([handle writeData:data error:&error], @"%@", error);
+    
+    // Servers without fsync@openssh.com aren't an error
+    XCTAssertTrue([handle synchronizeFile:&error], @"%@", error);
+    XCTAssertEqualObjects([self dataAtPath:path], data);
+    
+    XCTAssertTrue([handle closeFile:&error], @"%@", error);
+}
+
+#pragma mark Timeouts
+
+- (void)testStalledCallTimesOutAndCancelsPromptly;
+{
+    [self connect];
+    
+    NSString *path = [self pathForName:@"large"];
+    [self writeData:[self randomDataOfLength:8 * CK2SFTPBufferLength] toPath:path];
+    
+    // A session of its own, since it's no use after timing out part way through a read
+    NSError *error;
+    CK2SFTPSession *session = [_pool checkOutSessionWithURL:_URL credential:_credential error:&error];
+    XCTAssertNotNil(session, @"%@", error);
+    
+    CK2SFTPFileHandle *handle = [session openHandleAtPath:path flags:LIBSSH2_FXF_READ mode:0 error:&error];
+    XCTAssertNotNil(handle, @"%@", error);
+    
+    // Far too short for the server to answer within, however fast
+    [session setTimeout:0.000001];
+    NSData *data = [handle readDataToEndOfFile:&error];
+    XCTAssertNil(data);
+    XCTAssertEqualObjects([error domain], NSURLErrorDomain);
+    XCTAssertEqual([error code], (NSInteger)NSURLErrorTimedOut);
+    
+    // Tearing down doesn't wait out the timeout on each step
+    [session setTimeout:60.0];
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    [handle closeFile];
+    [session cancel];
+    XCTAssertLessThan(CFAbsoluteTimeGetCurrent() - start, 20.0);
+    
+    [_pool checkInSession:session];
+}
+
+#pragma mark Transfer Queue
+
+- (void)testTransferQueueRoundTripsLargeAndSmallFiles;
+{
+    [self connect];
+    
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSMutableArray *localURLs = [NSMutableArray array];
+    NSMutableArray *contents = [NSMutableArray array];
+    
+    CK2SFTPTransferQueue *uploads = [[CK2SFTPTransferQueue alloc] initWithURL:_URL credential:_credential pool:_pool];
+    [uploads setLargeFileThreshold:CK2SFTPBufferLength];
+    
+    unsigned long long total = 0;
+    for (NSUInteger i = 0; i < 12; i++)
+    {
+        // A couple of large files, with the rest small enough to be batched
+        NSData *data = [self randomDataOfLength:(i < 2 ? 3 * CK2SFTPBufferLength : arc4random_uniform(CK2SFTPPreferredChunkSize))];
+        NSURL *URL = [self temporaryFileURL];
+        XCTAssertTrue([data writeToURL:URL atomically:NO]);
+        
+        [localURLs addObject:URL];
+        [contents addObject:data];
+        total += [data length];
+        
+        [uploads addUploadOfItemAtURL:URL toPath:[self pathForName:[NSString stringWithFormat:@"%lu", (unsigned long)i]] mode:0644];
+    }
+    
+    __block unsigned long long reportedCompleted = 0, reportedTotal = 0;
+    [uploads setProgressHandler:^(unsigned long long completedBytes, unsigned long long totalBytes) {
+        XCTAssertGreaterThanOrEqual(completedBytes, reportedCompleted);
+        reportedCompleted = completedBytes;
+        reportedTotal = totalBytes;
+    }];
+    
+    NSError *error;
+    XCTAssertTrue([uploads transferAndWaitUntilFinished:&error], @"%@", error);
+    XCTAssertEqual(reportedCompleted, total);
+    XCTAssertEqual(reportedTotal, total);
+    
+    
+    CK2SFTPTransferQueue *downloads = [[CK2SFTPTransferQueue alloc] initWithURL:_URL credential:_credential pool:_pool];
+    [downloads setLargeFileThreshold:CK2SFTPBufferLength];
+    
+    NSMutableArray *downloadedURLs = [NSMutableArray array];
+    for (NSUInteger i = 0; i < [contents count]; i++)
+    {
+        NSURL *URL = [self temporaryFileURL];
+        [downloadedURLs addObject:URL];
+        [downloads addDownloadOfItemAtPath:[self pathForName:[NSString stringWithFormat:@"%lu", (unsigned long)i]]
+                                      size:[[contents objectAtIndex:i] length]
+                                     toURL:URL];
+    }
+    
+    XCTAssertTrue([downloads transferAndWaitUntilFinished:&error], @"%@", error);
+    
+    for (NSUInteger i = 0; i < [contents count]; i++)
+    {
+        XCTAssertEqualObjects([NSData dataWithContentsOfURL:[downloadedURLs objectAtIndex:i]], [contents objectAtIndex:i]);
+        [fileManager removeItemAtURL:[downloadedURLs objectAtIndex:i] error:NULL];
+        [fileManager removeItemAtURL:[localURLs objectAtIndex:i] error:NULL];
+    }
+}
+
+- (void)testTransferQueueReportsFailureAndCarriesOn;
+{
+    [self connect];
+    
+    NSData *data = [self randomDataOfLength:1000];
+    NSURL *URL = [self temporaryFileURL];
+    XCTAssertTrue([data writeToURL:URL atomically:NO]);
+    
+    CK2SFTPTransferQueue *queue = [[CK2SFTPTransferQueue alloc] initWithURL:_URL credential:_credential pool:_pool];
+    [queue addUploadOfItemAtURL:URL toPath:[self pathForName:@"missing/file"] mode:0644];
+    [queue addUploadOfItemAtURL:URL toPath:[self pathForName:@"file"] mode:0644];
+    
+    NSError *error;
+    XCTAssertFalse([queue transferAndWaitUntilFinished:&error]);
+    XCTAssertNotNil(error);
+    
+    // The other upload still happened
+    XCTAssertEqualObjects([self dataAtPath:[self pathForName:@"file"]], data);
+    
+    [[NSFileManager defaultManager] removeItemAtURL:URL error:NULL];
+}
+
+#pragma mark Channels
+
+- (void)testChannelsTransferConcurrently;
+{
+    [self connect];
+    
+    NSMutableArray *channels = [NSMutableArray array];
+    NSMutableArray *contents = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 4; i++)
+    {
+        NSError *error;
+        CK2SFTPSession *channel = [_session openSFTPChannel:&error];
+        XCTAssertNotNil(channel, @"%@", error);
+        [channels addObject:channel];
+        [contents addObject:[self randomDataOfLength:2 * CK2SFTPBufferLength + i]];
+    }
+    
+    // Each channel writes and reads back its own file, all interleaved over the one connection
+    NSMutableArray *results = [NSMutableArray arrayWithCapacity:[channels count]];
+    for (NSUInteger i = 0; i < [channels count]; i++) [results addObject:[NSNull null]];
+    NSString *directory = _directory;
+    
+    dispatch_apply([channels count], dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        CK2SFTPSession *channel = [channels objectAtIndex:i];
+        NSString *path = [directory stringByAppendingPathComponent:[NSString stringWithFormat:@"channel%zu", i]];
+        
+        CK2SFTPFileHandle *handle = [channel openHandleAtPath:path flags:(LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC) mode:0644 error:NULL];
+        BOOL written = [handle writeData:[contents objectAtIndex:i] error:NULL];
+        written = [handle closeFile:NULL] && written;
+        
+        handle = [channel openHandleAtPath:path flags:LIBSSH2_FXF_READ mode:0 error:NULL];
+        NSData *read = (written ? [handle readDataToEndOfFile:NULL] : nil);
+        [handle closeFile];
+        
+        @synchronized(results)
+        {
+            if (read) [results replaceObjectAtIndex:i withObject:read];
+        }
+    });
+    
+    XCTAssertEqualObjects(results, contents);
+}
+
+- (void)testCancellingSessionCancelsItsChannels;
+{
+    [self connect];
+    
+    NSError *error;
+    CK2SFTPSession *session = [_pool checkOutSessionWithURL:_URL credential:_credential error:&error];
+    XCTAssertNotNil(session, @"%@", error);
+    
+    CK2SFTPSession *channel = [session openSFTPChannel:&error];
+    XCTAssertNotNil(channel, @"%@", error);
+    XCTAssertNotNil([channel attributesOfItemAtPath:_directory error:&error], @"%@", error);
+    
+    [session cancel];
+    XCTAssertTrue([channel libssh2_sftp] == NULL);
+    XCTAssertTrue([channel libssh2_session] == NULL);
+    
+    // And the channel can be cancelled again without harm
+    [channel cancel];
+    [_pool checkInSession:session];
+}
+
+#pragma mark Enumeration
+
+- (void)createFilesNamed:(NSArray *)names;
+{
+    for (NSString *aName in names)
+    {
+        [self writeData:[aName dataUsingEncoding:NSUTF8StringEncoding] toPath:[self pathForName:aName]];
+    }
+}
+
+- (NSArray *)fileNamesWithCount:(NSUInteger)count;
+{
+    NSMutableArray *result = [NSMutableArray arrayWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) [result addObject:[NSString stringWithFormat:@"file%lu", (unsigned long)i]];
+    return result;
+}
+
+- (void)testEnumerationSeesEachItemOnce;
+{
+    [self connect];
+    
+    // More than fit in one SSH_FXP_NAME reply
+    NSArray *names = [self fileNamesWithCount:300];
+    [self createFilesNamed:names];
+    
+    NSMutableArray *enumerated = [NSMutableArray array];
+    NSError *error;
+    XCTAssertTrue([_session enumerateContentsOfDirectoryAtPath:_directory usingBlock:^(NSDictionary *attributes, BOOL *stop) {
+        [enumerated addObject:[attributes objectForKey:cxFilenameKey]];
+    } error:&error], @"%@", error);
+    
+    // . and .. aren't included
+    XCTAssertEqualObjects([enumerated sortedArrayUsingSelector:@selector(compare:)], [names sortedArrayUsingSelector:@selector(compare:)]);
+    
+    __block NSUInteger entries = 0;
+    XCTAssertTrue([_session enumerateEntriesOfDirectoryAtPath:_directory usingBlock:^(const char *filename, size_t length, const LIBSSH2_SFTP_ATTRIBUTES *attributes, BOOL *stop) {
+        entries++;
+    } error:&error], @"%@", error);
+    XCTAssertEqual(entries, [names count]);
+}
+
+- (void)testEnumerationStopsWhenAsked;
+{
+    [self connect];
+    [self createFilesNamed:[self fileNamesWithCount:10]];
+    
+    __block NSUInteger count = 0;
+    NSError *error;
+    XCTAssertTrue([_session enumerateContentsOfDirectoryAtPath:_directory usingBlock:^(NSDictionary *attributes, BOOL *stop) {
+        if (++count == 3) *stop = YES;
+    } error:&error], @"%@", error);
+    XCTAssertEqual(count, (NSUInteger)3);
+}
+
+- (void)testEnumeratingMissingDirectoryFails;
+{
+    [self connect];
+    
+    NSError *error;
+    XCTAssertFalse([_session enumerateContentsOfDirectoryAtPath:[self pathForName:@"missing"] usingBlock:^(NSDictionary *attributes, BOOL *stop) {
+        XCTFail(@"Nothing to enumerate");
+    } error:&error]);
+    XCTAssertNotNil(error);
+}
+
+#pragma mark Listing Attributes
+
+- (void)testAttributesConvertOnlyWhatServerSupplied;
+{
+    LIBSSH2_SFTP_ATTRIBUTES attributes = {0};
+    attributes.flags = LIBSSH2_SFTP_ATTR_PERMISSIONS | LIBSSH2_SFTP_ATTR_SIZE;
+    attributes.permissions = LIBSSH2_SFTP_S_IFREG | 0640;
+    attributes.filesize = 1234;
+    attributes.uid = 501;
+    attributes.mtime = 1000000000;
+    
+    NSDictionary *result = [CK2SFTPSession attributesWithFilename:@"name" SFTPAttributes:&attributes];
+    XCTAssertEqualObjects([result objectForKey:cxFilenameKey], @"name");
+    XCTAssertEqualObjects([result objectForKey:NSFileType], NSFileTypeRegular);
+    XCTAssertEqualObjects([result objectForKey:NSFilePosixPermissions], [NSNumber numberWithUnsignedLong:0640]);
+    XCTAssertEqualObjects([result objectForKey:NSFileSize], [NSNumber numberWithUnsignedLongLong:1234]);
+    
+    // Not flagged, so not there, whatever the struct happens to hold
+    XCTAssertNil([result objectForKey:NSFileOwnerAccountID]);
+    XCTAssertNil([result objectForKey:NSFileModificationDate]);
+    
+    attributes.flags = LIBSSH2_SFTP_ATTR_ACMODTIME;
+    result = [CK2SFTPSession attributesWithFilename:nil SFTPAttributes:&attributes];
+    XCTAssertNil([result objectForKey:cxFilenameKey]);
+    XCTAssertEqualObjects([result objectForKey:NSFileType], NSFileTypeUnknown);
+    XCTAssertEqualObjects([result objectForKey:NSFileModificationDate], [NSDate dateWithTimeIntervalSince1970:1000000000]);
+}
+
+- (void)testListingAttributesMatchStat;
+{
+    [self connect];
+    
+    NSError *error;
+    [self writeData:[self randomDataOfLength:4321] toPath:[self pathForName:@"file"]];
+    XCTAssertTrue([_session createDirectoryAtPath:[self pathForName:@"directory"] mode:0755 error:&error], @"%@", error);
+    
+    NSArray *listing = [_session attributesOfContentsOfDirectoryAtPath:_directory error:&error];
+    XCTAssertEqual([listing count], (NSUInteger)2, @"%@", error);
+    
+    for (NSDictionary *listed in listing)
+    {
+        NSString *name = [listed objectForKey:cxFilenameKey];
+        NSDictionary *stat = [_session attributesOfItemAtPath:[self pathForName:name] error:&error];
+        XCTAssertNotNil(stat, @"%@", error);
+        
+        for (NSString *aKey in [NSArray arrayWithObjects:NSFileType, NSFileSize, NSFilePosixPermissions, NSFileModificationDate, NSFileOwnerAccountID, nil])
+        {
+            XCTAssertEqualObjects([listed objectForKey:aKey], [stat objectForKey:aKey], @"%@ of %@", aKey, name);
+        }
+        
+        NSString *expectedType = ([name isEqualToString:@"file"] ? NSFileTypeRegular : NSFileTypeDirectory);
+        XCTAssertEqualObjects([listed objectForKey:NSFileType], expectedType);
+    }
+    
+    NSArray *names = [[listing valueForKey:cxFilenameKey] sortedArrayUsingSelector:@selector(compare:)];
+    XCTAssertEqualObjects(names, ([NSArray arrayWithObjects:@"directory", @"file", nil]));
+}
+
+#pragma mark Tree Walker
+
+// Makes a/1, a/b/2, a/b/c/3 and d/4 in the scratch directory. Returns the relative path of each item, mapped to its depth
+- (NSDictionary *)createTree;
+{
+    NSError *error;
+    XCTAssertTrue([_session createDirectoryAtPath:[self pathForName:@"a/b/c"] withIntermediateDirectories:YES mode:0755 error:&error], @"%@", error);
+    XCTAssertTrue([_session createDirectoryAtPath:[self pathForName:@"d"] mode:0755 error:&error], @"%@", error);
+    
+    NSArray *files = [NSArray arrayWithObjects:@"a/1", @"a/b/2", @"a/b/c/3", @"d/4", nil];
+    for (NSString *aPath in files)
+    {
+        [self writeData:[aPath dataUsingEncoding:NSUTF8StringEncoding] toPath:[self pathForName:aPath]];
+    }
+    
+    NSMutableDictionary *result = [NSMutableDictionary dictionary];
+    for (NSString *aPath in [files arrayByAddingObjectsFromArray:[NSArray arrayWithObjects:@"a", @"a/b", @"a/b/c", @"d", nil]])
+    {
+        [result setObject:[NSNumber numberWithUnsignedInteger:[[aPath pathComponents] count]] forKey:aPath];
+    }
+    return result;
+}
+
+- (NSDictionary *)walkWithWalker:(CK2SFTPTreeWalker *)walker;
+{
+    NSMutableDictionary *result = [NSMutableDictionary dictionary];
+    NSString *prefix = [_directory stringByAppendingString:@"/"];
+    
+    NSError *error;
+    XCTAssertTrue([walker walkDirectoryAtPath:_directory usingBlock:^(NSString *path, NSDictionary *attributes, NSUInteger depth, BOOL *stop) {
+        @synchronized(result)
+        {
+            XCTAssertNil([result objectForKey:path], @"%@ visited twice", path);
+            [result setObject:[NSNumber numberWithUnsignedInteger:depth] forKey:[path substringFromIndex:[prefix length]]];
+        }
+    } error:&error], @"%@", error);
+    
+    return result;
+}
+
+- (void)testTreeWalkerVisitsEverything;
+{
+    [self connect];
+    NSDictionary *tree = [self createTree];
+    
+    CK2SFTPTreeWalker *walker = [[CK2SFTPTreeWalker alloc] initWithSession:_session];
+    XCTAssertEqualObjects([self walkWithWalker:walker], tree);
+}
+
+- (void)testTreeWalkerLimitsDepthAndExcludes;
+{
+    [self connect];
+    NSDictionary *tree = [self createTree];
+    
+    CK2SFTPTreeWalker *walker = [[CK2SFTPTreeWalker alloc] initWithSession:_session];
+    [walker setMaximumDepth:2];
+    [walker setExcludedPatterns:[NSArray arrayWithObject:@"d*"]];
+    
+    // d is excluded outright, so nothing inside it is seen either
+    NSMutableDictionary *expected = [NSMutableDictionary dictionary];
+    [tree enumerateKeysAndObjectsUsingBlock:^(NSString *path, NSNumber *depth, BOOL *stop) {
+        if ([depth unsignedIntegerValue] <= 2 && ![path hasPrefix:@"d"]) [expected setObject:depth forKey:path];
+    }];
+    
+    XCTAssertEqualObjects([self walkWithWalker:walker], expected);
+}
+
+- (void)testTreeWalkerStopsWhenAsked;
+{
+    [self connect];
+    [self createTree];
+    
+    CK2SFTPTreeWalker *walker = [[CK2SFTPTreeWalker alloc] initWithSession:_session];
+    [walker setMaximumConcurrentDirectories:1];
+    
+    __block NSUInteger count = 0;
+    NSError *error;
+    XCTAssertTrue([walker walkDirectoryAtPath:_directory usingBlock:^(NSString *path, NSDictionary *attributes, NSUInteger depth, BOOL *stop) {
+        count++;
+        *stop = YES;
+    } error:&error], @"%@", error);
+    
+    // With a single channel, there's no other listing underway to finish off
+    XCTAssertEqual(count, (NSUInteger)1);
+}
+
+- (void)testTreeWalkerReportsMissingRoot;
+{
+    [self connect];
+    
+    CK2SFTPTreeWalker *walker = [[CK2SFTPTreeWalker alloc] initWithSession:_session];
+    NSError *error;
+    XCTAssertFalse([walker walkDirectoryAtPath:[self pathForName:@"missing"] usingBlock:^(NSString *path, NSDictionary *attributes, NSUInteger depth, BOOL *stop) {
+        XCTFail(@"Nothing to walk");
+    } error:&error]);
+    XCTAssertNotNil(error);
+}
+
+#pragma mark Metadata Cache
+
+// Another connection altogether, whose changes the receiver's cache can't know about
+- (CK2SFTPSession *)checkOutOtherSession;
+{
+    NSError *error;
+    CK2SFTPSession *result = [_pool checkOutSessionWithURL:_URL credential:_credential error:&error];
+    XCTAssertNotNil(result, @"%@", error);
+    return result;
+}
+
+- (unsigned long long)sizeOfItemAtPath:(NSString *)path;
+{
+    return [[[_session attributesOfItemAtPath:path error:NULL] objectForKey:NSFileSize] unsignedLongLongValue];
+}
+
+- (void)testCachedAttributesLastUntilInvalidated;
+{
+    [self connect];
+    [_session setMetadataCacheTimeout:60.0];
+    
+    NSString *path = [self pathForName:@"file"];
+    [self writeData:[self randomDataOfLength:10] toPath:path];
+    XCTAssertEqual([self sizeOfItemAtPath:path], 10ULL);
+    
+    CK2SFTPSession *other = [self checkOutOtherSession];
+    CK2SFTPFileHandle *handle = [other openHandleAtPath:path flags:(LIBSSH2_FXF_WRITE | LIBSSH2_FXF_APPEND) mode:0 error:NULL];
+    [handle seekToEndOfFile];
+    XCTAssertTrue([handle writeData:[self randomDataOfLength:10] error:NULL]);
+    [handle closeFile];
+    [_pool checkInSession:other];
+    
+    // Still remembered
+    XCTAssertEqual([self sizeOfItemAtPath:path], 10ULL);
+    
+    [_session invalidateCachedMetadataForPath:_directory];
+    XCTAssertEqual([self sizeOfItemAtPath:path], 20ULL);
+}
+
+- (void)testNothingIsCachedByDefault;
+{
+    [self connect];
+    XCTAssertEqual([_session metadataCacheTimeout], 0.0);
+    
+    NSString *path = [self pathForName:@"file"];
+    [self writeData:[self randomDataOfLength:10] toPath:path];
+    XCTAssertEqual([self sizeOfItemAtPath:path], 10ULL);
+    
+    CK2SFTPSession *other = [self checkOutOtherSession];
+    XCTAssertTrue([other removeFileAtPath:path error:NULL]);
+    [_pool checkInSession:other];
+    
+    XCTAssertNil([_session attributesOfItemAtPath:path error:NULL]);
+}
+
+- (void)testOwnChangesInvalidateCache;
+{
+    [self connect];
+    [_session setMetadataCacheTimeout:60.0];
+    
+    NSString *path = [self pathForName:@"file"];
+    [self writeData:[self randomDataOfLength:10] toPath:path];
+    XCTAssertEqualObjects([_session contentsOfDirectoryAtPath:_directory error:NULL], [NSArray arrayWithObject:@"file"]);
+    XCTAssertNotNil([_session attributesOfItemAtPath:path error:NULL]);
+    
+    // Through a channel, which shares the cache
+    NSError *error;
+    CK2SFTPSession *channel = [_session openSFTPChannel:&error];
+    XCTAssertNotNil(channel, @"%@", error);
+    XCTAssertTrue([channel moveItemAtPath:path toPath:[self pathForName:@"moved"] error:&error], @"%@", error);
+    [channel cancel];
+    
+    XCTAssertNil([_session attributesOfItemAtPath:path error:NULL]);
+    XCTAssertEqualObjects([_session contentsOfDirectoryAtPath:_directory error:NULL], [NSArray arrayWithObject:@"moved"]);
+}
+
+- (void)testListedAttributesMatchStatWhenCached;
+{
+    [self connect];
+    
+    NSString *path = [self pathForName:@"file"];
+    [self writeData:[self randomDataOfLength:10] toPath:path];
+    NSDictionary *uncached = [_session attributesOfItemAtPath:path error:NULL];
+    XCTAssertNotNil(uncached);
+    
+    // Whether the attributes come from a stat or a listing shouldn't show
+    [_session setMetadataCacheTimeout:60.0];
+    XCTAssertNotNil([_session attributesOfContentsOfDirectoryAtPath:_directory error:NULL]);
+    XCTAssertEqualObjects([_session attributesOfItemAtPath:path error:NULL], uncached);
+}
+
+#pragma mark Creating Directories
+
+- (BOOL)isDirectoryAtPath:(NSString *)path;
+{
+    return [[[_session attributesOfItemAtPath:path error:NULL] fileType] isEqualToString:NSFileTypeDirectory];
+}
+
+- (void)testCreatesMissingIntermediates;
+{
+    [self connect];
+    
+    NSError *error;
+    XCTAssertTrue([_session createDirectoryAtPath:[self pathForName:@"a"] mode:0755 error:&error], @"%@", error);
+    
+    // Some ancestors exist, some don't
+    XCTAssertTrue([_session createDirectoryAtPath:[self pathForName:@"a/b/c/d/e"] withIntermediateDirectories:YES mode:0750 error:&error], @"%@", error);
+    
+    for (NSString *aPath in [NSArray arrayWithObjects:@"a/b", @"a/b/c", @"a/b/c/d", @"a/b/c/d/e", nil])
+    {
+        NSDictionary *attributes = [_session attributesOfItemAtPath:[self pathForName:aPath] error:&error];
+        XCTAssertEqualObjects([attributes fileType], NSFileTypeDirectory, @"%@", aPath);
+        XCTAssertEqual([attributes filePosixPermissions], (NSUInteger)0750, @"%@", aPath);
+    }
+}
+
+- (void)testCreatingExistingDirectorySucceedsQuietly;
+{
+    [self connect];
+    
+    NSString *path = [self pathForName:@"existing"];
+    NSError *error;
+    XCTAssertTrue([_session createDirectoryAtPath:path mode:0700 error:&error], @"%@", error);
+    
+    // Left as it was, and no error handed back for a call that succeeded
+    NSError *untouched = [NSError errorWithDomain:@"untouched" code:0 userInfo:nil];
+    error = untouched;
+    XCTAssertTrue([_session createDirectoryAtPath:path withIntermediateDirectories:YES mode:0755 error:&error]);
+    XCTAssertEqual(error, untouched);
+    XCTAssertEqual([[_session attributesOfItemAtPath:path error:NULL] filePosixPermissions], (NSUInteger)0700);
+    
+    // Whereas without intermediates, it's an error as before
+    XCTAssertFalse([_session createDirectoryAtPath:path withIntermediateDirectories:NO mode:0755 error:&error]);
+}
+
+- (void)testCreatingBeneathFileFails;
+{
+    [self connect];
+    
+    [self writeData:[NSData data] toPath:[self pathForName:@"file"]];
+    
+    NSError *error = nil;
+    XCTAssertFalse([_session createDirectoryAtPath:[self pathForName:@"file/a/b"] withIntermediateDirectories:YES mode:0755 error:&error]);
+    XCTAssertNotNil(error);
+    XCTAssertFalse([self isDirectoryAtPath:[self pathForName:@"file/a"]]);
+    
+    // Nor can a file be replaced by a directory
+    error = nil;
+    XCTAssertFalse([_session createDirectoryAtPath:[self pathForName:@"file"] withIntermediateDirectories:YES mode:0755 error:&error]);
+    XCTAssertNotNil(error);
+}
+
+#pragma mark Learning Mode Handling
+
+- (void)testLearnsWhetherMkdirModeIsHonoured;
+{
+    [self connect];
+    [_session removeLearntServerCapabilities];
+    XCTAssertNil([[_session serverCapabilities] objectForKey:CK2SFTPCapabilityHonoursMkdirMode]);
+    
+    // Group write is what a typical umask strips, so the outcome is conclusive either way
+    NSError *error;
+    XCTAssertTrue([_session createDirectoryAtPath:[self pathForName:@"a/b"] withIntermediateDirectories:YES mode:0775 error:&error], @"%@", error);
+    XCTAssertNotNil([[_session serverCapabilities] objectForKey:CK2SFTPCapabilityHonoursMkdirMode]);
+    
+    // And whatever was learnt, the directories come out as asked, now and once it's known
+    XCTAssertTrue([_session createDirectoryAtPath:[self pathForName:@"c/d"] withIntermediateDirectories:YES mode:0775 error:&error], @"%@", error);
+    for (NSString *aPath in [NSArray arrayWithObjects:@"a", @"a/b", @"c", @"c/d", nil])
+    {
+        XCTAssertEqual([[_session attributesOfItemAtPath:[self pathForName:aPath] error:NULL] filePosixPermissions], (NSUInteger)0775, @"%@", aPath);
+    }
+}
+
+- (void)testLearnsWhetherOpenModeIsHonoured;
+{
+    [self connect];
+    [_session removeLearntServerCapabilities];
+    
+    NSString *path = [self pathForName:@"file"];
+    NSError *error;
+    CK2SFTPFileHandle *handle = [_session openHandleAtPath:path flags:(LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_EXCL) mode:0664 error:&error];
+    XCTAssertNotNil(handle, @"%@", error);
+    [handle closeFile];
+    
+    XCTAssertNotNil([[_session serverCapabilities] objectForKey:CK2SFTPCapabilityHonoursOpenMode]);
+    XCTAssertEqual([[_session attributesOfItemAtPath:path error:NULL] filePosixPermissions], (NSUInteger)0664);
+}
+
+- (void)testLearntCapabilitiesAreSharedAndRemovable;
+{
+    [self connect];
+    [_session removeLearntServerCapabilities];
+    XCTAssertTrue([_session createDirectoryAtPath:[self pathForName:@"a/b"] withIntermediateDirectories:YES mode:0775 error:NULL]);
+    
+    // Remembered for the host, not the session
+    NSError *error;
+    CK2SFTPSession *other = [_pool checkOutSessionWithURL:_URL credential:_credential error:&error];
+    XCTAssertNotNil(other, @"%@", error);
+    XCTAssertEqualObjects([other serverCapabilities], [_session serverCapabilities]);
+    
+    [other removeLearntServerCapabilities];
+    XCTAssertEqual([[_session serverCapabilities] count], (NSUInteger)0);
+    [_pool checkInSession:other];
+    
+    XCTAssertTrue([_session createDirectoryAtPath:[self pathForName:@"c/d"] withIntermediateDirectories:YES mode:0775 error:NULL]);
+    XCTAssertNotEqual([[_session serverCapabilities] count], (NSUInteger)0);
+    [CK2SFTPSession removeAllLearntServerCapabilities];
+    XCTAssertEqual([[_session serverCapabilities] count], (NSUInteger)0);
+}
+
+#pragma mark Server Capabilities
+
+// With the bundled libssh2, older than 1.11, these go through the remove-and-retry fallback. With newer builds, posix-rename if the server supports it
+- (void)testOverwritingRenameReplacesDestination;
+{
+    [self connect];
+    
+    NSData *source = [@"source" dataUsingEncoding:NSUTF8StringEncoding];
+    [self writeData:source toPath:[self pathForName:@"a"]];
+    [self writeData:[@"destination" dataUsingEncoding:NSUTF8StringEncoding] toPath:[self pathForName:@"b"]];
+    
+    NSError *error;
+    XCTAssertTrue([_session moveItemAtPath:[self pathForName:@"a"] toPath:[self pathForName:@"b"] overwrite:YES error:&error], @"%@", error);
+    
+    XCTAssertEqualObjects([self dataAtPath:[self pathForName:@"b"]], source);
+    XCTAssertNil([_session attributesOfItemAtPath:[self pathForName:@"a"] error:NULL]);
+}
+
+- (void)testRenameOnlyReplacesWhenAsked;
+{
+    [self connect];
+    
+    NSData *destination = [@"destination" dataUsingEncoding:NSUTF8StringEncoding];
+    [self writeData:[@"source" dataUsingEncoding:NSUTF8StringEncoding] toPath:[self pathForName:@"a"]];
+    [self writeData:destination toPath:[self pathForName:@"b"]];
+    
+    XCTAssertFalse([_session moveItemAtPath:[self pathForName:@"a"] toPath:[self pathForName:@"b"] error:NULL]);
+    XCTAssertEqualObjects([self dataAtPath:[self pathForName:@"b"]], destination);
+    XCTAssertNotNil([_session attributesOfItemAtPath:[self pathForName:@"a"] error:NULL]);
+}
+
+- (void)testOverwritingRenameOntoSelfKeepsFile;
+{
+    [self connect];
+    
+    NSData *data = [@"data" dataUsingEncoding:NSUTF8StringEncoding];
+    [self writeData:data toPath:[self pathForName:@"a"]];
+    
+    // Whether or not the server treats this as success, the file mustn't be removed as if it were a separate destination
+    [_session moveItemAtPath:[self pathForName:@"a"] toPath:[self pathForName:@"a"] overwrite:YES error:NULL];
+    XCTAssertEqualObjects([self dataAtPath:[self pathForName:@"a"]], data);
+}
+
+- (void)testOverwritingRenameLeavesMissingSourceAlone;
+{
+    [self connect];
+    
+    NSData *destination = [@"destination" dataUsingEncoding:NSUTF8StringEncoding];
+    [self writeData:destination toPath:[self pathForName:@"b"]];
+    
+    // The rename fails for want of a source, not because of the destination, so that's no reason to remove it
+    XCTAssertFalse([_session moveItemAtPath:[self pathForName:@"a"] toPath:[self pathForName:@"b"] overwrite:YES error:NULL]);
+    XCTAssertEqualObjects([self dataAtPath:[self pathForName:@"b"]], destination);
+}
+
+- (void)testFileSystemAttributesOrUnsupported;
+{
+    [self connect];
+    [_session removeLearntServerCapabilities];
+    
+    NSError *error;
+    NSDictionary *attributes = [_session attributesOfFileSystemForPath:_directory error:&error];
+    NSNumber *supported = [[_session serverCapabilities] objectForKey:CK2SFTPCapabilityStatVFS];
+    
+    if (attributes)
+    {
+        XCTAssertEqualObjects(supported, [NSNumber numberWithBool:YES]);
+        XCTAssertGreaterThan([[attributes objectForKey:NSFileSystemSize] unsignedLongLongValue], 0ULL);
+        XCTAssertLessThanOrEqual([[attributes objectForKey:NSFileSystemFreeSize] unsignedLongLongValue], [[attributes objectForKey:NSFileSystemSize] unsignedLongLongValue]);
+    }
+    else
+    {
+        XCTAssertEqualObjects(supported, [NSNumber numberWithBool:NO]);
+        XCTAssertEqualObjects([error domain], CK2LibSSH2SFTPErrorDomain);
+        XCTAssertEqual([error code], (NSInteger)LIBSSH2_FX_OP_UNSUPPORTED);
+        
+        // Known now, so not asked again, but still reported the same way
+        XCTAssertNil([_session attributesOfFileSystemForPath:_directory error:&error]);
+        XCTAssertEqual([error code], (NSInteger)LIBSSH2_FX_OP_UNSUPPORTED);
+    }
+}
+
+#if LIBSSH2_VERSION_NUM >= 0x010404
+- (void)testSynchronizeLearnsFsyncSupport;
+{
+    [self connect];
+    [_session removeLearntServerCapabilities];
+    
+    NSError *error;
+    CK2SFTPFileHandle *handle = [_session openHandleAtPath:[self pathForName:@"file"] flags:(LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT) mode:0644 error:&error];
+    XCTAssertNotNil(handle, @"%@", error);
+    XCTAssertTrue([handle writeData:[self randomDataOfLength:10] error:&error], @"%@", error);
+    
+    // Unsupported isn't a failure
+    XCTAssertTrue([handle synchronizeFile:&error], @"%@", error);
+    XCTAssertNotNil([[_session serverCapabilities] objectForKey:CK2SFTPCapabilityFsync]);
+    XCTAssertTrue([handle closeFile:&error], @"%@", error);
+}
+#endif
+
+- (void)testCancelledSessionHasNoCapabilities;
+{
+    [self connect];
+    XCTAssertTrue([_session createDirectoryAtPath:[self pathForName:@"a/b"] withIntermediateDirectories:YES mode:0775 error:NULL]);
+    
+    NSError *error;
+    CK2SFTPSession *session = [_pool checkOutSessionWithURL:_URL credential:_credential error:&error];
+    XCTAssertNotNil(session, @"%@", error);
+    [session cancel];
+    
+    // With no host any more, there's nothing to report or remove, and the host's own capabilities are untouched
+    XCTAssertEqual([[session serverCapabilities] count], (NSUInteger)0);
+    [session removeLearntServerCapabilities];
+    XCTAssertNotEqual([[_session serverCapabilities] count], (NSUInteger)0);
+    
+    [_pool checkInSession:session];
+}
+
+#pragma mark Copying
+
+- (void)testCopyKeepsDataAndPermissions;
+{
+    [self connect];
+    
+    // Several windows' worth, so reads and writes overlap
+    NSData *data = [self randomDataOfLength:5 * CK2SFTPBufferLength + 17];
+    [self writeData:data toPath:[self pathForName:@"a"]];
+    
+    NSError *error;
+    XCTAssertTrue([_session setPermissions:0640 forItemAtPath:[self pathForName:@"a"] error:&error], @"%@", error);
+    XCTAssertTrue([_session copyItemAtPath:[self pathForName:@"a"] toPath:[self pathForName:@"b"] error:&error], @"%@", error);
+    
+    XCTAssertEqualObjects([self dataAtPath:[self pathForName:@"b"]], data);
+    XCTAssertEqual([[_session attributesOfItemAtPath:[self pathForName:@"b"] error:NULL] filePosixPermissions], (NSUInteger)0640);
+}
+
+- (void)testCopyOntoSelfKeepsSource;
+{
+    [self connect];
+    
+    NSData *data = [self randomDataOfLength:100000];
+    [self writeData:data toPath:[self pathForName:@"a"]];
+    
+    XCTAssertFalse([_session copyItemAtPath:[self pathForName:@"a"] toPath:[self pathForName:@"a"] overwrite:NO error:NULL]);
+    XCTAssertEqualObjects([self dataAtPath:[self pathForName:@"a"]], data);
+    
+    XCTAssertFalse([_session copyItemAtPath:[self pathForName:@"a"] toPath:[self pathForName:@"a"] overwrite:YES error:NULL]);
+    XCTAssertEqualObjects([self dataAtPath:[self pathForName:@"a"]], data);
+}
+
+- (void)testCopyDoesNotOverwriteUnlessAsked;
+{
+    [self connect];
+    
+    NSData *source = [self randomDataOfLength:100000];
+    NSData *destination = [@"destination" dataUsingEncoding:NSUTF8StringEncoding];
+    [self writeData:source toPath:[self pathForName:@"a"]];
+    [self writeData:destination toPath:[self pathForName:@"b"]];
+    
+    XCTAssertFalse([_session copyItemAtPath:[self pathForName:@"a"] toPath:[self pathForName:@"b"] error:NULL]);
+    XCTAssertEqualObjects([self dataAtPath:[self pathForName:@"b"]], destination);
+    
+    NSError *error;
+    XCTAssertTrue([_session copyItemAtPath:[self pathForName:@"a"] toPath:[self pathForName:@"b"] overwrite:YES error:&error], @"%@", error);
+    XCTAssertEqualObjects([self dataAtPath:[self pathForName:@"b"]], source);
+}
+
+- (void)testFailedCopyLeavesNothingBehind;
+{
+    [self connect];
+    
+    NSError *error;
+    XCTAssertFalse([_session copyItemAtPath:[self pathForName:@"missing"] toPath:[self pathForName:@"b"] error:&error]);
+    XCTAssertNotNil(error);
+    XCTAssertNil([_session attributesOfItemAtPath:[self pathForName:@"b"] error:NULL]);
+}
+
+#pragma mark Seeking and Resuming
+
+- (void)testSeekingReadsAndWritesAtOffset;
+{
+    [self connect];
+    
+    NSString *path = [self pathForName:@"file"];
+    NSMutableData *data = [[self randomDataOfLength:3 * CK2SFTPPreferredChunkSize] mutableCopy];
+    [self writeData:data toPath:path];
+    
+    NSError *error;
+    CK2SFTPFileHandle *handle = [_session openHandleAtPath:path flags:(LIBSSH2_FXF_READ | LIBSSH2_FXF_WRITE) mode:0 error:&error];
+    XCTAssertNotNil(handle, @"%@", error);
+    
+    XCTAssertEqual([handle seekToEndOfFile], (unsigned long long)[data length]);
+    
+    XCTAssertTrue([handle seekToFileOffset:CK2SFTPPreferredChunkSize + 5 error:&error], @"%@", error);
+    XCTAssertEqual([handle offsetInFile], (unsigned long long)CK2SFTPPreferredChunkSize + 5);
+    XCTAssertEqualObjects([handle readDataOfLength:100 error:&error], [data subdataWithRange:NSMakeRange(CK2SFTPPreferredChunkSize + 5, 100)]);
+    XCTAssertEqual([handle offsetInFile], (unsigned long long)CK2SFTPPreferredChunkSize + 105);
+    
+    // Seeking away sends a queued write first, so it lands where it was made
+    NSData *patch = [self randomDataOfLength:10];
+    [handle setMaximumWriteBytesInFlight:CK2SFTPBufferLength];
+    XCTAssertTrue([handle seekToFileOffset:7 error:&error], @"%@", error);
+    XCTAssertTrue([handle writeData:patch error:&error], @"%@", error);
+    XCTAssertTrue([handle seekToFileOffset:0 error:&error], @"%@", error);
+    XCTAssertTrue([handle closeFile:&error], @"%@", error);
+    
+    [data replaceBytesInRange:NSMakeRange(7, [patch length]) withBytes:[patch bytes]];
+    XCTAssertEqualObjects([self dataAtPath:path], data);
+}
+
+- (void)testResumesPartialDownload;
+{
+    [self connect];
+    
+    NSData *data = [self randomDataOfLength:3 * CK2SFTPBufferLength];
+    [self writeData:data toPath:[self pathForName:@"file"]];
+    
+    NSURL *localURL = [self temporaryFileURL];
+    XCTAssertTrue([[data subdataWithRange:NSMakeRange(0, CK2SFTPBufferLength)] writeToURL:localURL atomically:NO]);
+    
+    CK2SFTPTransferQueue *queue = [[CK2SFTPTransferQueue alloc] initWithURL:_URL credential:_credential pool:_pool];
+    [queue setResumesPartialTransfers:YES];
+    [queue addDownloadOfItemAtPath:[self pathForName:@"file"] size:[data length] toURL:localURL];
+    
+    NSError *error;
+    XCTAssertTrue([queue transferAndWaitUntilFinished:&error], @"%@", error);
+    XCTAssertEqualObjects([NSData dataWithContentsOfURL:localURL], data);
+    
+    [[NSFileManager defaultManager] removeItemAtURL:localURL error:NULL];
+}
+
+- (void)testRestartsWhenPartialFileDiffers;
+{
+    [self connect];
+    
+    NSData *data = [self randomDataOfLength:3 * CK2SFTPBufferLength];
+    [self writeData:data toPath:[self pathForName:@"file"]];
+    
+    // Right length for a partial download, but not the same data
+    NSURL *localURL = [self temporaryFileURL];
+    XCTAssertTrue([[self randomDataOfLength:CK2SFTPBufferLength] writeToURL:localURL atomically:NO]);
+    
+    CK2SFTPTransferQueue *queue = [[CK2SFTPTransferQueue alloc] initWithURL:_URL credential:_credential pool:_pool];
+    [queue setResumesPartialTransfers:YES];
+    [queue addDownloadOfItemAtPath:[self pathForName:@"file"] size:[data length] toURL:localURL];
+    
+    NSError *error;
+    XCTAssertTrue([queue transferAndWaitUntilFinished:&error], @"%@", error);
+    XCTAssertEqualObjects([NSData dataWithContentsOfURL:localURL], data);
+    
+    [[NSFileManager defaultManager] removeItemAtURL:localURL error:NULL];
+}
+
+- (void)testResumesPartialUpload;
+{
+    [self connect];
+    
+    NSData *data = [self randomDataOfLength:3 * CK2SFTPBufferLength];
+    NSURL *localURL = [self temporaryFileURL];
+    XCTAssertTrue([data writeToURL:localURL atomically:NO]);
+    [self writeData:[data subdataWithRange:NSMakeRange(0, CK2SFTPBufferLength + 1)] toPath:[self pathForName:@"file"]];
+    
+    CK2SFTPTransferQueue *queue = [[CK2SFTPTransferQueue alloc] initWithURL:_URL credential:_credential pool:_pool];
+    [queue setResumesPartialTransfers:YES];
+    [queue addUploadOfItemAtURL:localURL toPath:[self pathForName:@"file"] mode:0644];
+    
+    NSError *error;
+    XCTAssertTrue([queue transferAndWaitUntilFinished:&error], @"%@", error);
+    XCTAssertEqualObjects([self dataAtPath:[self pathForName:@"file"]], data);
+    
+    [[NSFileManager defaultManager] removeItemAtURL:localURL error:NULL];
+}
+
+#pragma mark Uploading from Files
+
+- (void)testUploadsFileFromOffset;
+{
+    [self connect];
+    
+    NSData *data = [self randomDataOfLength:4 * CK2SFTPBufferLength + 3];
+    NSURL *localURL = [self temporaryFileURL];
+    XCTAssertTrue([data writeToURL:localURL atomically:NO]);
+    
+    for (NSNumber *anOffset in [NSArray arrayWithObjects:[NSNumber numberWithUnsignedInteger:0], [NSNumber numberWithUnsignedInteger:CK2SFTPBufferLength + 1], nil])
+    {
+        NSUInteger offset = [anOffset unsignedIntegerValue];
+        NSString *path = [self pathForName:[anOffset stringValue]];
+        
+        NSError *error;
+        CK2SFTPFileHandle *handle = [_session openHandleAtPath:path flags:(LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC) mode:0644 error:&error];
+        XCTAssertNotNil(handle, @"%@", error);
+        
+        __block unsigned long long written = 0;
+        XCTAssertTrue([handle writeContentsOfURL:localURL fromOffset:offset progressHandler:^(NSUInteger bytesWritten) {
+            written += bytesWritten;
+        } error:&error], @"%@", error);
+        XCTAssertTrue([handle closeFile:&error], @"%@", error);
+        
+        XCTAssertEqual(written, (unsigned long long)([data length] - offset));
+        XCTAssertEqualObjects([self dataAtPath:path], [data subdataWithRange:NSMakeRange(offset, [data length] - offset)]);
+    }
+    
+    [[NSFileManager defaultManager] removeItemAtURL:localURL error:NULL];
+}
+
+- (void)testUploadDeeperThanPooledBuffer;
+{
+    [self connect];
+    
+    NSData *data = [self randomDataOfLength:8 * CK2SFTPBufferLength];
+    NSURL *localURL = [self temporaryFileURL];
+    XCTAssertTrue([data writeToURL:localURL atomically:NO]);
+    
+    // More in flight than a pooled buffer holds, so the upload switches to one of its own
+    NSError *error;
+    CK2SFTPFileHandle *handle = [_session openHandleAtPath:[self pathForName:@"file"] flags:(LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC) mode:0644 error:&error];
+    XCTAssertNotNil(handle, @"%@", error);
+    [handle setMaximumWriteBytesInFlight:4 * CK2SFTPBufferLength];
+    
+    XCTAssertTrue([handle writeContentsOfURL:localURL fromOffset:0 progressHandler:nil error:&error], @"%@", error);
+    XCTAssertTrue([handle closeFile:&error], @"%@", error);
+    XCTAssertEqualObjects([self dataAtPath:[self pathForName:@"file"]], data);
+    
+    [[NSFileManager defaultManager] removeItemAtURL:localURL error:NULL];
+}
+
+- (void)testUploadFromMissingFileFails;
+{
+    [self connect];
+    
+    NSURL *localURL = [self temporaryFileURL];
+    NSError *error;
+    CK2SFTPFileHandle *handle = [_session openHandleAtPath:[self pathForName:@"file"] flags:(LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC) mode:0644 error:&error];
+    XCTAssertNotNil(handle, @"%@", error);
+    
+    XCTAssertFalse([handle writeContentsOfURL:localURL fromOffset:0 progressHandler:nil error:&error]);
+    XCTAssertEqualObjects([error domain], NSPOSIXErrorDomain);
+    XCTAssertEqual([error code], (NSInteger)ENOENT);
+    XCTAssertEqualObjects([[error userInfo] objectForKey:NSURLErrorKey], localURL);
+    [handle closeFile];
+}
+
+#pragma mark Downloading into Files
+
+- (void)testDownloadsIntoFile;
+{
+    [self connect];
+    
+    NSData *data = [self randomDataOfLength:5 * CK2SFTPBufferLength + 1];
+    [self writeData:data toPath:[self pathForName:@"file"]];
+    
+    // Replacing whatever's already there, even if longer
+    NSURL *localURL = [self temporaryFileURL];
+    XCTAssertTrue([[self randomDataOfLength:[data length] + 100] writeToURL:localURL atomically:NO]);
+    
+    NSError *error;
+    XCTAssertTrue([_session downloadItemAtPath:[self pathForName:@"file"] toURL:localURL error:&error], @"%@", error);
+    XCTAssertEqualObjects([NSData dataWithContentsOfURL:localURL], data);
+    
+    [[NSFileManager defaultManager] removeItemAtURL:localURL error:NULL];
+}
+
+- (void)testReadsToEndWhateverLengthWasExpected;
+{
+    [self connect];
+    
+    NSData *data = [self randomDataOfLength:2 * CK2SFTPBufferLength];
+    [self writeData:data toPath:[self pathForName:@"file"]];
+    
+    NSData *prefix = [@"prefix" dataUsingEncoding:NSUTF8StringEncoding];
+    NSMutableData *expected = [NSMutableData dataWithData:prefix];
+    [expected appendData:data];
+    
+    // Expecting less, as if the file grew since it was measured, and more, as if it shrank. Either way, what's before offset is kept
+    for (NSNumber *aLength in [NSArray arrayWithObjects:[NSNumber numberWithUnsignedInteger:CK2SFTPBufferLength / 2], [NSNumber numberWithUnsignedInteger:4 * CK2SFTPBufferLength], nil])
+    {
+        NSURL *localURL = [self temporaryFileURL];
+        XCTAssertTrue([prefix writeToURL:localURL atomically:NO]);
+        
+        NSError *error;
+        CK2SFTPFileHandle *handle = [_session openHandleAtPath:[self pathForName:@"file"] flags:LIBSSH2_FXF_READ mode:0 error:&error];
+        XCTAssertNotNil(handle, @"%@", error);
+        
+        __block unsigned long long received = 0;
+        XCTAssertTrue([handle readIntoFileAtURL:localURL offset:[prefix length] length:[aLength unsignedLongLongValue] progressHandler:^(NSUInteger bytesRead) {
+            received += bytesRead;
+        } error:&error], @"%@", error);
+        [handle closeFile];
+        
+        XCTAssertEqual(received, (unsigned long long)[data length]);
+        XCTAssertEqualObjects([NSData dataWithContentsOfURL:localURL], expected, @"expecting %@ bytes", aLength);
+        [[NSFileManager defaultManager] removeItemAtURL:localURL error:NULL];
+    }
+}
+
+- (void)testResumeAfterFailedDownload;
+{
+    [self connect];
+    
+    NSData *data = [self randomDataOfLength:(32 * 1024 * 1024)];
+    [self writeData:data toPath:[self pathForName:@"large"]];
+    
+    NSURL *localURL = [self temporaryFileURL];
+    
+    // Fail the download partway through, by having the next wait on the server time out straight away
+    NSError *error;
+    CK2SFTPFileHandle *handle = [_session openHandleAtPath:[self pathForName:@"large"] flags:LIBSSH2_FXF_READ mode:0 error:&error];
+    XCTAssertNotNil(handle, @"%@", error);
+    
+    NSTimeInterval timeout = [_session timeout];
+    __block unsigned long long received = 0;
+    CK2SFTPSession *session = _session;
+    
+    BOOL result = [handle readIntoFileAtURL:localURL offset:0 length:[data length] progressHandler:^(NSUInteger bytesRead) {
+        received += bytesRead;
+        [session setTimeout:0.000001];
+    } error:&error];
+    
+    [_session setTimeout:timeout];
+    [handle closeFile];
+    
+    XCTAssertFalse(result, @"The download should have timed out");
+    XCTAssertTrue(received > 0 && received < [data length]);
+    
+    // Only what arrived is left behind, so it can't be mistaken for the whole file
+    NSNumber *partialSize;
+    XCTAssertTrue([localURL getResourceValue:&partialSize forKey:NSURLFileSizeKey error:&error], @"%@", error);
+    XCTAssertEqual([partialSize unsignedLongLongValue], received);
+    XCTAssertEqualObjects([NSData dataWithContentsOfURL:localURL], [data subdataWithRange:NSMakeRange(0, (NSUInteger)received)]);
+    
+    // The session's in no state to be reused after timing out, so disconnect it
+    [session cancel];
+    [_pool checkInSession:session];
+    _session = [_pool checkOutSessionWithURL:_URL credential:_credential error:&error];
+    XCTAssertNotNil(_session, @"%@", error);
+    
+    CK2SFTPTransferQueue *queue = [[CK2SFTPTransferQueue alloc] initWithURL:_URL credential:_credential pool:_pool];
+    [queue setResumesPartialTransfers:YES];
+    [queue addDownloadOfItemAtPath:[self pathForName:@"large"] size:[data length] toURL:localURL];
+    XCTAssertTrue([queue transferAndWaitUntilFinished:&error], @"%@", error);
+    
+    XCTAssertEqualObjects([NSData dataWithContentsOfURL:localURL], data);
+    [[NSFileManager defaultManager] removeItemAtURL:localURL error:NULL];
+}
+
+#pragma mark Buffers
+
+- (CK2SFTPSession *)unstartedSession;
+{
+    return [[CK2SFTPSession alloc] initWithURL:[NSURL URLWithString:@"sftp://example.com/"] delegate:nil startImmediately:NO];
+}
+
+- (void)testReturnedBuffersAreRecycled;
+{
+    CK2SFTPSession *session = [self unstartedSession];
+    
+    void *buffer = [session borrowBuffer];
+    XCTAssertTrue(buffer != NULL);
+    memset(buffer, 0xAB, CK2SFTPBufferLength);  // the full length is ours to use
+    [session returnBuffer:buffer];
+    
+    XCTAssertTrue([session borrowBuffer] == buffer);
+    [session returnBuffer:buffer];
+    
+    // Returning nothing is harmless
+    [session returnBuffer:NULL];
+}
+
+- (void)testBuffersAreNeverLentTwice;
+{
+    CK2SFTPSession *session = [self unstartedSession];
+    
+    // More at once than the pool keeps, so some are freshly allocated, and some freed again on return
+    NSUInteger count = 32;
+    void **buffers = calloc(count, sizeof(void *));
+    dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        buffers[i] = [session borrowBuffer];
+    });
+    
+    NSMutableSet *distinct = [NSMutableSet set];
+    for (NSUInteger i = 0; i < count; i++)
+    {
+        XCTAssertTrue(buffers[i] != NULL);
+        [distinct addObject:[NSValue valueWithPointer:buffers[i]]];
+    }
+    XCTAssertEqual([distinct count], count);
+    
+    dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        [session returnBuffer:buffers[i]];
+    });
+    free(buffers);
+}
+
+- (void)testChannelsShareBuffers;
+{
+    [self connect];
+    
+    NSError *error;
+    CK2SFTPSession *channel = [_session openSFTPChannel:&error];
+    XCTAssertNotNil(channel, @"%@", error);
+    
+    void *buffer = [channel borrowBuffer];
+    [channel returnBuffer:buffer];
+    XCTAssertTrue([_session borrowBuffer] == buffer);
+    [_session returnBuffer:buffer];
+    
+    [channel cancel];
+}
+
+#pragma mark Adaptive Pipelining
+
+- (void)testAdaptingKeepsDepthWithinBounds;
+{
+    [self connect];
+    
+    NSData *data = [self randomDataOfLength:16 * CK2SFTPBufferLength];
+    [self writeData:data toPath:[self pathForName:@"file"]];
+    
+    NSError *error;
+    CK2SFTPFileHandle *handle = [_session openHandleAtPath:[self pathForName:@"file"] flags:LIBSSH2_FXF_READ mode:0 error:&error];
+    XCTAssertNotNil(handle, @"%@", error);
+    XCTAssertFalse([handle adaptsPipelineDepth]);
+    XCTAssertEqual([handle measuredThroughput], 0.0);
+    
+    [handle setAdaptsPipelineDepth:YES];
+    XCTAssertEqualObjects([handle readDataToEndOfFile:&error], data);
+    XCTAssertTrue([handle closeFile:&error], @"%@", error);
+    
+    // Only ever deepened, and never beyond the limit
+    XCTAssertGreaterThanOrEqual([handle readWindow], (NSUInteger)CK2SFTPDefaultReadWindow);
+    XCTAssertLessThanOrEqual([handle readWindow], (NSUInteger)CK2SFTPMaximumPipelineDepth);
+    XCTAssertGreaterThan([handle measuredThroughput], 0.0);
+}
+
+- (void)testAdaptingUploadLeavesUnpipelinedWritesAlone;
+{
+    [self connect];
+    
+    NSData *data = [self randomDataOfLength:16 * CK2SFTPBufferLength];
+    NSURL *localURL = [self temporaryFileURL];
+    XCTAssertTrue([data writeToURL:localURL atomically:NO]);
+    
+    NSError *error;
+    CK2SFTPFileHandle *handle = [_session openHandleAtPath:[self pathForName:@"file"] flags:(LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC) mode:0644 error:&error];
+    XCTAssertNotNil(handle, @"%@", error);
+    [handle setAdaptsPipelineDepth:YES];
+    
+    // Uploading a file pipelines regardless, but mustn't switch later writes into queueing
+    XCTAssertTrue([handle writeContentsOfURL:localURL fromOffset:0 progressHandler:nil error:&error], @"%@", error);
+    XCTAssertEqual([handle maximumWriteBytesInFlight], (NSUInteger)0);
+    XCTAssertTrue([handle closeFile:&error], @"%@", error);
+    
+    // Whereas once queueing, what's learnt carries over
+    handle = [_session openHandleAtPath:[self pathForName:@"file"] flags:(LIBSSH2_FXF_WRITE | LIBSSH2_FXF_TRUNC) mode:0 error:&error];
+    XCTAssertNotNil(handle, @"%@", error);
+    [handle setAdaptsPipelineDepth:YES];
+    [handle setMaximumWriteBytesInFlight:CK2SFTPPreferredChunkSize];
+    
+    XCTAssertTrue([handle writeContentsOfURL:localURL fromOffset:0 progressHandler:nil error:&error], @"%@", error);
+    XCTAssertGreaterThanOrEqual([handle maximumWriteBytesInFlight], (NSUInteger)(CK2SFTPDefaultReadWindow * CK2SFTPPreferredChunkSize));
+    XCTAssertLessThanOrEqual([handle maximumWriteBytesInFlight], (NSUInteger)(CK2SFTPMaximumPipelineDepth * CK2SFTPPreferredChunkSize));
+    XCTAssertTrue([handle closeFile:&error], @"%@", error);
+    
+    XCTAssertEqualObjects([self dataAtPath:[self pathForName:@"file"]], data);
+    [[NSFileManager defaultManager] removeItemAtURL:localURL error:NULL];
+}
+
+#pragma mark Receive Window
+
+- (void)testLargeReceiveWindowDownloadsIntact;
+{
+    [self connect];
+    XCTAssertEqual([_session receiveWindowSize], 0UL);
+    
+    NSData *data = [self randomDataOfLength:16 * CK2SFTPBufferLength];
+    [self writeData:data toPath:[self pathForName:@"file"]];
+    
+    [_session setReceiveWindowSize:CK2SFTPHighBandwidthDelayReceiveWindow];
+    
+    // Channels opened afterwards inherit it
+    NSError *error;
+    CK2SFTPSession *channel = [_session openSFTPChannel:&error];
+    XCTAssertNotNil(channel, @"%@", error);
+    XCTAssertEqual([channel receiveWindowSize], (unsigned long)CK2SFTPHighBandwidthDelayReceiveWindow);
+    
+    for (CK2SFTPSession *aSession in [NSArray arrayWithObjects:_session, channel, nil])
+    {
+        CK2SFTPFileHandle *handle = [aSession openHandleAtPath:[self pathForName:@"file"] flags:LIBSSH2_FXF_READ mode:0 error:&error];
+        XCTAssertNotNil(handle, @"%@", error);
+        [handle setReadWindow:4 * CK2SFTPDefaultReadWindow];
+        XCTAssertEqualObjects([handle readDataToEndOfFile:&error], data, @"%@", error);
+        [handle closeFile];
+    }
+    
+    [channel cancel];
+}
+
+#pragma mark Resolving and Connecting
+
+- (void)testUnresolvableHostFailsPromptly;
+{
+    // .invalid is guaranteed never to resolve
+    NSURL *URL = [NSURL URLWithString:@"sftp://user@ck2sftptests.invalid/"];
+    NSURLCredential *credential = [NSURLCredential credentialWithUser:@"user" password:@"password" persistence:NSURLCredentialPersistenceNone];
+    
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    NSError *error;
+    XCTAssertNil([_pool checkOutSessionWithURL:URL credential:credential error:&error]);
+    XCTAssertEqualObjects([error domain], NSURLErrorDomain);
+    XCTAssertEqual([error code], (NSInteger)NSURLErrorCannotFindHost);
+    
+    // Bounded by the resolver, not a connection timeout
+    XCTAssertLessThan(CFAbsoluteTimeGetCurrent() - start, 30.0);
+}
+
+- (void)testResolvedAddressesAreReused;
+{
+    [self connect];
+    
+    // Connecting again straight away goes to the addresses already found, starting with the one that worked
+    NSError *error;
+    CK2SFTPSession *other = [_pool checkOutSessionWithURL:_URL credential:_credential error:&error];
+    XCTAssertNotNil(other, @"%@", error);
+    XCTAssertLessThan([[other connectionTimings] resolutionDuration], 0.05);
+    [_pool checkInSession:other];
+}
+
+#pragma mark Connection Timings
+
+- (void)testConnectionTimingsAreRecorded;
+{
+    [self connect];
+    
+    SFTPTestsDelegate *delegate = [[SFTPTestsDelegate alloc] initWithCredential:_credential];
+    CK2SFTPSession *session = [[CK2SFTPSession alloc] initWithURL:_URL delegate:delegate startImmediately:YES];
+    XCTAssertTrue([delegate initialized], @"%@", [delegate error]);
+    
+    // Handed to the delegate as well
+    CK2SFTPConnectionTimings *timings = [session connectionTimings];
+    XCTAssertNotNil(timings);
+    XCTAssertEqual([delegate recordedTimings], timings);
+    
+    XCTAssertGreaterThanOrEqual([timings resolutionDuration], 0.0);
+    XCTAssertGreaterThan([timings connectDuration], 0.0);
+    XCTAssertGreaterThan([timings handshakeDuration], 0.0);
+    XCTAssertGreaterThan([timings SFTPInitializationDuration], 0.0);
+    
+    // Whatever failed along the way, the last attempt is the one which got in
+    NSArray *attempts = [timings authenticationAttempts];
+    XCTAssertGreaterThan([attempts count], (NSUInteger)0);
+    XCTAssertEqualObjects([[attempts lastObject] objectForKey:CK2SFTPTimingSucceededKey], [NSNumber numberWithBool:YES]);
+    
+    NSArray *schemes = [NSArray arrayWithObjects:CK2SSHAuthenticationSchemePublicKey, CK2SSHAuthenticationSchemeKeyboardInteractive, CK2SSHAuthenticationSchemePassword, nil];
+    for (NSDictionary *anAttempt in attempts)
+    {
+        XCTAssertTrue([schemes containsObject:[anAttempt objectForKey:CK2SFTPTimingAuthenticationSchemeKey]], @"%@", anAttempt);
+        XCTAssertGreaterThanOrEqual([[anAttempt objectForKey:CK2SFTPTimingDurationKey] doubleValue], 0.0);
+    }
+    
+    // Channels don't connect, so have nothing to report
+    NSError *error;
+    CK2SFTPSession *channel = [session openSFTPChannel:&error];
+    XCTAssertNotNil(channel, @"%@", error);
+    XCTAssertNil([channel connectionTimings]);
+    
+    [session cancel];
+}
+
+- (void)testFailedConnectionReportsTimings;
+{
+    [self connect];
+    
+    NSURLCredential *credential = [NSURLCredential credentialWithUser:[_URL user] password:@"not the password" persistence:NSURLCredentialPersistenceNone];
+    SFTPTestsDelegate *delegate = [[SFTPTestsDelegate alloc] initWithCredential:credential];
+    CK2SFTPSession *session = [[CK2SFTPSession alloc] initWithURL:_URL delegate:delegate startImmediately:YES];
+    XCTAssertFalse([delegate initialized]);
+    
+    // Reported even though connecting failed, with no attempt having succeeded
+    XCTAssertNotNil([delegate recordedTimings]);
+    for (NSDictionary *anAttempt in [[delegate recordedTimings] authenticationAttempts])
+    {
+        XCTAssertEqualObjects([anAttempt objectForKey:CK2SFTPTimingSucceededKey], [NSNumber numberWithBool:NO]);
+    }
+    
+    [session cancel];
+}
+
+#pragma mark SSH-Agent
+
+// ssh-add only runs ahead of the first agent login in the process. Later ones, and ones where it couldn't be run at all, go with whatever identities the agent already holds
+- (void)testAgentAuthenticationRepeats;
+{
+    [self connect];
+    XCTSkipUnless([[[NSProcessInfo processInfo] environment] objectForKey:@"SSH_AUTH_SOCK"] != nil, @"Needs SSH-Agent running");
+    
+    NSURLCredential *credential = [NSURLCredential ck2_SSHAgentCredentialWithUser:[_URL user]];
+    
+    for (NSUInteger i = 0; i < 2; i++)
+    {
+        SFTPTestsDelegate *delegate = [[SFTPTestsDelegate alloc] initWithCredential:credential];
+        CK2SFTPSession *session = [[CK2SFTPSession alloc] initWithURL:_URL delegate:delegate startImmediately:YES];
+        XCTAssertTrue([delegate initialized], @"%@", [delegate error]);
+        
+        NSDictionary *attempt = [[[session connectionTimings] authenticationAttempts] lastObject];
+        XCTAssertEqualObjects([attempt objectForKey:CK2SFTPTimingAuthenticationSchemeKey], CK2SSHAuthenticationSchemePublicKey);
+        
+        [session cancel];
+    }
+}
+
+#pragma mark Authentication Memos
+
+- (CK2SFTPConnectionTimings *)timingsOfLoginWithCredential:(NSURLCredential *)credential;
+{
+    SFTPTestsDelegate *delegate = [[SFTPTestsDelegate alloc] initWithCredential:credential];
+    CK2SFTPSession *session = [[CK2SFTPSession alloc] initWithURL:_URL delegate:delegate startImmediately:YES];
+    XCTAssertTrue([delegate initialized], @"%@", [delegate error]);
+    
+    CK2SFTPConnectionTimings *result = [session connectionTimings];
+    [session cancel];
+    return result;
+}
+
+// Once a password has got in, the next login goes straight to that scheme without asking the server which it supports
+- (void)testRememberedSchemeSkipsAskingServer;
+{
+    [self connect];
+    XCTSkipUnless([_credential password] != nil, @"Set CK2SFTPTestPassword to test password logins");
+    
+    [CK2SFTPSession removeAllAuthenticationMemos];
+    
+    CK2SFTPConnectionTimings *timings = [self timingsOfLoginWithCredential:_credential];
+    XCTAssertGreaterThan([timings authenticationListDuration], 0.0);
+    
+    timings = [self timingsOfLoginWithCredential:_credential];
+    XCTAssertEqual([timings authenticationListDuration], 0.0);
+    XCTAssertEqual([[timings authenticationAttempts] count], (NSUInteger)1);
+    
+    // Forgetting the host means asking again
+    [_session removeAuthenticationMemos];
+    timings = [self timingsOfLoginWithCredential:_credential];
+    XCTAssertGreaterThan([timings authenticationListDuration], 0.0);
+    
+    [CK2SFTPSession removeAllAuthenticationMemos];
+    timings = [self timingsOfLoginWithCredential:_credential];
+    XCTAssertGreaterThan([timings authenticationListDuration], 0.0);
+}
+
+// A wrong password mustn't be mistaken for the server having changed what it accepts, nor spoil the memo for the right one
+- (void)testWrongPasswordKeepsMemo;
+{
+    [self connect];
+    XCTSkipUnless([_credential password] != nil, @"Set CK2SFTPTestPassword to test password logins");
+    
+    [self timingsOfLoginWithCredential:_credential];
+    
+    NSURLCredential *wrong = [NSURLCredential credentialWithUser:[_URL user] password:@"not the password" persistence:NSURLCredentialPersistenceNone];
+    SFTPTestsDelegate *delegate = [[SFTPTestsDelegate alloc] initWithCredential:wrong];
+    CK2SFTPSession *session = [[CK2SFTPSession alloc] initWithURL:_URL delegate:delegate startImmediately:YES];
+    XCTAssertFalse([delegate initialized]);
+    [session cancel];
+    
+    CK2SFTPConnectionTimings *timings = [self timingsOfLoginWithCredential:_credential];
+    XCTAssertEqual([timings authenticationListDuration], 0.0);
+    XCTAssertEqual([[timings authenticationAttempts] count], (NSUInteger)1);
+}
+
+// With several identities in the agent, the next login starts with whichever got in last time
+- (void)testRememberedAgentIdentityIsTriedFirst;
+{
+    [self connect];
+    XCTSkipUnless([[[NSProcessInfo processInfo] environment] objectForKey:@"SSH_AUTH_SOCK"] != nil, @"Needs SSH-Agent running");
+    
+    NSURLCredential *credential = [NSURLCredential ck2_SSHAgentCredentialWithUser:[_URL user]];
+    [CK2SFTPSession removeAllAuthenticationMemos];
+    [self timingsOfLoginWithCredential:credential];
+    
+    CK2SFTPConnectionTimings *timings = [self timingsOfLoginWithCredential:credential];
+    XCTAssertEqual([[timings authenticationAttempts] count], (NSUInteger)1);
+    
+    [CK2SFTPSession removeAllAuthenticationMemos];
+}
+
+#pragma mark Private Key Cache
+
+#if LIBSSH2_VERSION_NUM >= 0x010600
+
+// Once a key file has been read, reconnecting uses the copy in memory, so even a key that's since gone away still gets in
+- (void)testReconnectingDoesntRereadKeyFile;
+{
+    [self connect];
+    
+    NSString *keyPath = [[[NSProcessInfo processInfo] environment] objectForKey:@"CK2SFTPTestPrivateKey"];
+    XCTSkipUnless(keyPath != nil, @"Set CK2SFTPTestPrivateKey to an unencrypted private key the server accepts");
+    
+    NSURL *keyURL = [self temporaryFileURL];
+    NSError *error;
+    XCTAssertTrue([[NSFileManager defaultManager] copyItemAtURL:[NSURL fileURLWithPath:keyPath] toURL:keyURL error:&error], @"%@", error);
+    
+    [CK2SFTPSession removeAllCachedPrivateKeys];
+    NSURLCredential *credential = [NSURLCredential ck2_credentialWithUser:[_URL user] publicKeyURL:nil privateKeyURL:keyURL];
+    [self timingsOfLoginWithCredential:credential];
+    
+    XCTAssertTrue([[NSFileManager defaultManager] removeItemAtURL:keyURL error:&error], @"%@", error);
+    [self timingsOfLoginWithCredential:credential];
+    
+    // Without the cache, there's nothing left to log in with
+    [CK2SFTPSession removeAllCachedPrivateKeys];
+    SFTPTestsDelegate *delegate = [[SFTPTestsDelegate alloc] initWithCredential:credential];
+    CK2SFTPSession *session = [[CK2SFTPSession alloc] initWithURL:_URL delegate:delegate startImmediately:YES];
+    XCTAssertFalse([delegate initialized]);
+    [session cancel];
+}
+
+#endif
+
+@end